@@ -0,0 +1,407 @@
+/*
+================================================================================
+EXT2 PARSER MICROBENCHMARKS - LAB 13
+================================================================================
+
+Generates a synthetic image with ImageGenerator (ext2_imagegen.h) and times
+the EXT2Parser library on it:
+- path lookups per second (path resolution plus inode read)
+- directory entries per second (one pass over /huge)
+- extraction MB/s for a fully allocated and a sparse file
+
+Each benchmark runs twice. The cold pass uses a freshly opened parser after
+the image has been dropped from the OS page cache; the warm pass repeats the
+work on the same parser, with its block, run and name caches populated.
+
+With --verify nothing is timed: /large.bin and /sparse.bin are extracted and
+every block of the copies is checked against the generator's stamps, which
+is how the 64-bit read path is tested on images past 4 GB (make test-large).
+
+Usage: myfs-bench [options] <image>
+
+Author: Fatima
+Course: Operating Systems - Lab 13
+Date: January 2026
+================================================================================
+*/
+
+#include "ext2_imagegen.h"
+#include <chrono>
+
+using namespace std;
+using namespace ext2;
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define BENCH_LOOKUPS 10000         // Paths resolved per pass
+
+// ============================================================================
+// HELPERS
+// ============================================================================
+
+static double nowSeconds() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Evict the image from the page cache so the next pass reads from disk.
+// The image was fsynced when generated, so its pages are clean and the
+// kernel can drop them without privileges.
+static void dropPageCache(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+struct BenchOptions {
+    ImageSpec spec;
+    uint32_t lookups;
+    bool use_mmap;
+    bool keep_image;
+    bool generate_only;
+    bool verify;
+    
+    BenchOptions()
+        : lookups(BENCH_LOOKUPS), use_mmap(true), keep_image(false), generate_only(false),
+          verify(false) {}
+};
+
+// ============================================================================
+// BENCHMARKS
+// ============================================================================
+
+class Benchmark {
+private:
+    string image_path;
+    BenchOptions options;
+    vector<string> sample;          // Paths to resolve
+    
+    // Parser on the image; a cold parser starts with nothing cached anywhere
+    unique_ptr<EXT2Parser> openParser(bool cold) {
+        if (cold) {
+            dropPageCache(image_path);
+        }
+        
+        unique_ptr<EXT2Parser> parser(new EXT2Parser());
+        parser->setUseMmap(options.use_mmap);
+        parser->setUseIndex(false);
+        if (!parser->open(image_path)) {
+            return unique_ptr<EXT2Parser>();
+        }
+        return parser;
+    }
+    
+    // Lookups per second
+    double runLookups(EXT2Parser& parser) {
+        double start = nowSeconds();
+        for (const string& path : sample) {
+            uint32_t inode_num;
+            ext2_inode inode;
+            if (!parser.lookupPath(path, inode_num) || !parser.getInode(inode_num, inode)) {
+                cerr << "Error: Lookup failed: " << path << endl;
+                return 0;
+            }
+        }
+        return sample.size() / (nowSeconds() - start);
+    }
+    
+    // Entries per second over one directory
+    double runDirectory(EXT2Parser& parser, const string& path) {
+        uint32_t dir_inode_num;
+        if (!parser.lookupPath(path, dir_inode_num)) {
+            return 0;
+        }
+        
+        uint64_t entries = 0;
+        double start = nowSeconds();
+        if (!parser.forEachEntry(dir_inode_num, [&](const DirEntryView&) {
+                entries++;
+                return true;
+            })) {
+            cerr << "Error: Failed to read directory " << path << endl;
+            return 0;
+        }
+        return entries / (nowSeconds() - start);
+    }
+    
+    // MB/s of file size extracted
+    double runExtract(EXT2Parser& parser, const string& path) {
+        uint32_t inode_num;
+        if (!parser.lookupPath(path, inode_num)) {
+            return 0;
+        }
+        
+        string output_path = image_path + ".out";
+        uint64_t written = 0;
+        double start = nowSeconds();
+        bool ok = parser.extractFile(inode_num, output_path, written);
+        double elapsed = nowSeconds() - start;
+        unlink(output_path.c_str());
+        
+        if (!ok) {
+            cerr << "Error: Failed to extract " << path << endl;
+            return 0;
+        }
+        return written / (1024.0 * 1024.0) / elapsed;
+    }
+    
+    // Extract a generated file and compare every block of the copy with
+    // its stamp; blocks the generator left out must read back as zeros
+    bool verifyExtract(EXT2Parser& parser, const string& path, uint64_t size, uint32_t stride) {
+        uint32_t inode_num;
+        ext2_inode inode;
+        if (!parser.lookupPath(path, inode_num) || !parser.getInode(inode_num, inode)) {
+            cerr << "Error: Lookup failed: " << path << endl;
+            return false;
+        }
+        if (parser.getFileSize(inode) != size) {
+            cerr << "Error: " << path << " has size " << parser.getFileSize(inode)
+                 << ", expected " << size << endl;
+            return false;
+        }
+        
+        string output_path = image_path + ".out";
+        uint64_t written = 0;
+        if (!parser.extractFile(inode_num, output_path, written) || written != size) {
+            cerr << "Error: Failed to extract " << path << endl;
+            unlink(output_path.c_str());
+            return false;
+        }
+        
+        uint32_t block_size = parser.getBlockSize();
+        int fd = ::open(output_path.c_str(), O_RDONLY);
+        vector<uint8_t> chunk(EXT2_COPY_CHUNK);
+        vector<uint8_t> expected(block_size);
+        bool ok = fd >= 0;
+        for (uint64_t offset = 0; ok && offset < size; offset += chunk.size()) {
+            size_t length = min<uint64_t>(chunk.size(), size - offset);
+            if (pread(fd, chunk.data(), length, offset) != (ssize_t)length) {
+                cerr << "Error: Failed to read back " << output_path << endl;
+                ok = false;
+                break;
+            }
+            for (size_t done = 0; done < length; done += block_size) {
+                uint64_t logical = (offset + done) / block_size;
+                if (logical % stride == 0) {
+                    ImageGenerator::stampBlock(inode_num, logical, expected.data(), block_size);
+                } else {
+                    memset(expected.data(), 0, block_size);
+                }
+                if (memcmp(chunk.data() + done, expected.data(),
+                           min<size_t>(block_size, length - done)) != 0) {
+                    cerr << "Error: Block " << logical << " of " << path << " is wrong" << endl;
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(output_path.c_str());
+        
+        if (ok) {
+            cout << "Verified " << path << ": " << size << " bytes" << endl;
+        }
+        return ok;
+    }
+    
+    // Run one benchmark cold then warm and print a row
+    void report(const char* name, const char* unit,
+                const function<double(EXT2Parser&)>& body) {
+        unique_ptr<EXT2Parser> parser = openParser(true);
+        if (!parser) {
+            cerr << "Error: Failed to open " << image_path << endl;
+            return;
+        }
+        double cold = body(*parser);
+        double warm = body(*parser);
+        
+        cout << left << setw(26) << name << right << fixed << setprecision(1)
+             << setw(14) << cold << setw(14) << warm << "  " << unit << endl;
+    }
+
+public:
+    Benchmark(const string& path, const BenchOptions& bench_options)
+        : image_path(path), options(bench_options) {}
+    
+    bool run() {
+        cout << "\n========================================" << endl;
+        cout << "EXT2 BENCHMARK: " << image_path << endl;
+        cout << "========================================" << endl;
+        
+        ImageGenerator generator;
+        double start = nowSeconds();
+        if (!generator.generate(image_path, options.spec)) {
+            cerr << "Error: Failed to generate image: " << generator.lastError() << endl;
+            return false;
+        }
+        double gen_time = nowSeconds() - start;
+        
+        cout << "Image: " << (uint64_t)generator.blockCount() * options.spec.block_size / (1024 * 1024)
+             << " MB, " << options.spec.block_size << "-byte blocks, "
+             << generator.groupCount() << " groups, " << generator.inodeCount() << " inodes" << endl;
+        cout << "Tree: " << generator.dirPaths().size() << " directories, "
+             << generator.filePaths().size() << " files" << endl;
+        cout << "Generated in " << fixed << setprecision(2) << gen_time << " s" << endl;
+        
+        if (options.generate_only) {
+            cout << "========================================\n" << endl;
+            return true;
+        }
+        
+        if (options.verify) {
+            unique_ptr<EXT2Parser> parser = openParser(true);
+            bool ok = parser != nullptr;
+            cout << "----------------------------------------" << endl;
+            if (ok && options.spec.large_file_size > 0) {
+                ok = verifyExtract(*parser, "/large.bin", options.spec.large_file_size, 1);
+            }
+            if (ok && options.spec.sparse_file_size > 0) {
+                ok = verifyExtract(*parser, "/sparse.bin", options.spec.sparse_file_size,
+                                   max(1u, options.spec.sparse_stride));
+            }
+            cout << "========================================\n" << endl;
+            
+            if (!options.keep_image) {
+                unlink(image_path.c_str());
+            }
+            return ok;
+        }
+        
+        // Spread the sample over the whole tree with a fixed-seed LCG so
+        // runs are comparable
+        const vector<string>& files = generator.filePaths();
+        uint32_t seed = 12345;
+        for (uint32_t i = 0; i < options.lookups && !files.empty(); i++) {
+            seed = seed * 1103515245u + 12345u;
+            sample.push_back(files[(seed >> 8) % files.size()]);
+        }
+        
+        cout << "----------------------------------------" << endl;
+        cout << left << setw(26) << "Benchmark" << right << setw(14) << "Cold"
+             << setw(14) << "Warm" << endl;
+        cout << "----------------------------------------" << endl;
+        
+        if (!sample.empty()) {
+            report("path lookups", "lookups/s", [&](EXT2Parser& parser) {
+                return runLookups(parser);
+            });
+        }
+        if (options.spec.huge_dir_entries > 0) {
+            report("directory entries", "entries/s", [&](EXT2Parser& parser) {
+                return runDirectory(parser, "/huge");
+            });
+        }
+        if (options.spec.large_file_size > 0) {
+            report("extract /large.bin", "MB/s", [&](EXT2Parser& parser) {
+                return runExtract(parser, "/large.bin");
+            });
+        }
+        if (options.spec.sparse_file_size > 0) {
+            report("extract /sparse.bin", "MB/s", [&](EXT2Parser& parser) {
+                return runExtract(parser, "/sparse.bin");
+            });
+        }
+        
+        cout << "========================================\n" << endl;
+        
+        if (!options.keep_image) {
+            unlink(image_path.c_str());
+        }
+        return true;
+    }
+};
+
+// ============================================================================
+// MAIN PROGRAM
+// ============================================================================
+
+void showUsage(const char* prog_name) {
+    ImageSpec defaults;
+    cout << "Usage: " << prog_name << " [options] <image>" << endl;
+    cout << "\nBuilds a synthetic EXT2 image at <image> and benchmarks the parser on it." << endl;
+    cout << "\nOptions:" << endl;
+    cout << "  --size <MB>          - Image size (default "
+         << defaults.image_size / (1024 * 1024) << "; a K suffix gives KB)" << endl;
+    cout << "  --block-size <n>     - 1024, 2048 or 4096 (default " << defaults.block_size << ")" << endl;
+    cout << "  --dirs <n>           - Directories under /tree (default " << defaults.tree_dirs << ")" << endl;
+    cout << "  --files <n>          - Files per /tree directory (default "
+         << defaults.files_per_dir << ")" << endl;
+    cout << "  --depth <n>          - Levels below /deep (default " << defaults.deep_depth << ")" << endl;
+    cout << "  --huge <n>           - Entries in /huge (default " << defaults.huge_dir_entries << ")" << endl;
+    cout << "  --large <MB>         - Size of /large.bin (default "
+         << defaults.large_file_size / (1024 * 1024) << ")" << endl;
+    cout << "  --sparse <MB>        - Apparent size of /sparse.bin (default "
+         << defaults.sparse_file_size / (1024 * 1024) << ")" << endl;
+    cout << "  --stride <n>         - /sparse.bin has one block in n (default "
+         << defaults.sparse_stride << ")" << endl;
+    cout << "  --data-offset <MB>   - Place /large.bin and /sparse.bin at least this far in" << endl;
+    cout << "  --lookups <n>        - Paths resolved per pass (default " << BENCH_LOOKUPS << ")" << endl;
+    cout << "  --no-mmap            - Benchmark the lseek/read backend" << endl;
+    cout << "  --keep               - Keep the image afterwards" << endl;
+    cout << "  --generate-only      - Only build the image (implies --keep)" << endl;
+    cout << "  --verify             - Check extracted large files block by block instead of timing" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        string option = argv[arg];
+        bool has_value = arg + 1 < argc;
+        if (option == "--size" && has_value) {
+            char* unit;
+            options.spec.image_size = strtoull(argv[++arg], &unit, 10) * 1024;
+            if (*unit != 'K' && *unit != 'k') {
+                options.spec.image_size *= 1024;
+            }
+        } else if (option == "--block-size" && has_value) {
+            options.spec.block_size = atoi(argv[++arg]);
+        } else if (option == "--dirs" && has_value) {
+            options.spec.tree_dirs = atoi(argv[++arg]);
+        } else if (option == "--files" && has_value) {
+            options.spec.files_per_dir = atoi(argv[++arg]);
+        } else if (option == "--depth" && has_value) {
+            options.spec.deep_depth = atoi(argv[++arg]);
+        } else if (option == "--huge" && has_value) {
+            options.spec.huge_dir_entries = atoi(argv[++arg]);
+        } else if (option == "--large" && has_value) {
+            options.spec.large_file_size = strtoull(argv[++arg], nullptr, 10) * 1024 * 1024;
+        } else if (option == "--sparse" && has_value) {
+            options.spec.sparse_file_size = strtoull(argv[++arg], nullptr, 10) * 1024 * 1024;
+        } else if (option == "--stride" && has_value) {
+            options.spec.sparse_stride = atoi(argv[++arg]);
+        } else if (option == "--data-offset" && has_value) {
+            options.spec.bulk_offset = strtoull(argv[++arg], nullptr, 10) * 1024 * 1024;
+        } else if (option == "--lookups" && has_value) {
+            options.lookups = atoi(argv[++arg]);
+        } else if (option == "--no-mmap") {
+            options.use_mmap = false;
+        } else if (option == "--keep") {
+            options.keep_image = true;
+        } else if (option == "--generate-only") {
+            options.generate_only = true;
+            options.keep_image = true;
+        } else if (option == "--verify") {
+            options.verify = true;
+        } else {
+            cerr << "Error: Unknown option: " << option << endl;
+            showUsage(argv[0]);
+            return 1;
+        }
+        arg++;
+    }
+    
+    if (arg + 1 != argc) {
+        showUsage(argv[0]);
+        return 1;
+    }
+    
+    Benchmark bench(argv[arg], options);
+    return bench.run() ? 0 : 1;
+}
@@ -0,0 +1,755 @@
+/*
+================================================================================
+EXT2 SYNTHETIC IMAGE GENERATOR - LAB 13
+================================================================================
+
+PURPOSE:
+Builds EXT2 images directly, without mkfs or a mount, so benchmarks and tests
+can run against trees far larger than the 200 MB sample image: deep
+directory chains, directories with hundreds of thousands of entries, large
+files mapped through double and triple indirect blocks, and sparse files.
+
+LAYOUT:
+- Revision 1 file system with 128-byte inodes, file types in directory
+  entries and sparse superblock backups (groups 0, 1 and powers of 3, 5, 7)
+- Each group: [superblock + group descriptors] block bitmap, inode bitmap,
+  inode table, data
+- Blocks are handed out in order from a single cursor, so files are laid out
+  contiguously with their indirect blocks in front of the data they map,
+  the way a freshly written ext2 file system looks
+- The image file is created sparse; only metadata and file data are written
+
+Generated tree (sizes come from ImageSpec):
+  /lost+found
+  /tree/dNNNN/fNNNN     - tree_dirs directories of files_per_dir small files
+  /deep/l1/l2/.../f     - deep_depth nested directories, one file in each
+  /huge/eNNNNNNN        - huge_dir_entries empty files in one directory
+  /large.bin            - large_file_size bytes, every block allocated
+  /sparse.bin           - sparse_file_size bytes, one block per sparse_stride
+Both large files are placed at or after bulk_offset, so images can have file
+data beyond 4 GB without writing gigabytes first.
+
+Every data block starts with its inode and logical block numbers, so copies
+can be checked without keeping the data anywhere else.
+
+Author: Fatima
+Course: Operating Systems - Lab 13
+Date: January 2026
+================================================================================
+*/
+
+#ifndef EXT2_IMAGEGEN_H
+#define EXT2_IMAGEGEN_H
+
+#include "ext2_parser.h"
+
+// ============================================================================
+// CONSTANTS
+// ============================================================================
+
+#define EXT2_GEN_BYTES_PER_INODE (16 * 1024)  // Default inode density
+#define EXT2_GEN_INODE_SIZE      128
+#define EXT2_GEN_FIRST_INO       11           // First non-reserved inode
+
+namespace ext2 {
+
+// ============================================================================
+// IMAGE SPECIFICATION
+// ============================================================================
+
+// Shape of a generated image; counts of 0 leave that part of the tree out
+struct ImageSpec {
+    uint64_t image_size;        // Bytes
+    uint32_t block_size;        // 1024, 2048 or 4096
+    uint32_t tree_dirs;         // Directories under /tree
+    uint32_t files_per_dir;     // Files in each of them
+    uint32_t small_file_size;   // Bytes per /tree and /deep file
+    uint32_t deep_depth;        // Levels below /deep
+    uint32_t huge_dir_entries;  // Empty files in /huge
+    uint64_t large_file_size;   // Bytes in /large.bin
+    uint64_t sparse_file_size;  // Apparent size of /sparse.bin
+    uint32_t sparse_stride;     // /sparse.bin has one block in this many
+    uint64_t bulk_offset;       // /large.bin and /sparse.bin data start at or after this byte
+    
+    ImageSpec()
+        : image_size(1024ull * 1024 * 1024), block_size(4096),
+          tree_dirs(200), files_per_dir(50), small_file_size(4096),
+          deep_depth(64), huge_dir_entries(50000),
+          large_file_size(256ull * 1024 * 1024),
+          sparse_file_size(1024ull * 1024 * 1024), sparse_stride(16), bulk_offset(0) {}
+};
+
+// ============================================================================
+// IMAGE GENERATOR
+// ============================================================================
+
+class ImageGenerator {
+private:
+    // Directory being built; written out once all entries are known
+    struct GenDir {
+        uint32_t inode;
+        uint32_t parent;
+        uint32_t subdirs;
+        vector<string> names;
+        vector<uint32_t> inodes;
+        vector<uint8_t> types;
+    };
+    
+    // Pointer blocks of one file while its blocks are being assigned
+    struct FileMap {
+        ext2_inode inode;
+        unordered_map<uint32_t, vector<uint32_t>> tables;  // By physical block
+        uint64_t blocks;            // Data plus pointer blocks
+    };
+    
+    int fd;
+    uint32_t block_size;
+    uint32_t blocks_count;
+    uint32_t first_data_block;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t group_count;
+    uint32_t gdt_blocks;            // Blocks of group descriptors per copy
+    uint32_t inode_table_blocks;    // Per group
+    uint32_t next_block;            // Allocation cursor
+    uint32_t next_inode;
+    uint32_t ro_compat;
+    uint32_t now;
+    vector<vector<uint8_t>> block_bitmaps;  // One block-sized bitmap per group
+    vector<vector<uint8_t>> inode_bitmaps;
+    vector<uint16_t> group_dirs;
+    vector<GenDir> dirs;
+    vector<string> file_paths;
+    vector<string> dir_paths;
+    string error;
+    
+    static void setBit(vector<uint8_t>& bitmap, uint32_t bit) {
+        bitmap[bit / 8] |= 1 << (bit % 8);
+    }
+    
+    static bool testBit(const vector<uint8_t>& bitmap, uint32_t bit) {
+        return bitmap[bit / 8] & (1 << (bit % 8));
+    }
+    
+    static bool isPowerOf(uint32_t value, uint32_t base) {
+        while (value > 1 && value % base == 0) {
+            value /= base;
+        }
+        return value == 1;
+    }
+    
+    // Groups holding a superblock backup under sparse_super
+    static bool groupHasSuper(uint32_t group) {
+        return group <= 1 || isPowerOf(group, 3) || isPowerOf(group, 5) || isPowerOf(group, 7);
+    }
+    
+    uint32_t groupStart(uint32_t group) const {
+        return first_data_block + group * blocks_per_group;
+    }
+    
+    uint32_t groupBlocks(uint32_t group) const {
+        return min(blocks_per_group, blocks_count - groupStart(group));
+    }
+    
+    uint32_t groupOverhead(uint32_t group) const {
+        return (groupHasSuper(group) ? 1 + gdt_blocks : 0) + 2 + inode_table_blocks;
+    }
+    
+    // Block bitmap, inode bitmap and inode table of a group
+    uint32_t blockBitmapBlock(uint32_t group) const {
+        return groupStart(group) + (groupHasSuper(group) ? 1 + gdt_blocks : 0);
+    }
+    
+    bool writeAt(const void* data, size_t size, uint64_t offset) {
+        const uint8_t* bytes = (const uint8_t*)data;
+        while (size > 0) {
+            ssize_t written = pwrite(fd, bytes, size, offset);
+            if (written <= 0) {
+                error = "write failed: " + string(strerror(errno));
+                return false;
+            }
+            bytes += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+    
+    // Choose group geometry for the image size and the number of inodes
+    // the tree needs
+    bool planLayout(const ImageSpec& spec) {
+        block_size = spec.block_size;
+        if (block_size != 1024 && block_size != 2048 && block_size != 4096) {
+            error = "block size must be 1024, 2048 or 4096";
+            return false;
+        }
+        
+        uint64_t total_blocks = spec.image_size / block_size;
+        if (total_blocks > 0xFFFFFFFFull) {
+            error = "image too large for 32-bit block numbers";
+            return false;
+        }
+        blocks_count = total_blocks;
+        first_data_block = block_size == 1024 ? 1 : 0;
+        blocks_per_group = block_size * 8;
+        
+        uint64_t needed_inodes = EXT2_GEN_FIRST_INO + 8 +
+                                 (uint64_t)spec.tree_dirs * (spec.files_per_dir + 1) +
+                                 2ull * spec.deep_depth + spec.huge_dir_entries;
+        
+        // Drop a trailing group too small to hold its own metadata
+        for (int attempt = 0; attempt < 2; attempt++) {
+            if (blocks_count <= first_data_block) {
+                error = "image too small";
+                return false;
+            }
+            group_count = (blocks_count - first_data_block + blocks_per_group - 1) / blocks_per_group;
+            gdt_blocks = (group_count * sizeof(ext2_group_desc) + block_size - 1) / block_size;
+            
+            uint32_t inodes_per_block = block_size / EXT2_GEN_INODE_SIZE;
+            uint64_t by_size = (uint64_t)blocks_per_group * block_size / EXT2_GEN_BYTES_PER_INODE;
+            uint64_t by_need = (needed_inodes + group_count - 1) / group_count;
+            uint64_t per_group = max(by_size, by_need);
+            per_group = (per_group + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+            per_group = (per_group + 7) / 8 * 8;
+            if (per_group > blocks_per_group) {
+                error = "image too small for the requested number of files";
+                return false;
+            }
+            inodes_per_group = per_group;
+            inode_table_blocks = inodes_per_group / inodes_per_block;
+            
+            uint32_t last = group_count - 1;
+            if (groupBlocks(last) > groupOverhead(last) + 16) {
+                return true;
+            }
+            blocks_count = groupStart(last);
+        }
+        
+        error = "image too small";
+        return false;
+    }
+    
+    // Mark every group's metadata in use and pad the bitmaps past the end
+    void initBitmaps() {
+        block_bitmaps.assign(group_count, vector<uint8_t>(block_size, 0));
+        inode_bitmaps.assign(group_count, vector<uint8_t>(block_size, 0));
+        group_dirs.assign(group_count, 0);
+        
+        for (uint32_t group = 0; group < group_count; group++) {
+            for (uint32_t i = 0; i < groupOverhead(group); i++) {
+                setBit(block_bitmaps[group], i);
+            }
+            for (uint32_t i = groupBlocks(group); i < blocks_per_group; i++) {
+                setBit(block_bitmaps[group], i);
+            }
+            for (uint32_t i = inodes_per_group; i < block_size * 8; i++) {
+                setBit(inode_bitmaps[group], i);
+            }
+        }
+        
+        // Reserved inodes 1..10
+        for (uint32_t ino = 1; ino < EXT2_GEN_FIRST_INO; ino++) {
+            setBit(inode_bitmaps[0], ino - 1);
+        }
+        
+        next_block = first_data_block;
+        next_inode = EXT2_GEN_FIRST_INO;
+    }
+    
+    // Next free block after the cursor (0 when the image is full)
+    uint32_t allocBlock() {
+        while (next_block < blocks_count) {
+            uint32_t block = next_block++;
+            uint32_t group = (block - first_data_block) / blocks_per_group;
+            uint32_t bit = (block - first_data_block) % blocks_per_group;
+            if (!testBit(block_bitmaps[group], bit)) {
+                setBit(block_bitmaps[group], bit);
+                return block;
+            }
+        }
+        error = "image is full";
+        return 0;
+    }
+    
+    uint32_t allocInode(bool is_dir) {
+        uint32_t ino = next_inode++;
+        uint32_t group = (ino - 1) / inodes_per_group;
+        if (group >= group_count) {
+            error = "out of inodes";
+            return 0;
+        }
+        setBit(inode_bitmaps[group], (ino - 1) % inodes_per_group);
+        if (is_dir) {
+            group_dirs[group]++;
+        }
+        return ino;
+    }
+    
+    bool writeInode(uint32_t ino, const ext2_inode& inode) {
+        uint32_t group = (ino - 1) / inodes_per_group;
+        uint32_t index = (ino - 1) % inodes_per_group;
+        uint64_t table = blockBitmapBlock(group) + 2;
+        return writeAt(&inode, sizeof(inode),
+                       table * block_size + (uint64_t)index * EXT2_GEN_INODE_SIZE);
+    }
+    
+    static void initInode(ext2_inode& inode, uint16_t mode, uint64_t size, uint32_t time) {
+        memset(&inode, 0, sizeof(inode));
+        inode.i_mode = mode;
+        inode.i_size = (uint32_t)size;
+        inode.i_dir_acl = (mode & 0xF000) == EXT2_S_IFREG ? (uint32_t)(size >> 32) : 0;
+        inode.i_atime = inode.i_ctime = inode.i_mtime = time;
+        inode.i_links_count = 1;
+    }
+    
+    // Pointer table behind a block pointer, allocating the block if needed
+    uint32_t* table(FileMap& map, uint32_t& pointer) {
+        if (pointer == 0) {
+            pointer = allocBlock();
+            if (pointer == 0) {
+                return nullptr;
+            }
+            map.tables[pointer].assign(block_size / 4, 0);
+            map.blocks++;
+        }
+        return map.tables[pointer].data();
+    }
+    
+    // Slot holding the physical block of a logical file block; pointer
+    // blocks are allocated on first use, just ahead of the data they map
+    uint32_t* slot(FileMap& map, uint64_t logical) {
+        uint64_t per_block = block_size / 4;
+        if (logical < 12) {
+            return &map.inode.i_block[logical];
+        }
+        logical -= 12;
+        
+        if (logical < per_block) {
+            uint32_t* single = table(map, map.inode.i_block[12]);
+            return single ? &single[logical] : nullptr;
+        }
+        logical -= per_block;
+        
+        if (logical < per_block * per_block) {
+            uint32_t* dbl = table(map, map.inode.i_block[13]);
+            uint32_t* single = dbl ? table(map, dbl[logical / per_block]) : nullptr;
+            return single ? &single[logical % per_block] : nullptr;
+        }
+        logical -= per_block * per_block;
+        
+        if (logical < per_block * per_block * per_block) {
+            uint32_t* tri = table(map, map.inode.i_block[14]);
+            uint32_t* dbl = tri ? table(map, tri[logical / (per_block * per_block)]) : nullptr;
+            uint32_t* single = dbl ? table(map, dbl[(logical / per_block) % per_block]) : nullptr;
+            return single ? &single[logical % per_block] : nullptr;
+        }
+        
+        error = "file too large for triple indirect mapping";
+        return nullptr;
+    }
+    
+    // Write pointer blocks and the inode of a finished file
+    bool finishFile(uint32_t ino, FileMap& map) {
+        for (auto& entry : map.tables) {
+            if (!writeAt(entry.second.data(), block_size, (uint64_t)entry.first * block_size)) {
+                return false;
+            }
+        }
+        map.inode.i_blocks = map.blocks * (block_size / 512);
+        return writeInode(ino, map.inode);
+    }
+    
+    // Allocate the listed logical blocks of a file and fill each with
+    // content(logical, buffer); physically contiguous blocks go out in one
+    // write. Logical blocks must be increasing.
+    bool writeBlocks(FileMap& map, const vector<uint64_t>& logicals,
+                     const function<void(uint64_t, uint8_t*)>& content) {
+        const uint32_t batch_blocks = EXT2_COPY_CHUNK / block_size;
+        vector<uint8_t> batch(EXT2_COPY_CHUNK);
+        uint32_t batch_start = 0;
+        uint32_t batch_count = 0;
+        
+        for (uint64_t logical : logicals) {
+            uint32_t* pointer = slot(map, logical);
+            uint32_t physical = pointer ? allocBlock() : 0;
+            if (physical == 0) {
+                return false;
+            }
+            *pointer = physical;
+            map.blocks++;
+            
+            if (batch_count > 0 &&
+                (physical != batch_start + batch_count || batch_count == batch_blocks)) {
+                if (!writeAt(batch.data(), (size_t)batch_count * block_size,
+                             (uint64_t)batch_start * block_size)) {
+                    return false;
+                }
+                batch_count = 0;
+            }
+            if (batch_count == 0) {
+                batch_start = physical;
+            }
+            content(logical, batch.data() + (size_t)batch_count * block_size);
+            batch_count++;
+        }
+        
+        return batch_count == 0 ||
+               writeAt(batch.data(), (size_t)batch_count * block_size,
+                       (uint64_t)batch_start * block_size);
+    }
+    
+    // Regular file with one block in every stride (stride 1: fully allocated)
+    bool addFile(uint32_t dir_index, const string& name, const string& path,
+                 uint64_t size, uint32_t stride) {
+        uint32_t ino = allocInode(false);
+        if (ino == 0) {
+            return false;
+        }
+        
+        FileMap map;
+        initInode(map.inode, EXT2_S_IFREG | 0644, size, now);
+        map.blocks = 0;
+        if (size >= 0x80000000ull) {
+            ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+        }
+        
+        vector<uint64_t> logicals;
+        uint64_t file_blocks = (size + block_size - 1) / block_size;
+        for (uint64_t logical = 0; logical < file_blocks; logical += stride) {
+            logicals.push_back(logical);
+        }
+        
+        bool ok = writeBlocks(map, logicals, [&](uint64_t logical, uint8_t* block) {
+            stampBlock(ino, logical, block, block_size);
+        });
+        if (!ok || !finishFile(ino, map)) {
+            return false;
+        }
+        
+        addEntry(dir_index, name, ino, EXT2_FT_REG_FILE);
+        file_paths.push_back(path);
+        return true;
+    }
+    
+    // Directory whose entries are filled in later by writeDirectories
+    uint32_t addDir(uint32_t parent_index, const string& name, const string& path) {
+        uint32_t ino = allocInode(true);
+        if (ino == 0) {
+            return UINT32_MAX;
+        }
+        
+        GenDir dir;
+        dir.inode = ino;
+        dir.parent = parent_index;
+        dir.subdirs = 0;
+        dirs.push_back(dir);
+        
+        addEntry(parent_index, name, ino, EXT2_FT_DIR);
+        dirs[parent_index].subdirs++;
+        dir_paths.push_back(path);
+        return dirs.size() - 1;
+    }
+    
+    void addEntry(uint32_t dir_index, const string& name, uint32_t ino, uint8_t type) {
+        GenDir& dir = dirs[dir_index];
+        dir.names.push_back(name);
+        dir.inodes.push_back(ino);
+        dir.types.push_back(type);
+    }
+    
+    // Pack every directory's entries into blocks and write them out
+    bool writeDirectories() {
+        for (GenDir& dir : dirs) {
+            vector<uint8_t> data;
+            size_t block_used = 0;
+            size_t last_entry = 0;
+            
+            auto append = [&](const string& name, uint32_t ino, uint8_t type) {
+                size_t rec_len = (8 + name.size() + 3) & ~(size_t)3;
+                if (data.empty() || block_used + rec_len > block_size) {
+                    // Last entry of the full block takes up the rest of it
+                    if (!data.empty()) {
+                        ext2_dir_entry* prev = (ext2_dir_entry*)&data[last_entry];
+                        prev->rec_len += block_size - block_used;
+                    }
+                    data.resize(data.size() + block_size, 0);
+                    block_used = 0;
+                }
+                
+                last_entry = data.size() - block_size + block_used;
+                ext2_dir_entry* entry = (ext2_dir_entry*)&data[last_entry];
+                entry->inode = ino;
+                entry->rec_len = rec_len;
+                entry->name_len = name.size();
+                entry->file_type = type;
+                memcpy(entry->name, name.data(), name.size());
+                block_used += rec_len;
+            };
+            
+            append(".", dir.inode, EXT2_FT_DIR);
+            append("..", dirs[dir.parent].inode, EXT2_FT_DIR);
+            for (size_t i = 0; i < dir.names.size(); i++) {
+                append(dir.names[i], dir.inodes[i], dir.types[i]);
+            }
+            ((ext2_dir_entry*)&data[last_entry])->rec_len += block_size - block_used;
+            
+            FileMap map;
+            initInode(map.inode, EXT2_S_IFDIR | 0755, data.size(), now);
+            map.inode.i_links_count = 2 + dir.subdirs;
+            map.blocks = 0;
+            
+            vector<uint64_t> logicals(data.size() / block_size);
+            for (size_t i = 0; i < logicals.size(); i++) {
+                logicals[i] = i;
+            }
+            bool ok = writeBlocks(map, logicals, [&](uint64_t logical, uint8_t* block) {
+                memcpy(block, &data[logical * block_size], block_size);
+            });
+            if (!ok || !finishFile(dir.inode, map)) {
+                return false;
+            }
+            
+            // Entries are no longer needed
+            vector<string>().swap(dir.names);
+            vector<uint32_t>().swap(dir.inodes);
+            vector<uint8_t>().swap(dir.types);
+        }
+        return true;
+    }
+    
+    static uint32_t countFree(const vector<uint8_t>& bitmap, uint32_t bits) {
+        uint32_t used = 0;
+        for (uint32_t i = 0; i < bits; i++) {
+            used += testBit(bitmap, i);
+        }
+        return bits - used;
+    }
+    
+    // Bitmaps, group descriptors and superblock copies
+    bool writeMetadata() {
+        vector<ext2_group_desc> descs(group_count);
+        uint32_t free_blocks = 0;
+        uint32_t free_inodes = 0;
+        
+        for (uint32_t group = 0; group < group_count; group++) {
+            ext2_group_desc& gd = descs[group];
+            memset(&gd, 0, sizeof(gd));
+            gd.bg_block_bitmap = blockBitmapBlock(group);
+            gd.bg_inode_bitmap = gd.bg_block_bitmap + 1;
+            gd.bg_inode_table = gd.bg_block_bitmap + 2;
+            gd.bg_free_blocks_count = countFree(block_bitmaps[group], blocks_per_group);
+            gd.bg_free_inodes_count = countFree(inode_bitmaps[group], inodes_per_group);
+            gd.bg_used_dirs_count = group_dirs[group];
+            free_blocks += gd.bg_free_blocks_count;
+            free_inodes += gd.bg_free_inodes_count;
+            
+            if (!writeAt(block_bitmaps[group].data(), block_size,
+                         (uint64_t)gd.bg_block_bitmap * block_size) ||
+                !writeAt(inode_bitmaps[group].data(), block_size,
+                         (uint64_t)gd.bg_inode_bitmap * block_size)) {
+                return false;
+            }
+        }
+        
+        ext2_superblock sb;
+        memset(&sb, 0, sizeof(sb));
+        sb.s_inodes_count = inodes_per_group * group_count;
+        sb.s_blocks_count = blocks_count;
+        sb.s_free_blocks_count = free_blocks;
+        sb.s_free_inodes_count = free_inodes;
+        sb.s_first_data_block = first_data_block;
+        sb.s_log_block_size = block_size == 1024 ? 0 : block_size == 2048 ? 1 : 2;
+        sb.s_log_frag_size = sb.s_log_block_size;
+        sb.s_blocks_per_group = blocks_per_group;
+        sb.s_frags_per_group = blocks_per_group;
+        sb.s_inodes_per_group = inodes_per_group;
+        sb.s_wtime = now;
+        sb.s_max_mnt_count = 0xFFFF;
+        sb.s_magic = EXT2_SUPER_MAGIC;
+        sb.s_state = 1;             // Cleanly unmounted
+        sb.s_errors = 1;            // Continue on errors
+        sb.s_lastcheck = now;
+        sb.s_rev_level = 1;
+        sb.s_first_ino = EXT2_GEN_FIRST_INO;
+        sb.s_inode_size = EXT2_GEN_INODE_SIZE;
+        sb.s_feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+        sb.s_feature_ro_compat = ro_compat;
+        sb.s_def_hash_version = DX_HASH_HALF_MD4;
+        sb.s_mkfs_time = now;
+        
+        // Random UUID and hash seed, so every image gets its own identity
+        uint32_t seed = now ^ (uint32_t)getpid();
+        for (size_t i = 0; i < sizeof(sb.s_uuid); i++) {
+            seed = seed * 1103515245u + 12345u;
+            sb.s_uuid[i] = seed >> 16;
+        }
+        sb.s_uuid[6] = (sb.s_uuid[6] & 0x0F) | 0x40;
+        sb.s_uuid[8] = (sb.s_uuid[8] & 0x3F) | 0x80;
+        for (int i = 0; i < 4; i++) {
+            seed = seed * 1103515245u + 12345u;
+            sb.s_hash_seed[i] = seed;
+        }
+        
+        for (uint32_t group = 0; group < group_count; group++) {
+            if (!groupHasSuper(group)) {
+                continue;
+            }
+            sb.s_block_group_nr = group;
+            uint64_t sb_offset = group == 0 ? 1024 : (uint64_t)groupStart(group) * block_size;
+            uint64_t gdt_offset = (uint64_t)(groupStart(group) + 1) * block_size;
+            if (!writeAt(&sb, sizeof(sb), sb_offset) ||
+                !writeAt(descs.data(), descs.size() * sizeof(ext2_group_desc), gdt_offset)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    bool buildTree(const ImageSpec& spec) {
+        // Root is its own parent; inode 2 is reserved rather than allocated
+        GenDir root;
+        root.inode = EXT2_ROOT_INO;
+        root.parent = 0;
+        root.subdirs = 0;
+        dirs.push_back(root);
+        setBit(inode_bitmaps[0], EXT2_ROOT_INO - 1);
+        group_dirs[0]++;
+        
+        if (addDir(0, "lost+found", "/lost+found") == UINT32_MAX) {
+            return false;
+        }
+        
+        char name[32];
+        if (spec.tree_dirs > 0) {
+            uint32_t tree = addDir(0, "tree", "/tree");
+            if (tree == UINT32_MAX) {
+                return false;
+            }
+            for (uint32_t d = 0; d < spec.tree_dirs; d++) {
+                snprintf(name, sizeof(name), "d%04u", d);
+                string dir_path = string("/tree/") + name;
+                uint32_t dir = addDir(tree, name, dir_path);
+                if (dir == UINT32_MAX) {
+                    return false;
+                }
+                for (uint32_t f = 0; f < spec.files_per_dir; f++) {
+                    snprintf(name, sizeof(name), "f%04u", f);
+                    if (!addFile(dir, name, dir_path + "/" + name, spec.small_file_size, 1)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        
+        if (spec.deep_depth > 0) {
+            uint32_t dir = addDir(0, "deep", "/deep");
+            string path = "/deep";
+            for (uint32_t level = 1; level <= spec.deep_depth && dir != UINT32_MAX; level++) {
+                snprintf(name, sizeof(name), "l%u", level);
+                path += string("/") + name;
+                dir = addDir(dir, name, path);
+                if (dir != UINT32_MAX &&
+                    !addFile(dir, "f", path + "/f", spec.small_file_size, 1)) {
+                    return false;
+                }
+            }
+            if (dir == UINT32_MAX) {
+                return false;
+            }
+        }
+        
+        if (spec.huge_dir_entries > 0) {
+            uint32_t huge = addDir(0, "huge", "/huge");
+            if (huge == UINT32_MAX) {
+                return false;
+            }
+            for (uint32_t i = 0; i < spec.huge_dir_entries; i++) {
+                snprintf(name, sizeof(name), "e%07u", i);
+                if (!addFile(huge, name, string("/huge/") + name, 0, 1)) {
+                    return false;
+                }
+            }
+        }
+        
+        // Skipping ahead leaves the blocks in between free, so large files
+        // can be placed far into the image without writing what's before
+        if (spec.bulk_offset / block_size > next_block) {
+            next_block = (uint32_t)min<uint64_t>(spec.bulk_offset / block_size, blocks_count);
+        }
+        
+        if (spec.large_file_size > 0 &&
+            !addFile(0, "large.bin", "/large.bin", spec.large_file_size, 1)) {
+            return false;
+        }
+        
+        if (spec.sparse_file_size > 0 &&
+            !addFile(0, "sparse.bin", "/sparse.bin", spec.sparse_file_size,
+                     max(1u, spec.sparse_stride))) {
+            return false;
+        }
+        
+        return true;
+    }
+
+public:
+    ImageGenerator()
+        : fd(-1), block_size(0), blocks_count(0), first_data_block(0),
+          blocks_per_group(0), inodes_per_group(0), group_count(0), gdt_blocks(0),
+          inode_table_blocks(0), next_block(0), next_inode(0), ro_compat(0), now(0) {}
+    
+    // Create (or replace) an image at path shaped by spec
+    bool generate(const string& path, const ImageSpec& spec) {
+        error.clear();
+        dirs.clear();
+        file_paths.clear();
+        dir_paths.clear();
+        ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+        now = time(nullptr);
+        
+        if (!planLayout(spec)) {
+            return false;
+        }
+        initBitmaps();
+        
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            error = "cannot create " + path;
+            return false;
+        }
+        
+        // Size the file up front; everything not written stays a hole
+        bool ok = ftruncate(fd, (off_t)blocks_count * block_size) == 0 &&
+                  buildTree(spec) && writeDirectories() && writeMetadata() &&
+                  fsync(fd) == 0;
+        close(fd);
+        fd = -1;
+        
+        if (!ok && error.empty()) {
+            error = "write failed: " + string(strerror(errno));
+        }
+        return ok;
+    }
+    
+    const string& lastError() const { return error; }
+    
+    // Contents of a generated data block: its inode and logical block
+    // numbers, then a fill byte derived from both
+    static void stampBlock(uint32_t ino, uint64_t logical, uint8_t* block, uint32_t block_size) {
+        memset(block, (uint8_t)(ino + logical), block_size);
+        memcpy(block, &ino, sizeof(ino));
+        memcpy(block + sizeof(ino), &logical, sizeof(logical));
+    }
+    
+    // Every regular file and directory created, as absolute paths
+    const vector<string>& filePaths() const { return file_paths; }
+    const vector<string>& dirPaths() const { return dir_paths; }
+    
+    uint32_t blockCount() const { return blocks_count; }
+    uint32_t inodeCount() const { return inodes_per_group * group_count; }
+    uint32_t groupCount() const { return group_count; }
+};
+
+}  // namespace ext2
+
+#endif  // EXT2_IMAGEGEN_H
@@ -1,58 +1,14 @@
 /*
 ================================================================================
-EXT2 FILE SYSTEM PARSER - LAB 13
+MYFS - EXT2 FILE SYSTEM PARSER COMMAND LINE - LAB 13
 ================================================================================
 
-PURPOSE:
-This program parses an EXT2 file system from a raw disk image and implements
-basic file system utilities (ls and cp) without using the operating system's
-mounted file system services.
-
-DESIGN APPROACH:
-1. Read EXT2 structures directly from the raw disk image
-2. Parse superblock to understand file system layout
-3. Read group descriptor table to locate inode table
-4. Implement inode reading and data block traversal
-5. Parse directory entries to list files
-6. Extract file data by following inode block pointers
-
-EXT2 STRUCTURE OVERVIEW:
-------------------------
-Block 0: Boot Block (reserved)
-Block 1: Superblock (file system metadata)
-Block 2: Group Descriptor Table
-Block N: Block Bitmap
-Block N+1: Inode Bitmap  
-Block N+2: Inode Table
-Remaining: Data Blocks
-
-KEY DATA STRUCTURES:
-- Superblock: Contains file system parameters
-- Group Descriptor: Points to bitmaps and inode table
-- Inode: Contains file metadata and block pointers
-- Directory Entry: Maps filenames to inode numbers
-
-INODE STRUCTURE:
-- 12 direct block pointers
-- 1 indirect block pointer
-- 1 double indirect block pointer
-- 1 triple indirect block pointer
-
-DIRECTORY ENTRY FORMAT:
-- inode: Inode number
-- rec_len: Record length
-- name_len: Filename length
-- file_type: File type indicator
-- name: Filename (variable length)
-
-IMPLEMENTATION NOTES:
-- Uses only low-level I/O (open, read, lseek)
-- No system() calls or OS file system access
-- Direct byte-level parsing of EXT2 structures
-- Supports files up to 12 direct blocks + indirect blocks
-
-REFERENCES:
-https://www.nongnu.org/ext2-doc/ext2.html
+Command line front end for the EXT2Parser library in ext2_parser.h: parses
+options, opens the image and dispatches one command. The batch and serve
+commands keep the image open and run many commands against the same
+parser, so superblock, group descriptors, index and caches stay warm:
+- batch reads one command per line from stdin
+- serve answers clients on a Unix socket with a pool of workers
 
 Author: Fatima
 Course: Operating Systems - Lab 13
@@ -60,562 +16,640 @@ Date: January 2026
 ================================================================================
 */
 
-#include <iostream>
-#include <fstream>
-#include <cstring>
-#include <cstdint>
-#include <vector>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/stat.h>
-#include <iomanip>
+#include "ext2_parser.h"
+#include <sstream>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 using namespace std;
+using namespace ext2;
 
 // ============================================================================
-// EXT2 CONSTANTS
+// CONSTANTS
 // ============================================================================
 
-#define EXT2_SUPER_MAGIC 0xEF53
-#define EXT2_ROOT_INO 2
-#define EXT2_BLOCK_SIZE 1024  // Default block size
-
-// File types
-#define EXT2_FT_UNKNOWN  0
-#define EXT2_FT_REG_FILE 1
-#define EXT2_FT_DIR      2
-#define EXT2_FT_CHRDEV   3
-#define EXT2_FT_BLKDEV   4
-#define EXT2_FT_FIFO     5
-#define EXT2_FT_SOCK     6
-#define EXT2_FT_SYMLINK  7
-
-// Inode modes
-#define EXT2_S_IFREG  0x8000  // Regular file
-#define EXT2_S_IFDIR  0x4000  // Directory
-#define EXT2_S_IFLNK  0xA000  // Symbolic link
+#define MYFS_SERVE_BACKLOG 64       // Pending connections on the socket
+#define MYFS_SERVE_POLL_MS 200      // How often the server checks for a signal
+#define MYFS_MAX_REQUEST 65536      // Longest request line a client may send
 
 // ============================================================================
-// EXT2 DATA STRUCTURES
+// COMMAND DISPATCH
 // ============================================================================
 
-#pragma pack(push, 1)
-
-// EXT2 Superblock structure (located at offset 1024)
-struct ext2_superblock {
-    uint32_t s_inodes_count;        // Total inodes
-    uint32_t s_blocks_count;        // Total blocks
-    uint32_t s_r_blocks_count;      // Reserved blocks
-    uint32_t s_free_blocks_count;   // Free blocks
-    uint32_t s_free_inodes_count;   // Free inodes
-    uint32_t s_first_data_block;    // First data block
-    uint32_t s_log_block_size;      // Block size (log2(block_size) - 10)
-    uint32_t s_log_frag_size;       // Fragment size
-    uint32_t s_blocks_per_group;    // Blocks per group
-    uint32_t s_frags_per_group;     // Fragments per group
-    uint32_t s_inodes_per_group;    // Inodes per group
-    uint32_t s_mtime;               // Mount time
-    uint32_t s_wtime;               // Write time
-    uint16_t s_mnt_count;           // Mount count
-    uint16_t s_max_mnt_count;       // Max mount count
-    uint16_t s_magic;               // Magic signature (0xEF53)
-    uint16_t s_state;               // File system state
-    uint16_t s_errors;              // Error handling
-    uint16_t s_minor_rev_level;     // Minor revision
-    uint32_t s_lastcheck;           // Last check time
-    uint32_t s_checkinterval;       // Check interval
-    uint32_t s_creator_os;          // Creator OS
-    uint32_t s_rev_level;           // Revision level
-    uint16_t s_def_resuid;          // Default reserved user ID
-    uint16_t s_def_resgid;          // Default reserved group ID
-    // EXT2_DYNAMIC_REV specific
-    uint32_t s_first_ino;           // First non-reserved inode
-    uint16_t s_inode_size;          // Inode size
-    uint16_t s_block_group_nr;      // Block group number
-    uint32_t s_feature_compat;      // Compatible features
-    uint32_t s_feature_incompat;    // Incompatible features
-    uint32_t s_feature_ro_compat;   // Read-only compatible features
-    uint8_t  s_uuid[16];            // Volume UUID
-    char     s_volume_name[16];     // Volume name
-    char     s_last_mounted[64];    // Last mounted path
-    uint32_t s_algorithm_usage_bitmap; // Compression algorithm
-    uint8_t  s_prealloc_blocks;     // Blocks to preallocate
-    uint8_t  s_prealloc_dir_blocks; // Directory blocks to preallocate
-    uint16_t s_padding1;
-    uint8_t  s_reserved[204];       // Padding to 1024 bytes
-};
-
-// Group Descriptor structure
-struct ext2_group_desc {
-    uint32_t bg_block_bitmap;       // Block bitmap block
-    uint32_t bg_inode_bitmap;       // Inode bitmap block
-    uint32_t bg_inode_table;        // Inode table block
-    uint16_t bg_free_blocks_count;  // Free blocks count
-    uint16_t bg_free_inodes_count;  // Free inodes count
-    uint16_t bg_used_dirs_count;    // Directories count
-    uint16_t bg_pad;
-    uint8_t  bg_reserved[12];
-};
-
-// Inode structure
-struct ext2_inode {
-    uint16_t i_mode;        // File mode
-    uint16_t i_uid;         // Owner UID
-    uint32_t i_size;        // Size in bytes
-    uint32_t i_atime;       // Access time
-    uint32_t i_ctime;       // Creation time
-    uint32_t i_mtime;       // Modification time
-    uint32_t i_dtime;       // Deletion time
-    uint16_t i_gid;         // Group ID
-    uint16_t i_links_count; // Links count
-    uint32_t i_blocks;      // Blocks count
-    uint32_t i_flags;       // File flags
-    uint32_t i_osd1;        // OS dependent
-    uint32_t i_block[15];   // Pointers to blocks (12 direct, 1 indirect, 1 double, 1 triple)
-    uint32_t i_generation;  // File version
-    uint32_t i_file_acl;    // File ACL
-    uint32_t i_dir_acl;     // Directory ACL
-    uint32_t i_faddr;       // Fragment address
-    uint8_t  i_osd2[12];    // OS dependent
-};
-
-// Directory entry structure
-struct ext2_dir_entry {
-    uint32_t inode;         // Inode number
-    uint16_t rec_len;       // Record length
-    uint8_t  name_len;      // Name length
-    uint8_t  file_type;     // File type
-    char     name[255];     // Filename (variable length)
+static const char* const COMMANDS[] = {
+    "ls", "cp", "cp-in", "stat", "scan-inodes", "fsstats", "check", "diff", "find", "du", "grep", "manifest", "index", "pack", "info"
 };
 
-#pragma pack(pop)
-
-// ============================================================================
-// EXT2 FILE SYSTEM CLASS
-// ============================================================================
+// True for the commands runCommand() knows
+static bool isCommand(const string& name) {
+    for (const char* command : COMMANDS) {
+        if (name == command) {
+            return true;
+        }
+    }
+    return false;
+}
 
-class EXT2Parser {
-private:
-    int fd;                         // File descriptor for image
-    ext2_superblock superblock;     // Superblock
-    ext2_group_desc group_desc;     // Group descriptor
-    uint32_t block_size;            // Block size in bytes
-    uint32_t inode_size;            // Inode size in bytes
+// Split a command line into words. Words are separated by blanks; single
+// quotes keep everything literally, double quotes and bare words take
+// backslash escapes. Returns false on an unterminated quote.
+static bool splitCommandLine(const string& line, vector<string>& words) {
+    words.clear();
+    string word;
+    bool in_word = false;
+    char quote = 0;
     
-    // ========================================================================
-    // LOW-LEVEL I/O FUNCTIONS
-    // ========================================================================
-    
-    // Read bytes from disk at specified offset
-    ssize_t readBytes(void* buffer, size_t size, off_t offset) {
-        if (lseek(fd, offset, SEEK_SET) == -1) {
-            cerr << "Error: Failed to seek to offset " << offset << endl;
-            return -1;
-        }
-        
-        ssize_t bytes_read = read(fd, buffer, size);
-        if (bytes_read < 0) {
-            cerr << "Error: Failed to read " << size << " bytes at offset " << offset << endl;
-            return -1;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quote == '\'') {
+            if (c == '\'') {
+                quote = 0;
+            } else {
+                word += c;
+            }
+        } else if (c == '\\' && i + 1 < line.size()) {
+            word += line[++i];
+            in_word = true;
+        } else if (quote == '"') {
+            if (c == '"') {
+                quote = 0;
+            } else {
+                word += c;
+            }
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            in_word = true;
+        } else if (c == ' ' || c == '\t' || c == '\r') {
+            if (in_word) {
+                words.push_back(word);
+                word.clear();
+                in_word = false;
+            }
+        } else {
+            word += c;
+            in_word = true;
         }
-        
-        return bytes_read;
     }
     
-    // Read a complete block
-    bool readBlock(uint32_t block_num, void* buffer) {
-        off_t offset = block_num * block_size;
-        ssize_t result = readBytes(buffer, block_size, offset);
-        return result == (ssize_t)block_size;
+    if (in_word) {
+        words.push_back(word);
+    }
+    return quote == 0;
+}
+
+// Quote a word so splitCommandLine() gives it back unchanged
+static string quoteWord(const string& word) {
+    if (!word.empty() && word.find_first_of(" \t\r\n'\"\\") == string::npos) {
+        return word;
     }
     
-    // ========================================================================
-    // EXT2 STRUCTURE PARSING
-    // ========================================================================
-    
-    // Read and validate superblock
-    bool readSuperblock() {
-        // Superblock is at offset 1024
-        if (readBytes(&superblock, sizeof(ext2_superblock), 1024) < 0) {
-            cerr << "Error: Failed to read superblock" << endl;
-            return false;
+    string quoted = "'";
+    for (char c : word) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
         }
-        
-        // Validate magic number
-        if (superblock.s_magic != EXT2_SUPER_MAGIC) {
-            cerr << "Error: Invalid EXT2 magic number: 0x" 
-                 << hex << superblock.s_magic << dec << endl;
-            cerr << "Expected: 0xEF53" << endl;
-            return false;
+    }
+    return quoted + "'";
+}
+
+// Run one command (args[0]) on an open parser. Output goes to out, errors
+// to err; in is the stream cp --stdin reads paths from, or nullptr when
+// stdin already carries commands. Returns the exit status.
+static int runCommand(EXT2Parser& parser, const vector<string>& args,
+                      ostream& out, ostream& err, istream* in) {
+    if (!isCommand(args[0])) {
+        err << "Error: Unknown command: " << args[0] << endl;
+        return 1;
+    }
+    IOStats::Phase phase(parser.getStats(), args[0]);
+    
+    int status = 0;
+    const string& command = args[0];
+    if (command == "ls") {
+        parser.listDirectory(args.size() >= 2 ? args[1] : "/", out, err);
+    }
+    else if (command == "cp") {
+        if (args.size() < 2) {
+            err << "Error: cp command requires filename" << endl;
+            out << "Usage: myfs <image> cp <filename>" << endl;
+            return 1;
         }
         
-        // Calculate block size
-        block_size = 1024 << superblock.s_log_block_size;
+        string filename = args[1];
+        string dest_path = (args.size() >= 3) ? args[2] : "";
         
-        // Get inode size
-        if (superblock.s_rev_level == 0) {
-            inode_size = 128;  // Old revision
-        } else {
-            inode_size = superblock.s_inode_size;
+        if (filename == "-r" || filename == "--stdin") {
+            // Bulk modes: cp -r <dir> <dest>, cp --stdin <dest>
+            bool recursive = filename == "-r";
+            if (args.size() < (recursive ? 4u : 3u)) {
+                err << "Error: cp " << filename << " requires "
+                     << (recursive ? "a source directory and " : "") << "a destination" << endl;
+                return 1;
+            }
+            
+            if (!recursive && !in) {
+                err << "Error: cp --stdin is not available here (stdin carries the commands)" << endl;
+                return 1;
+            }
+            
+            bool ok = recursive ? parser.copyTreeOut(args[2], args[3], out, err)
+                                : parser.copyListOut(*in, args[2], out, err);
+            if (!ok) {
+                status = 1;
+            }
+        }
+        else if (!parser.copyFileOut(filename, dest_path, out, err)) {
+            status = 1;
         }
-        
-        return true;
     }
-    
-    // Read group descriptor table
-    bool readGroupDescriptor() {
-        // Group descriptor table starts right after superblock
-        uint32_t gdt_block = superblock.s_first_data_block + 1;
-        off_t gdt_offset = gdt_block * block_size;
-        
-        if (readBytes(&group_desc, sizeof(ext2_group_desc), gdt_offset) < 0) {
-            cerr << "Error: Failed to read group descriptor" << endl;
-            return false;
+    else if (command == "cp-in") {
+        if (args.size() < 3) {
+            err << "Error: cp-in command requires host files and an image destination" << endl;
+            out << "Usage: myfs <image> cp-in <host_path>... <dest>" << endl;
+            return 1;
         }
         
-        return true;
+        vector<string> sources(args.begin() + 1, args.end() - 1);
+        if (!parser.importFiles(sources, args.back(), out, err)) {
+            status = 1;
+        }
     }
-    
-    // Read an inode by inode number
-    bool readInode(uint32_t inode_num, ext2_inode& inode) {
-        if (inode_num == 0 || inode_num > superblock.s_inodes_count) {
-            cerr << "Error: Invalid inode number: " << inode_num << endl;
-            return false;
+    else if (command == "stat") {
+        if (args.size() < 2) {
+            err << "Error: stat command requires a path" << endl;
+            return 1;
         }
         
-        // Calculate inode location
-        // Inodes are numbered starting from 1
-        uint32_t inode_index = inode_num - 1;
-        uint32_t group = inode_index / superblock.s_inodes_per_group;
-        uint32_t local_index = inode_index % superblock.s_inodes_per_group;
-        
-        // For simplicity, we use group 0 (works for small file systems)
-        off_t inode_table_offset = group_desc.bg_inode_table * block_size;
-        off_t inode_offset = inode_table_offset + (local_index * inode_size);
-        
-        if (readBytes(&inode, sizeof(ext2_inode), inode_offset) < 0) {
-            cerr << "Error: Failed to read inode " << inode_num << endl;
-            return false;
+        if (!parser.statPath(args[1], out, err)) {
+            status = 1;
         }
-        
-        return true;
     }
-    
-    // ========================================================================
-    // DATA BLOCK READING
-    // ========================================================================
-    
-    // Read data from inode (handles direct and indirect blocks)
-    bool readInodeData(const ext2_inode& inode, vector<uint8_t>& data) {
-        data.clear();
-        data.reserve(inode.i_size);
-        
-        uint8_t* block_buffer = new uint8_t[block_size];
-        uint32_t blocks_needed = (inode.i_size + block_size - 1) / block_size;
-        uint32_t bytes_read = 0;
-        
-        // Read direct blocks (first 12 blocks)
-        for (int i = 0; i < 12 && i < (int)blocks_needed && bytes_read < inode.i_size; i++) {
-            if (inode.i_block[i] == 0) break;
-            
-            if (!readBlock(inode.i_block[i], block_buffer)) {
-                delete[] block_buffer;
-                return false;
+    else if (command == "find") {
+        FindFilter filter;
+        string root = "/";
+        
+        for (size_t i = 1; i < args.size(); i++) {
+            string opt = args[i];
+            if (opt[0] != '-') {
+                root = opt;
+                continue;
             }
+            if (i + 1 >= args.size()) {
+                err << "Error: Missing value for " << opt << endl;
+                return 1;
+            }
+            string value = args[++i];
             
-            uint32_t to_copy = min(block_size, inode.i_size - bytes_read);
-            data.insert(data.end(), block_buffer, block_buffer + to_copy);
-            bytes_read += to_copy;
-        }
-        
-        // Handle indirect blocks if needed
-        if (bytes_read < inode.i_size && inode.i_block[12] != 0) {
-            uint32_t* indirect_block = new uint32_t[block_size / sizeof(uint32_t)];
-            
-            if (readBlock(inode.i_block[12], indirect_block)) {
-                uint32_t entries = block_size / sizeof(uint32_t);
+            if (opt == "-name") {
+                filter.name_glob = value;
+            } else if (opt == "-type") {
+                filter.type = value[0];
+            } else if (opt == "-size" || opt == "-mtime") {
+                int cmp = 0;
+                if (value[0] == '+' || value[0] == '-') {
+                    cmp = value[0] == '+' ? 1 : -1;
+                    value = value.substr(1);
+                }
+                char* end = nullptr;
+                uint64_t number = strtoull(value.c_str(), &end, 10);
                 
-                for (uint32_t i = 0; i < entries && bytes_read < inode.i_size; i++) {
-                    if (indirect_block[i] == 0) break;
-                    
-                    if (!readBlock(indirect_block[i], block_buffer)) {
-                        delete[] indirect_block;
-                        delete[] block_buffer;
-                        return false;
+                if (opt == "-size") {
+                    switch (*end) {
+                        case 'k': number <<= 10; break;
+                        case 'M': number <<= 20; break;
+                        case 'G': number <<= 30; break;
                     }
-                    
-                    uint32_t to_copy = min(block_size, inode.i_size - bytes_read);
-                    data.insert(data.end(), block_buffer, block_buffer + to_copy);
-                    bytes_read += to_copy;
+                    filter.size_cmp = cmp;
+                    filter.size = number;
+                    filter.has_size = true;
+                } else {
+                    filter.mtime_cmp = cmp;
+                    filter.mtime_days = number;
+                    filter.has_mtime = true;
                 }
+            } else {
+                err << "Error: Unknown find option: " << opt << endl;
+                return 1;
             }
-            
-            delete[] indirect_block;
         }
         
-        delete[] block_buffer;
-        return true;
+        if (!parser.findFiles(root, filter, out)) {
+            status = 1;
+        }
     }
-    
-    // ========================================================================
-    // DIRECTORY PARSING
-    // ========================================================================
-    
-    // Parse directory entries from directory data
-    void parseDirectoryEntries(const vector<uint8_t>& data, 
-                              vector<ext2_dir_entry>& entries) {
-        entries.clear();
-        size_t offset = 0;
-        
-        while (offset < data.size()) {
-            ext2_dir_entry* entry = (ext2_dir_entry*)(data.data() + offset);
-            
-            if (entry->inode == 0 || entry->rec_len == 0) {
-                break;
+    else if (command == "du") {
+        bool summary_only = false;
+        string root = "/";
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i] == "-s") {
+                summary_only = true;
+            } else {
+                root = args[i];
             }
-            
-            // Copy entry (only copy the actual name length)
-            ext2_dir_entry dir_entry;
-            memcpy(&dir_entry, entry, sizeof(ext2_dir_entry) - 255);
-            memcpy(dir_entry.name, entry->name, entry->name_len);
-            dir_entry.name[entry->name_len] = '\0';  // Null terminate
-            
-            entries.push_back(dir_entry);
-            
-            offset += entry->rec_len;
+        }
+        
+        if (!parser.diskUsage(root, summary_only, out)) {
+            status = 1;
         }
     }
-    
-    // Find a file in directory by name
-    bool findFileInDirectory(uint32_t dir_inode_num, const string& filename, 
-                            uint32_t& found_inode) {
-        ext2_inode dir_inode;
-        if (!readInode(dir_inode_num, dir_inode)) {
-            return false;
+    else if (command == "fsstats") {
+        if (!parser.showFsStats(out)) {
+            status = 1;
         }
-        
-        // Check if it's a directory
-        if ((dir_inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
-            cerr << "Error: Inode " << dir_inode_num << " is not a directory" << endl;
-            return false;
+    }
+    else if (command == "check") {
+        if (!parser.checkFileSystem(out, err)) {
+            status = 1;
         }
-        
-        // Read directory data
-        vector<uint8_t> dir_data;
-        if (!readInodeData(dir_inode, dir_data)) {
-            return false;
+    }
+    else if (command == "diff") {
+        if (args.size() < 2) {
+            err << "Error: diff command requires a second image" << endl;
+            out << "Usage: myfs <older_image> diff <newer_image>" << endl;
+            return 1;
         }
         
-        // Parse directory entries
-        vector<ext2_dir_entry> entries;
-        parseDirectoryEntries(dir_data, entries);
+        if (!parser.diffImage(args[1], out, err)) {
+            status = 1;
+        }
+    }
+    else if (command == "scan-inodes") {
+        if (!parser.scanInodes(out)) {
+            status = 1;
+        }
+    }
+    else if (command == "grep") {
+        if (args.size() < 2) {
+            err << "Error: grep command requires a pattern" << endl;
+            return 1;
+        }
         
-        // Search for file
-        for (const auto& entry : entries) {
-            if (strcmp(entry.name, filename.c_str()) == 0) {
-                found_inode = entry.inode;
-                return true;
-            }
+        if (!parser.grepFiles(args[1], args.size() >= 3 ? args[2] : "/", out, err)) {
+            status = 1;
+        }
+    }
+    else if (command == "manifest") {
+        if (!parser.writeManifest(args.size() >= 2 ? args[1] : "/", out, err)) {
+            status = 1;
+        }
+    }
+    else if (command == "index") {
+        status = parser.buildIndex(args.size() >= 2 ? args[1] : "", out, err) ? 0 : 1;
+    }
+    else if (command == "pack") {
+        if (args.size() < 2) {
+            err << "Error: pack command requires an output file" << endl;
+            return 1;
         }
         
-        return false;
+        if (!parser.packImage(args[1], out, err)) {
+            status = 1;
+        }
+    }
+    else if (command == "info") {
+        parser.showInfo(out);
     }
     
-public:
-    // ========================================================================
-    // CONSTRUCTOR & INITIALIZATION
-    // ========================================================================
-    
-    EXT2Parser() : fd(-1), block_size(1024), inode_size(128) {}
+    return status;
+}
+
+// ============================================================================
+// BATCH MODE
+// ============================================================================
+
+// Run commands read from in, one per line, against the same open parser.
+// Blank lines and lines starting with # are skipped. Returns 1 if any
+// command failed.
+static int runBatch(EXT2Parser& parser, istream& in) {
+    int status = 0;
+    string line;
+    vector<string> args;
+    uint64_t line_number = 0;
     
-    ~EXT2Parser() {
-        if (fd >= 0) {
-            close(fd);
+    while (getline(in, line)) {
+        line_number++;
+        if (!splitCommandLine(line, args)) {
+            cerr << "Error: Unterminated quote on line " << line_number << endl;
+            status = 1;
+            continue;
+        }
+        if (args.empty() || args[0][0] == '#') {
+            continue;
         }
+        
+        if (runCommand(parser, args, cout, cerr, nullptr) != 0) {
+            status = 1;
+        }
+        cout.flush();
     }
     
-    // Open and initialize EXT2 image
-    bool open(const string& image_path) {
-        // Open image file in read-only mode
-        fd = ::open(image_path.c_str(), O_RDONLY);
-        if (fd < 0) {
-            cerr << "Error: Cannot open image file: " << image_path << endl;
-            return false;
+    return status;
+}
+
+// ============================================================================
+// SERVER MODE
+// ============================================================================
+//
+// Protocol: a client sends requests as command lines ending in '\n', quoted
+// like batch input. For each request the server answers with a header line
+// "<status> <stdout bytes> <stderr bytes>\n" followed by the command's
+// stdout and stderr text. A connection may carry any number of requests;
+// each connection is served by one worker, so requests on different
+// connections run in parallel against the shared parser.
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void requestStop(int) {
+    stop_requested = 1;
+}
+
+static bool sendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
         }
-        
-        // Read superblock
-        if (!readSuperblock()) {
-            close(fd);
-            fd = -1;
+        if (sent <= 0) {
             return false;
         }
-        
-        // Read group descriptor
-        if (!readGroupDescriptor()) {
-            close(fd);
-            fd = -1;
+        data += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool recvAll(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(fd, data, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
             return false;
         }
-        
-        return true;
+        data += received;
+        size -= received;
     }
-    
-    // ========================================================================
-    // FILE SYSTEM OPERATIONS
-    // ========================================================================
-    
-    // List directory contents (ls command)
-    void listDirectory(uint32_t dir_inode_num = EXT2_ROOT_INO) {
-        ext2_inode inode;
-        if (!readInode(dir_inode_num, inode)) {
-            cerr << "Error: Failed to read directory inode" << endl;
-            return;
+    return true;
+}
+
+// Read up to the next '\n' into line, keeping any bytes after it in pending
+static bool recvLine(int fd, string& pending, string& line) {
+    while (true) {
+        size_t newline = pending.find('\n');
+        if (newline != string::npos) {
+            line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            return true;
+        }
+        if (pending.size() > MYFS_MAX_REQUEST) {
+            return false;
         }
         
-        // Check if it's a directory
-        if ((inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
-            cerr << "Error: Inode is not a directory" << endl;
-            return;
+        char buffer[4096];
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
         }
-        
-        // Read directory data
-        vector<uint8_t> dir_data;
-        if (!readInodeData(inode, dir_data)) {
-            cerr << "Error: Failed to read directory data" << endl;
-            return;
+        if (received <= 0) {
+            return false;
         }
-        
-        // Parse directory entries
-        vector<ext2_dir_entry> entries;
-        parseDirectoryEntries(dir_data, entries);
-        
-        // Display entries
-        cout << "\n========================================" << endl;
-        cout << "DIRECTORY LISTING (Inode " << dir_inode_num << ")" << endl;
-        cout << "========================================" << endl;
-        cout << left << setw(30) << "Name" 
-             << setw(10) << "Type" 
-             << setw(10) << "Inode"
-             << "Size" << endl;
-        cout << "----------------------------------------" << endl;
-        
-        for (const auto& entry : entries) {
-            // Skip . and .. for cleaner output (optional)
-            // if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) continue;
-            
-            // Get inode to check size
-            ext2_inode file_inode;
-            string type_str = "UNKNOWN";
-            uint32_t size = 0;
-            
-            if (readInode(entry.inode, file_inode)) {
-                size = file_inode.i_size;
-                
-                switch (entry.file_type) {
-                    case EXT2_FT_REG_FILE: type_str = "FILE"; break;
-                    case EXT2_FT_DIR:      type_str = "DIR"; break;
-                    case EXT2_FT_SYMLINK:  type_str = "LINK"; break;
-                    case EXT2_FT_CHRDEV:   type_str = "CHR"; break;
-                    case EXT2_FT_BLKDEV:   type_str = "BLK"; break;
-                    case EXT2_FT_FIFO:     type_str = "FIFO"; break;
-                    case EXT2_FT_SOCK:     type_str = "SOCK"; break;
-                }
+        pending.append(buffer, received);
+    }
+}
+
+class CommandServer {
+private:
+    EXT2Parser& parser;
+    string socket_path;
+    unsigned int workers;
+    mutex clients_lock;
+    unordered_set<int> clients;     // Connections being served
+    
+    // Answer requests on one connection until the client hangs up
+    void serveClient(int fd) {
+        string pending;
+        string line;
+        vector<string> args;
+        
+        while (!stop_requested && recvLine(fd, pending, line)) {
+            ostringstream out;
+            ostringstream err;
+            int status;
+            if (!splitCommandLine(line, args)) {
+                err << "Error: Unterminated quote in request" << endl;
+                status = 1;
+            } else if (args.empty()) {
+                err << "Error: Empty request" << endl;
+                status = 1;
+            } else {
+                status = runCommand(parser, args, out, err, nullptr);
             }
             
-            cout << left << setw(30) << entry.name
-                 << setw(10) << type_str
-                 << setw(10) << entry.inode
-                 << size << " bytes" << endl;
+            string out_text = out.str();
+            string err_text = err.str();
+            string header = to_string(status) + " " + to_string(out_text.size()) + " " +
+                            to_string(err_text.size()) + "\n";
+            if (!sendAll(fd, header.data(), header.size()) ||
+                !sendAll(fd, out_text.data(), out_text.size()) ||
+                !sendAll(fd, err_text.data(), err_text.size())) {
+                break;
+            }
         }
         
-        cout << "----------------------------------------" << endl;
-        cout << "Total entries: " << entries.size() << endl;
-        cout << "========================================\n" << endl;
+        {
+            lock_guard<mutex> guard(clients_lock);
+            clients.erase(fd);
+        }
+        close(fd);
     }
+
+public:
+    CommandServer(EXT2Parser& shared_parser, const string& path, unsigned int worker_count)
+        : parser(shared_parser), socket_path(path), workers(worker_count) {}
     
-    // Copy file from image to host (cp command)
-    bool copyFileOut(const string& filename, const string& dest_path = "") {
-        // Find file in root directory
-        uint32_t file_inode_num;
-        if (!findFileInDirectory(EXT2_ROOT_INO, filename, file_inode_num)) {
-            cerr << "Error: File not found: " << filename << endl;
+    // Accept connections until SIGINT or SIGTERM
+    bool run() {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        string bind_path = socket_path + ".tmp";
+        if (bind_path.size() >= sizeof(address.sun_path)) {
+            cerr << "Error: Socket path too long: " << socket_path << endl;
             return false;
         }
+        strcpy(address.sun_path, bind_path.c_str());
         
-        // Read file inode
-        ext2_inode file_inode;
-        if (!readInode(file_inode_num, file_inode)) {
-            cerr << "Error: Failed to read file inode" << endl;
+        int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            cerr << "Error: Cannot create socket: " << strerror(errno) << endl;
             return false;
         }
         
-        // Check if it's a regular file
-        if ((file_inode.i_mode & 0xF000) != EXT2_S_IFREG) {
-            cerr << "Error: Not a regular file" << endl;
-            return false;
+        // Bind under a temporary name and link the socket into place only
+        // once it listens, so a client that sees the path can connect
+        // (link, unlike rename, fails if the path is already taken)
+        bool listening = false;
+        int saved_errno = 0;
+        if (bind(listen_fd, (sockaddr*)&address, sizeof(address)) == 0) {
+            listening = listen(listen_fd, MYFS_SERVE_BACKLOG) == 0 &&
+                        link(bind_path.c_str(), socket_path.c_str()) == 0;
+            saved_errno = errno;
+            unlink(bind_path.c_str());
+        } else {
+            saved_errno = errno;
         }
-        
-        // Read file data
-        vector<uint8_t> file_data;
-        if (!readInodeData(file_inode, file_data)) {
-            cerr << "Error: Failed to read file data" << endl;
+        if (!listening) {
+            cerr << "Error: Cannot listen on " << socket_path << ": " << strerror(saved_errno) << endl;
+            close(listen_fd);
             return false;
         }
         
-        // Determine output path
-        string output_path = dest_path.empty() ? filename : dest_path;
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, requestStop);
+        signal(SIGTERM, requestStop);
         
-        // Write to host file system
-        int out_fd = ::open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (out_fd < 0) {
-            cerr << "Error: Cannot create output file: " << output_path << endl;
-            return false;
-        }
+        cerr << "Serving on " << socket_path << " with " << workers << " workers" << endl;
         
-        ssize_t written = write(out_fd, file_data.data(), file_data.size());
-        close(out_fd);
-        
-        if (written != (ssize_t)file_data.size()) {
-            cerr << "Error: Failed to write complete file" << endl;
-            return false;
+        // Commands run inside these workers build pools of their own (find,
+        // du, grep, manifest, cp -r); ThreadPool keys a worker's deque index
+        // by pool, so the nesting is safe with any mix of sizes
+        {
+            ThreadPool pool(workers);
+            while (!stop_requested) {
+                pollfd poll_fd = {listen_fd, POLLIN, 0};
+                if (poll(&poll_fd, 1, MYFS_SERVE_POLL_MS) <= 0) {
+                    continue;
+                }
+                
+                int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (fd < 0) {
+                    continue;
+                }
+                {
+                    lock_guard<mutex> guard(clients_lock);
+                    clients.insert(fd);
+                }
+                pool.submit([this, fd]() { serveClient(fd); });
+            }
+            
+            // Wake workers blocked on idle clients, then let them finish
+            {
+                lock_guard<mutex> guard(clients_lock);
+                for (int fd : clients) {
+                    shutdown(fd, SHUT_RDWR);
+                }
+            }
+            pool.wait();
         }
         
-        cout << "Successfully copied: " << filename << " -> " << output_path << endl;
-        cout << "Size: " << file_data.size() << " bytes" << endl;
-        
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        cerr << "Server stopped" << endl;
         return true;
     }
+};
+
+// ============================================================================
+// CLIENT MODE
+// ============================================================================
+
+// Send one request line and copy the answer to stdout/stderr. Returns the
+// command's exit status, or -1 if the connection failed.
+static int sendRequest(int fd, const string& request) {
+    string line = request + "\n";
+    if (!sendAll(fd, line.data(), line.size())) {
+        return -1;
+    }
     
-    // Show file system information
-    void showInfo() {
-        cout << "\n========================================" << endl;
-        cout << "EXT2 FILE SYSTEM INFORMATION" << endl;
-        cout << "========================================" << endl;
-        cout << "Magic Number: 0x" << hex << superblock.s_magic << dec << endl;
-        cout << "Block Size: " << block_size << " bytes" << endl;
-        cout << "Inode Size: " << inode_size << " bytes" << endl;
-        cout << "Total Blocks: " << superblock.s_blocks_count << endl;
-        cout << "Free Blocks: " << superblock.s_free_blocks_count << endl;
-        cout << "Total Inodes: " << superblock.s_inodes_count << endl;
-        cout << "Free Inodes: " << superblock.s_free_inodes_count << endl;
-        cout << "Blocks Per Group: " << superblock.s_blocks_per_group << endl;
-        cout << "Inodes Per Group: " << superblock.s_inodes_per_group << endl;
-        cout << "First Data Block: " << superblock.s_first_data_block << endl;
-        
-        if (superblock.s_volume_name[0] != '\0') {
-            cout << "Volume Name: " << superblock.s_volume_name << endl;
+    string pending;
+    string header;
+    if (!recvLine(fd, pending, header)) {
+        return -1;
+    }
+    int status = 0;
+    unsigned long long out_size = 0;
+    unsigned long long err_size = 0;
+    if (sscanf(header.c_str(), "%d %llu %llu", &status, &out_size, &err_size) != 3) {
+        return -1;
+    }
+    
+    // Bytes after the header arrived with it; the rest is read exactly
+    string body = pending;
+    if (body.size() < out_size + err_size) {
+        size_t have = body.size();
+        body.resize(out_size + err_size);
+        if (!recvAll(fd, &body[have], body.size() - have)) {
+            return -1;
         }
-        
-        cout << "\nGroup Descriptor (Group 0):" << endl;
-        cout << "Block Bitmap: Block " << group_desc.bg_block_bitmap << endl;
-        cout << "Inode Bitmap: Block " << group_desc.bg_inode_bitmap << endl;
-        cout << "Inode Table: Block " << group_desc.bg_inode_table << endl;
-        cout << "Free Blocks: " << group_desc.bg_free_blocks_count << endl;
-        cout << "Free Inodes: " << group_desc.bg_free_inodes_count << endl;
-        cout << "Used Directories: " << group_desc.bg_used_dirs_count << endl;
-        cout << "========================================\n" << endl;
     }
-};
+    
+    cout.write(body.data(), out_size);
+    cout.flush();
+    cerr.write(body.data() + out_size, err_size);
+    return status;
+}
+
+// Run one command on a server, or every line of stdin when no command is
+// given. Returns the exit status of the last failing command.
+static int runClient(const string& socket_path, const vector<string>& args) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        cerr << "Error: Socket path too long: " << socket_path << endl;
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        cerr << "Error: Cannot connect to " << socket_path << ": " << strerror(errno) << endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    
+    vector<string> requests;
+    if (!args.empty()) {
+        string request;
+        for (const string& arg : args) {
+            request += (request.empty() ? "" : " ") + quoteWord(arg);
+        }
+        requests.push_back(request);
+    } else {
+        string line;
+        vector<string> words;
+        while (getline(cin, line)) {
+            // Skip what the server would reject as empty
+            if (splitCommandLine(line, words) && (words.empty() || words[0][0] == '#')) {
+                continue;
+            }
+            requests.push_back(line);
+        }
+    }
+    
+    int status = 0;
+    for (const string& request : requests) {
+        int result = sendRequest(fd, request);
+        if (result < 0) {
+            cerr << "Error: Lost connection to " << socket_path << endl;
+            status = 1;
+            break;
+        }
+        if (result != 0) {
+            status = result;
+        }
+    }
+    
+    close(fd);
+    return status;
+}
 
 // ============================================================================
 // MAIN PROGRAM
@@ -626,17 +660,109 @@ void showUsage(const char* prog_name) {
     cout << "  EXT2 File System Parser - Lab 13" << endl;
     cout << "========================================" << endl;
     cout << "Usage:" << endl;
-    cout << "  " << prog_name << " <image> ls           - List root directory" << endl;
-    cout << "  " << prog_name << " <image> cp <file>    - Copy file from image to host" << endl;
+    cout << "  " << prog_name << " [options] <image> <command> [args]" << endl;
+    cout << "  " << prog_name << " --connect <socket> [command [args]]" << endl;
+    cout << "\nCommands:" << endl;
+    cout << "  " << prog_name << " <image> ls [path]    - List a directory (default: root)" << endl;
+    cout << "  " << prog_name << " <image> cp <path> [dest] - Copy file from image to host" << endl;
+    cout << "  " << prog_name << " <image> cp -r <dir> <dest> - Copy a directory tree to the host" << endl;
+    cout << "  " << prog_name << " <image> cp --stdin <dest> - Copy paths listed on stdin into dest" << endl;
+    cout << "  " << prog_name << " <image> cp-in <host_path>... <dest> - Copy host files/trees into the image" << endl;
+    cout << "  " << prog_name << " <image> stat <path>  - Show inode details of a file" << endl;
+    cout << "  " << prog_name << " <image> scan-inodes  - Dump all in-use inodes as TSV" << endl;
+    cout << "  " << prog_name << " <image> fsstats      - Space and fragmentation from the bitmaps" << endl;
+    cout << "  " << prog_name << " <image> check        - Cross-check bitmaps, counters and link counts" << endl;
+    cout << "  " << prog_name << " <image> diff <image2> - Files added, removed or changed in image2" << endl;
+    cout << "  " << prog_name << " <image> find [path] [-name <glob>] [-type f|d|l|c|b|p|s]" << endl;
+    cout << "       [-size [+|-]<n>[k|M|G]] [-mtime [+|-]<days>] - Search the tree" << endl;
+    cout << "  " << prog_name << " <image> du [-s] [path] - Space used per directory subtree (KB)" << endl;
+    cout << "  " << prog_name << " <image> grep <pattern> [path] - Offsets of a literal string in files" << endl;
+    cout << "  " << prog_name << " <image> manifest [path] - CRC32C of every file, plus duplicates" << endl;
+    cout << "  " << prog_name << " <image> index [file] - Build the metadata index (default: <image>.idx)" << endl;
+    cout << "  " << prog_name << " <image> pack <file>  - Write a chunk-compressed copy of the image" << endl;
     cout << "  " << prog_name << " <image> info         - Show file system info" << endl;
+    cout << "  " << prog_name << " <image> batch        - Run commands read from stdin, one per line" << endl;
+    cout << "  " << prog_name << " <image> serve <socket> [workers] - Answer clients on a Unix socket" << endl;
+    cout << "\nOptions:" << endl;
+    cout << "  --no-mmap            - Read the image with lseek/read instead of mmap" << endl;
+    cout << "  --cache-size <n>     - Block cache capacity in blocks (default "
+         << EXT2_CACHE_BLOCKS << ", 0 disables)" << endl;
+    cout << "  --cache-stats        - Print block cache hit/miss counters on exit" << endl;
+    cout << "  --stats[=json]       - Print I/O counters, latency histograms and phase times" << endl;
+    cout << "  --threads <n>        - Worker threads for find/du (default: all cores)" << endl;
+    cout << "  --io-depth <n>       - Files in flight for cp -r / cp --stdin (default "
+         << EXT2_IO_DEPTH << ")" << endl;
+    cout << "  --index <file>       - Metadata index to use (default: <image>.idx if current)" << endl;
+    cout << "  --no-index           - Ignore any metadata index and read directories" << endl;
+    cout << "  --connect <socket>   - Send the command (or stdin lines) to a running server" << endl;
     cout << "\nExamples:" << endl;
     cout << "  " << prog_name << " my_partition.img ls" << endl;
     cout << "  " << prog_name << " my_partition.img cp test.txt" << endl;
+    cout << "  " << prog_name << " my_partition.img cp /test_dir/subfile.txt out.txt" << endl;
+    cout << "  " << prog_name << " my_partition.img cp-in notes.txt photos /docs" << endl;
     cout << "  " << prog_name << " my_partition.img info" << endl;
+    cout << "  " << prog_name << " my_partition.img serve /tmp/myfs.sock &" << endl;
+    cout << "  " << prog_name << " --connect /tmp/myfs.sock stat /test.txt" << endl;
     cout << "========================================" << endl;
 }
 
 int main(int argc, char* argv[]) {
+    // Initialize parser
+    EXT2Parser parser;
+    
+    // Leading options come before the image path
+    bool cache_stats = false;
+    bool io_stats = false;
+    bool stats_json = false;
+    string connect_path;
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        string option = argv[arg];
+        if (option == "--no-mmap") {
+            parser.setUseMmap(false);
+        } else if (option == "--cache-size" && arg + 1 < argc) {
+            char* end = nullptr;
+            unsigned long blocks = strtoul(argv[++arg], &end, 10);
+            if (end == argv[arg] || *end != '\0') {
+                cerr << "Error: Invalid cache size: " << argv[arg] << endl;
+                return 1;
+            }
+            parser.setCacheSize(blocks);
+        } else if (option == "--cache-stats") {
+            cache_stats = true;
+        } else if (option == "--stats" || option == "--stats=json") {
+            io_stats = true;
+            stats_json = option == "--stats=json";
+            parser.enableStats();
+        } else if (option == "--threads" && arg + 1 < argc) {
+            parser.setThreads(atoi(argv[++arg]));
+        } else if (option == "--io-depth" && arg + 1 < argc) {
+            parser.setIODepth(atoi(argv[++arg]));
+        } else if (option == "--index" && arg + 1 < argc) {
+            parser.setIndexPath(argv[++arg]);
+        } else if (option == "--no-index") {
+            parser.setUseIndex(false);
+        } else if (option == "--connect" && arg + 1 < argc) {
+            connect_path = argv[++arg];
+        } else {
+            cerr << "Error: Unknown option: " << option << endl;
+            showUsage(argv[0]);
+            return 1;
+        }
+        arg++;
+    }
+    
+    // A client has no image; everything left is the command
+    if (!connect_path.empty()) {
+        return runClient(connect_path, vector<string>(argv + arg, argv + argc));
+    }
+    
+    // Shift remaining arguments so argv[1] is the image path
+    char* prog_name = argv[0];
+    argc -= arg - 1;
+    argv += arg - 1;
+    argv[0] = prog_name;
+    
     if (argc < 3) {
         showUsage(argv[0]);
         return 1;
@@ -644,41 +770,55 @@ int main(int argc, char* argv[]) {
     
     string image_path = argv[1];
     string command = argv[2];
+    vector<string> args(argv + 2, argv + argc);
     
-    // Initialize parser
-    EXT2Parser parser;
-    
-    if (!parser.open(image_path)) {
-        cerr << "Error: Failed to open EXT2 image: " << image_path << endl;
+    if (command != "batch" && command != "serve" && !isCommand(command)) {
+        cerr << "Error: Unknown command: " << command << endl;
+        showUsage(argv[0]);
+        return 1;
+    }
+    if (command == "serve" && argc < 4) {
+        cerr << "Error: serve command requires a socket path" << endl;
         return 1;
     }
     
-    // Execute command
-    if (command == "ls") {
-        parser.listDirectory();
+    // Rebuilding the index never reads through the old one
+    if (command == "index") {
+        parser.setUseIndex(false);
     }
-    else if (command == "cp") {
-        if (argc < 4) {
-            cerr << "Error: cp command requires filename" << endl;
-            cout << "Usage: " << argv[0] << " <image> cp <filename>" << endl;
-            return 1;
-        }
-        
-        string filename = argv[3];
-        string dest_path = (argc >= 5) ? argv[4] : filename;
-        
-        if (!parser.copyFileOut(filename, dest_path)) {
+    
+    // Only cp-in opens the image for writing
+    if (command == "cp-in") {
+        parser.setWritable(true);
+    }
+    
+    {
+        IOStats::Phase phase(parser.getStats(), "open");
+        if (!parser.open(image_path)) {
+            cerr << "Error: Failed to open EXT2 image: " << image_path << endl;
             return 1;
         }
     }
-    else if (command == "info") {
-        parser.showInfo();
+    
+    int status;
+    if (command == "batch") {
+        status = runBatch(parser, cin);
+    }
+    else if (command == "serve") {
+        unsigned int workers = argc >= 5 ? atoi(argv[4]) : thread::hardware_concurrency();
+        CommandServer server(parser, argv[3], max(1u, workers));
+        status = server.run() ? 0 : 1;
     }
     else {
-        cerr << "Error: Unknown command: " << command << endl;
-        showUsage(argv[0]);
-        return 1;
+        status = runCommand(parser, args, cout, cerr, &cin);
+    }
+    
+    if (cache_stats) {
+        parser.showCacheStats();
+    }
+    if (io_stats) {
+        parser.printStats(cerr, stats_json);
     }
     
-    return 0;
+    return status;
 }
@@ -0,0 +1,7104 @@
+/*
+================================================================================
+EXT2 FILE SYSTEM PARSER - LAB 13
+================================================================================
+
+PURPOSE:
+This program parses an EXT2 file system from a raw disk image and implements
+basic file system utilities (ls and cp) without using the operating system's
+mounted file system services.
+
+This header is the parser library: everything lives in the EXT2Parser class
+and its helpers, in namespace ext2, so other programs (the myfs command line
+in ext2_parser.cpp, the benchmark in ext2_bench.cpp) can include it directly.
+
+DESIGN APPROACH:
+1. Read EXT2 structures directly from the raw disk image
+2. Parse superblock to understand file system layout
+3. Read group descriptor table to locate inode table
+4. Implement inode reading and data block traversal
+5. Parse directory entries to list files
+6. Extract file data by following inode block pointers
+
+EXT2 STRUCTURE OVERVIEW:
+------------------------
+Block 0: Boot Block (reserved)
+Block 1: Superblock (file system metadata)
+Block 2: Group Descriptor Table
+Block N: Block Bitmap
+Block N+1: Inode Bitmap  
+Block N+2: Inode Table
+Remaining: Data Blocks
+
+KEY DATA STRUCTURES:
+- Superblock: Contains file system parameters
+- Group Descriptor: Points to bitmaps and inode table
+- Inode: Contains file metadata and block pointers
+- Directory Entry: Maps filenames to inode numbers
+
+INODE STRUCTURE:
+- 12 direct block pointers
+- 1 indirect block pointer
+- 1 double indirect block pointer
+- 1 triple indirect block pointer
+
+DIRECTORY ENTRY FORMAT:
+- inode: Inode number
+- rec_len: Record length
+- name_len: Filename length
+- file_type: File type indicator
+- name: Filename (variable length)
+
+IMPLEMENTATION NOTES:
+- Uses only low-level I/O on the image (open, read, lseek, mmap, pwrite)
+- Image bytes come from a pluggable backend: a mapping of the image when
+  possible (zero-copy views, no syscall per read), falling back to
+  lseek+read on the file descriptor otherwise
+- Images are opened read-only, except by cp-in, which opens the image
+  O_RDWR and writes data blocks, inodes, directory blocks, bitmaps, group
+  descriptors and the superblock back with pwrite on the descriptor (the
+  mapping stays read-only and sees the writes through the page cache)
+- No system() calls; host files are read and written only as the sources
+  and destinations of copies (cp, cp-in)
+- Direct byte-level parsing of EXT2 structures
+- Resolves direct, single, double and triple indirect blocks
+
+REFERENCES:
+https://www.nongnu.org/ext2-doc/ext2.html
+
+Author: Fatima
+Course: Operating Systems - Lab 13
+Date: January 2026
+================================================================================
+*/
+
+#ifndef EXT2_PARSER_H
+#define EXT2_PARSER_H
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <iomanip>
+#include <chrono>
+#include <zlib.h>
+
+// The library lives in namespace ext2; the standard library is brought in
+// there rather than at global scope, so including this header does not
+// pull std into the includer's namespace.
+namespace ext2 {
+
+using namespace std;
+
+// ============================================================================
+// EXT2 CONSTANTS
+// ============================================================================
+
+#define EXT2_SUPER_MAGIC 0xEF53
+#define EXT2_ROOT_INO 2
+#define EXT2_RESIZE_INO 7
+#define EXT2_BLOCK_SIZE 1024  // Default block size
+
+// Streaming copy-out
+#define EXT2_COPY_CHUNK      (1024 * 1024)  // Largest single read/write
+#define EXT2_IO_DEPTH        16             // Files in flight during bulk copy-out
+
+// Dentry cache
+#define EXT2_DENTRY_CACHE_ENTRIES 65536  // Names kept before directories are evicted
+
+// Directory listing
+#define EXT2_LIST_BATCH          4096 // Entries whose inodes are fetched together
+
+// Batched inode reads
+#define EXT2_INODE_BATCH_GAP     8    // Unneeded table blocks read to merge ranges
+#define EXT2_INODE_BATCH_BLOCKS  256  // Largest inode-table read in blocks
+
+// Inode table scans
+#define EXT2_SCAN_CHUNK          (1024 * 1024)  // Inode table bytes read at once
+
+// Metadata index sidecar
+#define EXT2_INDEX_MAGIC   "EXT2IDX1"  // First 8 bytes of an index file
+#define EXT2_INDEX_VERSION 3
+#define EXT2_INDEX_SUFFIX  ".idx"      // Default index path is <image>.idx
+
+// Content hashing (manifest)
+#define EXT2_CRC32C_POLY 0x82F63B78u  // Castagnoli polynomial, bit-reflected
+#define EXT2_CRC32C_LANE 4096         // Bytes per stream in the SSE4.2 loop
+
+// Packed (chunk-compressed) images
+#define EXT2_PACK_MAGIC   "EXT2PAK1"     // First 8 bytes of a packed image
+#define EXT2_PACK_VERSION 1
+#define EXT2_PACK_CHUNK   (64 * 1024)    // Uncompressed bytes per chunk
+#define EXT2_PACK_MAX_CHUNK (16 * 1024 * 1024)  // Largest chunk size a reader accepts
+#define EXT2_PACK_LEVEL   6              // zlib compression level
+#define EXT2_PACK_CACHE_CHUNKS 64        // Decompressed chunks kept
+#define EXT2_PACK_ZERO    0x1            // Chunk flag: all zeros, nothing stored
+#define EXT2_PACK_STORED  0x2            // Chunk flag: stored uncompressed
+
+// Write support (cp-in)
+#define EXT2_WRITE_BATCH 256  // Files imported between bitmap/descriptor write-backs
+
+// Consistency check
+#define EXT2_CHECK_REPORT 20    // Problems of each kind listed by check
+#define EXT2_CHECK_KEPT   1000  // Problems of each kind kept for sorting
+
+// Image diff
+#define EXT2_DIFF_MAX_DEPTH 4096  // Parent directories climbed to name a directory
+
+// Block map cache
+#define EXT2_RUN_CACHE_INODES 4096  // Inodes whose run lists are kept
+
+// Instrumentation (--stats)
+#define EXT2_STATS_BUCKETS 32  // Latency histogram buckets, powers of two in ns
+
+// Block cache
+#define EXT2_CACHE_BLOCKS    1024  // Default cache capacity in blocks
+#define EXT2_READAHEAD_MAX   32    // Largest read-ahead window in blocks
+
+// File types
+#define EXT2_FT_UNKNOWN  0
+#define EXT2_FT_REG_FILE 1
+#define EXT2_FT_DIR      2
+#define EXT2_FT_CHRDEV   3
+#define EXT2_FT_BLKDEV   4
+#define EXT2_FT_FIFO     5
+#define EXT2_FT_SOCK     6
+#define EXT2_FT_SYMLINK  7
+
+// Inode modes
+#define EXT2_S_IFREG  0x8000  // Regular file
+#define EXT2_S_IFDIR  0x4000  // Directory
+#define EXT2_S_IFLNK  0xA000  // Symbolic link
+
+// Feature and flag bits
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020  // Hashed (htree) directories
+#define EXT2_FEATURE_INCOMPAT_FILETYPE 0x0002 // Directory entries carry file types
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001  // Backups only in some groups
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002  // Files may exceed 2 GB
+#define EXT2_FEATURE_COMPAT_RESIZE_INODE 0x0010  // Reserved GDT blocks held by inode 7
+#define EXT2_INDEX_FL                 0x1000  // Inode flag: directory is indexed
+#define EXT2_FLAGS_UNSIGNED_HASH      0x0002  // Superblock flag: unsigned char hashing
+
+// Directory index hash versions
+#define DX_HASH_LEGACY            0
+#define DX_HASH_HALF_MD4          1
+#define DX_HASH_TEA               2
+#define DX_HASH_LEGACY_UNSIGNED   3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED      5
+#define DX_MAX_LEVELS             3   // Root plus up to two interior levels
+
+// ============================================================================
+// EXT2 DATA STRUCTURES
+// ============================================================================
+
+#pragma pack(push, 1)
+
+// EXT2 Superblock structure (located at offset 1024)
+struct ext2_superblock {
+    uint32_t s_inodes_count;        // Total inodes
+    uint32_t s_blocks_count;        // Total blocks
+    uint32_t s_r_blocks_count;      // Reserved blocks
+    uint32_t s_free_blocks_count;   // Free blocks
+    uint32_t s_free_inodes_count;   // Free inodes
+    uint32_t s_first_data_block;    // First data block
+    uint32_t s_log_block_size;      // Block size (log2(block_size) - 10)
+    uint32_t s_log_frag_size;       // Fragment size
+    uint32_t s_blocks_per_group;    // Blocks per group
+    uint32_t s_frags_per_group;     // Fragments per group
+    uint32_t s_inodes_per_group;    // Inodes per group
+    uint32_t s_mtime;               // Mount time
+    uint32_t s_wtime;               // Write time
+    uint16_t s_mnt_count;           // Mount count
+    uint16_t s_max_mnt_count;       // Max mount count
+    uint16_t s_magic;               // Magic signature (0xEF53)
+    uint16_t s_state;               // File system state
+    uint16_t s_errors;              // Error handling
+    uint16_t s_minor_rev_level;     // Minor revision
+    uint32_t s_lastcheck;           // Last check time
+    uint32_t s_checkinterval;       // Check interval
+    uint32_t s_creator_os;          // Creator OS
+    uint32_t s_rev_level;           // Revision level
+    uint16_t s_def_resuid;          // Default reserved user ID
+    uint16_t s_def_resgid;          // Default reserved group ID
+    // EXT2_DYNAMIC_REV specific
+    uint32_t s_first_ino;           // First non-reserved inode
+    uint16_t s_inode_size;          // Inode size
+    uint16_t s_block_group_nr;      // Block group number
+    uint32_t s_feature_compat;      // Compatible features
+    uint32_t s_feature_incompat;    // Incompatible features
+    uint32_t s_feature_ro_compat;   // Read-only compatible features
+    uint8_t  s_uuid[16];            // Volume UUID
+    char     s_volume_name[16];     // Volume name
+    char     s_last_mounted[64];    // Last mounted path
+    uint32_t s_algorithm_usage_bitmap; // Compression algorithm
+    uint8_t  s_prealloc_blocks;     // Blocks to preallocate
+    uint8_t  s_prealloc_dir_blocks; // Directory blocks to preallocate
+    uint16_t s_reserved_gdt_blocks; // Blocks reserved for growing the descriptor table
+    // Journaling and directory indexing (EXT3 fields, also set by mke2fs for EXT2)
+    uint8_t  s_journal_uuid[16];    // Journal superblock UUID
+    uint32_t s_journal_inum;        // Journal inode
+    uint32_t s_journal_dev;         // Journal device
+    uint32_t s_last_orphan;         // Head of orphan inode list
+    uint32_t s_hash_seed[4];        // Seed for directory index hashing
+    uint8_t  s_def_hash_version;    // Default directory hash version
+    uint8_t  s_jnl_backup_type;
+    uint16_t s_desc_size;           // Group descriptor size (64-bit only)
+    uint32_t s_default_mount_opts;
+    uint32_t s_first_meta_bg;
+    uint32_t s_mkfs_time;           // File system creation time
+    uint32_t s_jnl_blocks[17];      // Backup of journal inode blocks
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;               // Miscellaneous flags (signed/unsigned hash)
+    uint8_t  s_reserved[668];       // Padding to 1024 bytes
+};
+
+// Group Descriptor structure
+struct ext2_group_desc {
+    uint32_t bg_block_bitmap;       // Block bitmap block
+    uint32_t bg_inode_bitmap;       // Inode bitmap block
+    uint32_t bg_inode_table;        // Inode table block
+    uint16_t bg_free_blocks_count;  // Free blocks count
+    uint16_t bg_free_inodes_count;  // Free inodes count
+    uint16_t bg_used_dirs_count;    // Directories count
+    uint16_t bg_pad;
+    uint8_t  bg_reserved[12];
+};
+
+// Inode structure
+struct ext2_inode {
+    uint16_t i_mode;        // File mode
+    uint16_t i_uid;         // Owner UID
+    uint32_t i_size;        // Size in bytes
+    uint32_t i_atime;       // Access time
+    uint32_t i_ctime;       // Creation time
+    uint32_t i_mtime;       // Modification time
+    uint32_t i_dtime;       // Deletion time
+    uint16_t i_gid;         // Group ID
+    uint16_t i_links_count; // Links count
+    uint32_t i_blocks;      // Blocks count
+    uint32_t i_flags;       // File flags
+    uint32_t i_osd1;        // OS dependent
+    uint32_t i_block[15];   // Pointers to blocks (12 direct, 1 indirect, 1 double, 1 triple)
+    uint32_t i_generation;  // File version
+    uint32_t i_file_acl;    // File ACL
+    uint32_t i_dir_acl;     // Directory ACL
+    uint32_t i_faddr;       // Fragment address
+    uint8_t  i_osd2[12];    // OS dependent
+};
+
+// Directory entry structure
+struct ext2_dir_entry {
+    uint32_t inode;         // Inode number
+    uint16_t rec_len;       // Record length
+    uint8_t  name_len;      // Name length
+    uint8_t  file_type;     // File type
+    char     name[255];     // Filename (variable length)
+};
+
+// Directory index (htree) root info, following the "." and ".." entries
+// in block 0 of an indexed directory
+struct ext2_dx_root_info {
+    uint32_t reserved_zero;
+    uint8_t  hash_version;  // DX_HASH_*
+    uint8_t  info_length;   // Size of this structure (8)
+    uint8_t  indirect_levels;  // Interior levels below the root
+    uint8_t  unused_flags;
+};
+
+// Index entry: names hashing to >= hash live under logical block "block".
+// In each node the first entry's hash field holds the count/limit instead.
+struct ext2_dx_entry {
+    uint32_t hash;
+    uint32_t block;
+};
+
+struct ext2_dx_countlimit {
+    uint16_t limit;         // Maximum entries in this node
+    uint16_t count;         // Entries in use (including the first)
+};
+
+// Metadata index file header. The sections that follow are located by
+// the offsets below; the whole file is mapped read-only on open.
+struct ext2_index_header {
+    char     magic[8];          // EXT2_INDEX_MAGIC
+    uint32_t version;           // EXT2_INDEX_VERSION
+    uint32_t block_size;
+    uint8_t  uuid[16];          // Superblock fields the index was built from
+    uint32_t wtime;
+    uint16_t mnt_count;
+    uint16_t pad;
+    uint32_t free_blocks;       // Free counts: more than one write may
+    uint32_t free_inodes;       // share a wtime second
+    uint32_t node_count;        // Directory tree nodes (node 0 is the root)
+    uint32_t bucket_count;      // Path hash slots (a power of two)
+    uint32_t inode_count;       // Inodes with a stored run list
+    uint32_t run_count;
+    uint64_t nodes_offset;      // ext2_index_node[node_count]
+    uint64_t buckets_offset;    // uint32_t[bucket_count], node index + 1 (0 = empty)
+    uint64_t inodes_offset;     // ext2_index_inode[inode_count], sorted by inode
+    uint64_t runs_offset;       // BlockRun[run_count]
+    uint64_t names_offset;      // Name bytes, not NUL-terminated
+    uint64_t names_size;
+};
+
+// One directory tree entry. Nodes are stored breadth first, so every
+// directory's children are contiguous and come after their parent.
+struct ext2_index_node {
+    uint32_t inode;
+    uint32_t parent;            // Node index of the containing directory
+    uint32_t first_child;       // Children are first_child..first_child+child_count-1
+    uint32_t child_count;
+    uint32_t name_offset;       // Into the name table
+    uint64_t size;              // Inode size in bytes
+    uint32_t mtime;
+    uint16_t mode;              // Inode mode
+    uint8_t  name_len;
+    uint8_t  file_type;         // EXT2_FT_* from the directory entry
+};
+
+// Run list of one inode: runs first_run..first_run+run_count-1
+struct ext2_index_inode {
+    uint32_t inode;
+    uint32_t first_run;
+    uint32_t run_count;
+};
+
+// Packed image header. The compressed chunks follow it; the chunk table
+// comes last, at table_offset, so chunks can be written as they are made.
+struct ext2_pack_header {
+    char     magic[8];          // EXT2_PACK_MAGIC
+    uint32_t version;           // EXT2_PACK_VERSION
+    uint32_t chunk_size;        // Uncompressed bytes per chunk (last may be short)
+    uint64_t image_size;        // Uncompressed image bytes
+    uint64_t chunk_count;
+    uint64_t table_offset;      // ext2_pack_chunk[chunk_count]
+};
+
+// Where one chunk is stored
+struct ext2_pack_chunk {
+    uint64_t offset;            // File offset of the stored bytes
+    uint32_t length;            // Stored bytes (0 for a zero chunk)
+    uint32_t flags;             // EXT2_PACK_ZERO, EXT2_PACK_STORED
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(ext2_superblock) == 1024, "superblock must be 1024 bytes");
+static_assert(sizeof(ext2_index_node) == 36, "index nodes must be 36 bytes");
+
+// One directory entry, viewed in place in the directory block it came from.
+// name is not NUL-terminated and stays valid while that block is held.
+struct DirEntryView {
+    uint32_t inode;
+    uint8_t  file_type;
+    uint8_t  name_len;
+    const char* name;
+    
+    bool nameEquals(const string& other) const {
+        return other.size() == name_len && memcmp(name, other.data(), name_len) == 0;
+    }
+    
+    string nameString() const {
+        return string(name, name_len);
+    }
+};
+
+// Physically contiguous piece of a file: length blocks starting at file
+// block "logical" are stored at image blocks physical..physical+length-1
+struct BlockRun {
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t length;
+};
+
+// Filters for the find command; unset criteria match everything
+struct FindFilter {
+    string name_glob;       // fnmatch pattern for the last path component
+    char type;              // 'f', 'd', 'l', 'c', 'b', 'p', 's' or 0
+    int size_cmp;           // -1: smaller than, 0: exactly, +1: larger than
+    uint64_t size;          // Bytes
+    bool has_size;
+    int mtime_cmp;          // Same convention as size_cmp, in whole days
+    int64_t mtime_days;
+    bool has_mtime;
+    
+    FindFilter()
+        : type(0), size_cmp(0), size(0), has_size(false),
+          mtime_cmp(0), mtime_days(0), has_mtime(false) {}
+};
+
+// ============================================================================
+// DIRECTORY INDEX HASHING
+// ============================================================================
+// Hash functions used by htree directories, as in the ext2/3 spec
+// (fs/ext4/hash.c in the Linux kernel).
+
+inline uint32_t rol32(uint32_t word, unsigned int shift) {
+    return (word << shift) | (word >> (32 - shift));
+}
+
+// Legacy hash (DX_HASH_LEGACY / DX_HASH_LEGACY_UNSIGNED)
+inline uint32_t dxHackHash(const char* name, int len, bool unsigned_chars) {
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    
+    for (int i = 0; i < len; i++) {
+        int c = unsigned_chars ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+        
+        if (hash & 0x80000000) {
+            hash -= 0x7fffffff;
+        }
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+// Pack up to num*4 bytes of a name into 32-bit words, padding with the length
+inline void str2hashbuf(const char* msg, int len, uint32_t* buf, int num,
+                        bool unsigned_chars) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+    
+    uint32_t val = pad;
+    if (len > num * 4) {
+        len = num * 4;
+    }
+    for (int i = 0; i < len; i++) {
+        int c = unsigned_chars ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+    while (--num >= 0) {
+        *buf++ = pad;
+    }
+}
+
+// Reduced MD4 round function used by DX_HASH_HALF_MD4
+inline void halfMD4Transform(uint32_t buf[4], const uint32_t in[8]) {
+    const uint32_t K1 = 0, K2 = 013240474631UL, K3 = 015666365641UL;
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+    
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = rol32(a, s))
+    
+    // Round 1
+    ROUND(F, a, b, c, d, in[0] + K1,  3);
+    ROUND(F, d, a, b, c, in[1] + K1,  7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1,  3);
+    ROUND(F, d, a, b, c, in[5] + K1,  7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+    
+    // Round 2
+    ROUND(G, a, b, c, d, in[1] + K2,  3);
+    ROUND(G, d, a, b, c, in[3] + K2,  5);
+    ROUND(G, c, d, a, b, in[5] + K2,  9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2,  3);
+    ROUND(G, d, a, b, c, in[2] + K2,  5);
+    ROUND(G, c, d, a, b, in[4] + K2,  9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+    
+    // Round 3
+    ROUND(H, a, b, c, d, in[3] + K3,  3);
+    ROUND(H, d, a, b, c, in[7] + K3,  9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3,  3);
+    ROUND(H, d, a, b, c, in[5] + K3,  9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+    
+#undef F
+#undef G
+#undef H
+#undef ROUND
+    
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// TEA round function used by DX_HASH_TEA
+inline void teaTransform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+    
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+// Major hash of a name for an htree lookup. Returns false for an unknown
+// hash version.
+inline bool dxNameHash(const char* name, int len, int version, const uint32_t seed[4],
+                       uint32_t& hash) {
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint32_t in[8];
+    
+    // A non-zero seed replaces the default initial state
+    if (seed[0] || seed[1] || seed[2] || seed[3]) {
+        memcpy(buf, seed, sizeof(buf));
+    }
+    
+    bool unsigned_chars = version >= DX_HASH_LEGACY_UNSIGNED;
+    switch (version) {
+        case DX_HASH_LEGACY:
+        case DX_HASH_LEGACY_UNSIGNED:
+            hash = dxHackHash(name, len, unsigned_chars);
+            break;
+        case DX_HASH_HALF_MD4:
+        case DX_HASH_HALF_MD4_UNSIGNED:
+            for (const char* p = name; len > 0; len -= 32, p += 32) {
+                str2hashbuf(p, len, in, 8, unsigned_chars);
+                halfMD4Transform(buf, in);
+            }
+            hash = buf[1];
+            break;
+        case DX_HASH_TEA:
+        case DX_HASH_TEA_UNSIGNED:
+            for (const char* p = name; len > 0; len -= 16, p += 16) {
+                str2hashbuf(p, len, in, 4, unsigned_chars);
+                teaTransform(buf, in);
+            }
+            hash = buf[0];
+            break;
+        default:
+            return false;
+    }
+    
+    // The low bit marks hash collisions in the index; 0xfffffffe is
+    // reserved as the end-of-directory marker
+    hash &= ~1u;
+    if (hash == (0x7fffffffu << 1)) {
+        hash = (0x7fffffffu - 1) << 1;
+    }
+    return true;
+}
+
+// ============================================================================
+// BITMAP KERNELS
+// ============================================================================
+// Built for several instruction sets and picked at load time, so the
+// popcount loop uses POPCNT/AVX2 where the CPU has them.
+
+__attribute__((target_clones("avx2", "popcnt", "default")))
+inline uint64_t popcountWords(const uint64_t* words, size_t count) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += __builtin_popcountll(words[i]);
+    }
+    return total;
+}
+
+// ============================================================================
+// CONTENT HASHING
+// ============================================================================
+// CRC32C of file contents for the manifest command. Functions work on the
+// raw CRC register: start from 0xFFFFFFFF and invert at the end. Because
+// the register is linear in the data, a run of zero bytes (a hole) can be
+// folded in with one multiplication instead of being hashed byte by byte.
+
+// Slicing-by-8 tables, built on first use
+inline const uint32_t* crc32cTables() {
+    static const vector<uint32_t> tables = [] {
+        vector<uint32_t> t(8 * 256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (crc & 1 ? EXT2_CRC32C_POLY : 0);
+            }
+            t[i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                t[k * 256 + i] = (t[(k - 1) * 256 + i] >> 8) ^ t[t[(k - 1) * 256 + i] & 0xFF];
+            }
+        }
+        return t;
+    }();
+    return tables.data();
+}
+
+inline uint32_t crc32cSoftware(uint32_t crc, const uint8_t* data, size_t size) {
+    const uint32_t* t = crc32cTables();
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = t[7 * 256 + (word & 0xFF)] ^ t[6 * 256 + ((word >> 8) & 0xFF)] ^
+              t[5 * 256 + ((word >> 16) & 0xFF)] ^ t[4 * 256 + ((word >> 24) & 0xFF)] ^
+              t[3 * 256 + ((word >> 32) & 0xFF)] ^ t[2 * 256 + ((word >> 40) & 0xFF)] ^
+              t[1 * 256 + ((word >> 48) & 0xFF)] ^ t[word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = t[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+// a * b modulo the polynomial (both bit-reflected, x^0 in the top bit)
+inline uint32_t crc32cMultiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t mask = 1u << 31; mask != 0; mask >>= 1) {
+        if (a & mask) {
+            product ^= b;
+        }
+        b = (b >> 1) ^ (b & 1 ? EXT2_CRC32C_POLY : 0);
+    }
+    return product;
+}
+
+// Register after size more zero bytes: crc * x^(8 * size)
+inline uint32_t crc32cZeros(uint32_t crc, uint64_t size) {
+    // powers[k] = x^(2^k * 8)
+    static const vector<uint32_t> powers = [] {
+        vector<uint32_t> p(64);
+        uint32_t x8 = 1u << 23;             // x^8
+        p[0] = x8;
+        for (int k = 1; k < 64; k++) {
+            p[k] = crc32cMultiply(p[k - 1], p[k - 1]);
+        }
+        return p;
+    }();
+    
+    for (int k = 0; size != 0; k++, size >>= 1) {
+        if (size & 1) {
+            crc = crc32cMultiply(powers[k], crc);
+        }
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// The crc32 instruction has a latency of three cycles but a throughput of
+// one per cycle, so long buffers are hashed as three interleaved streams
+// and the partial registers are joined with crc32cZeros-style shifts.
+__attribute__((target("sse4.2")))
+inline uint32_t crc32cHardware(uint32_t crc, const uint8_t* data, size_t size) {
+    static const uint32_t shift1 = crc32cZeros(1u << 31, EXT2_CRC32C_LANE);
+    static const uint32_t shift2 = crc32cZeros(1u << 31, 2 * EXT2_CRC32C_LANE);
+    
+    while (size >= 3 * EXT2_CRC32C_LANE) {
+        uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < EXT2_CRC32C_LANE; i += 8) {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, data + i, 8);
+            memcpy(&word1, data + EXT2_CRC32C_LANE + i, 8);
+            memcpy(&word2, data + 2 * EXT2_CRC32C_LANE + i, 8);
+            crc0 = __builtin_ia32_crc32di(crc0, word0);
+            crc1 = __builtin_ia32_crc32di(crc1, word1);
+            crc2 = __builtin_ia32_crc32di(crc2, word2);
+        }
+        crc = crc32cMultiply(shift2, (uint32_t)crc0) ^ crc32cMultiply(shift1, (uint32_t)crc1) ^
+              (uint32_t)crc2;
+        data += 3 * EXT2_CRC32C_LANE;
+        size -= 3 * EXT2_CRC32C_LANE;
+    }
+    
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        data += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (size-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+// Fold size bytes into the register, with SSE4.2 when the CPU has it
+inline uint32_t crc32cUpdate(uint32_t crc, const uint8_t* data, size_t size) {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return crc32cHardware(crc, data, size);
+    }
+#endif
+    return crc32cSoftware(crc, data, size);
+}
+
+// Free-space run tracking over a bitmap (0 = free). Runs are carried
+// across calls so a run spanning two groups is counted once.
+struct FreeRunScanner {
+    uint64_t current;           // Length of the run in progress
+    uint64_t largest;
+    uint64_t largest_start;
+    uint64_t current_start;
+    vector<uint64_t> histogram; // Bucket b counts runs of [2^b, 2^(b+1)) blocks
+    
+    FreeRunScanner() : current(0), largest(0), largest_start(0), current_start(0),
+                       histogram(64, 0) {}
+    
+    void endRun() {
+        if (current == 0) {
+            return;
+        }
+        histogram[63 - __builtin_clzll(current)]++;
+        if (current > largest) {
+            largest = current;
+            largest_start = current_start;
+        }
+        current = 0;
+    }
+    
+    // Feed nbits bits of a bitmap whose first bit is block first_block
+    void scan(const uint64_t* words, uint64_t nbits, uint64_t first_block) {
+        uint64_t bit = 0;
+        while (bit < nbits) {
+            uint64_t word = words[bit / 64] >> (bit % 64);
+            uint64_t avail = min<uint64_t>(64 - bit % 64, nbits - bit);
+            if (avail < 64) {
+                word |= ~0ULL << avail;     // Treat bits past the end as used
+            }
+            
+            if (word == 0) {
+                // Whole word free
+                if (current == 0) current_start = first_block + bit;
+                current += avail;
+                bit += avail;
+            } else if (~word == 0) {
+                endRun();
+                bit += avail;
+            } else if (word & 1) {
+                // Used bits up to the next free one
+                uint64_t used = __builtin_ctzll(~word);
+                endRun();
+                bit += min(used, avail);
+            } else {
+                uint64_t free_bits = __builtin_ctzll(word);
+                if (current == 0) current_start = first_block + bit;
+                current += free_bits;
+                bit += free_bits;
+            }
+        }
+    }
+};
+
+// ============================================================================
+// LITERAL SEARCH
+// ============================================================================
+// Finds every occurrence of a fixed byte string in a stream that arrives in
+// pieces (grep command). Candidates come from memchr, which libc
+// vectorizes, on the pattern byte least likely to be common in files, and
+// are confirmed with memcmp. The last pattern-length-minus-one bytes of the
+// stream are carried from one piece to the next, so matches that span a
+// block or run boundary are found as well.
+
+class LiteralMatcher {
+private:
+    string pattern;
+    size_t anchor;                  // Index of the byte memchr looks for
+    bool all_zero;                  // Pattern matches inside holes
+    string carry;                   // Stream tail that may start a match
+    uint64_t carry_offset;          // Stream offset of carry[0]
+    
+    // Report matches in data[0, size) that start before limit
+    void scan(const uint8_t* data, size_t size, size_t limit, uint64_t base,
+              vector<uint64_t>& matches) const {
+        size_t length = pattern.size();
+        if (size < length) {
+            return;
+        }
+        size_t starts = min(limit, size - length + 1);
+        const uint8_t* p = data + anchor;
+        const uint8_t* end = data + starts + anchor;
+        uint8_t needle = pattern[anchor];
+        
+        while (p < end && (p = (const uint8_t*)memchr(p, needle, end - p)) != nullptr) {
+            const uint8_t* start = p - anchor;
+            if (memcmp(start, pattern.data(), length) == 0) {
+                matches.push_back(base + (start - data));
+            }
+            p++;
+        }
+    }
+    
+public:
+    explicit LiteralMatcher(const string& text)
+        : pattern(text), anchor(0), all_zero(true), carry_offset(0) {
+        // Rough order of the most frequent bytes in text and binaries;
+        // anything not listed counts as rare
+        static const char common[] = " etaoinsrhldcumfpgwybvkxjqz\n\t\r,.;:_-=()/0123456789\0";
+        size_t best_rank = 0;
+        for (size_t i = 0; i < pattern.size(); i++) {
+            const void* found = memchr(common, pattern[i], sizeof(common));
+            size_t rank = found ? sizeof(common) - ((const char*)found - common) : sizeof(common) + 1;
+            if (rank > best_rank) {
+                best_rank = rank;
+                anchor = i;
+            }
+            all_zero = all_zero && pattern[i] == '\0';
+        }
+    }
+    
+    size_t length() const { return pattern.size(); }
+    
+    // Start a new stream
+    void reset() {
+        carry.clear();
+        carry_offset = 0;
+    }
+    
+    // Search the next size bytes of the stream, which start at offset
+    void feed(const uint8_t* data, size_t size, uint64_t offset, vector<uint64_t>& matches) {
+        size_t keep = pattern.size() - 1;
+        if (carry.empty()) {
+            carry_offset = offset;
+        } else {
+            // Matches starting in the carried tail and ending in this piece
+            string joined = carry;
+            joined.append((const char*)data, min(size, keep));
+            scan((const uint8_t*)joined.data(), joined.size(), carry.size(), carry_offset, matches);
+        }
+        scan(data, size, size, offset, matches);
+        
+        if (size >= keep) {
+            carry.assign((const char*)data + size - keep, keep);
+            carry_offset = offset + size - keep;
+        } else {
+            carry.append((const char*)data, size);
+            if (carry.size() > keep) {
+                carry_offset += carry.size() - keep;
+                carry.erase(0, carry.size() - keep);
+            }
+        }
+    }
+    
+    // Search size zero bytes (a hole). Unless the pattern is all zeros, a
+    // match can only overlap the first or last length - 1 bytes of the
+    // hole, so the middle is skipped rather than fed.
+    void feedZeros(uint64_t size, uint64_t offset, vector<uint64_t>& matches) {
+        static const uint8_t zeros[4096] = {};
+        size_t keep = pattern.size() - 1;
+        uint64_t head = all_zero ? size : min<uint64_t>(size, keep);
+        for (uint64_t fed = 0; fed < head; ) {
+            size_t piece = min<uint64_t>(head - fed, sizeof(zeros));
+            feed(zeros, piece, offset + fed, matches);
+            fed += piece;
+        }
+        if (head < size) {
+            carry.assign(keep, '\0');
+            carry_offset = offset + size - keep;
+        }
+    }
+};
+
+// ============================================================================
+// INSTRUMENTATION
+// ============================================================================
+
+// Operations timed into latency histograms
+enum StatOp {
+    STAT_READ_BYTES,        // readBytes: one backend read
+    STAT_READ_BLOCK,        // readBlock/getBlock: one block, mapped, cached or read
+    STAT_READ_INODE,        // readInode
+    STAT_READ_INODES,       // readInodes: one batch
+    STAT_DIR_LOOKUP,        // findFileInDirectory: a name the dentry cache can't answer
+    STAT_OP_COUNT
+};
+
+// I/O counters, latency histograms and per-phase wall time. Nothing is
+// recorded until enable() is called (before any reader threads start);
+// while disabled every hook is a single well-predicted branch. Counters are
+// relaxed atomics, so recording threads never wait on each other.
+class IOStats {
+private:
+    struct Histogram {
+        atomic<uint64_t> count;
+        atomic<uint64_t> total_ns;
+        atomic<uint64_t> max_ns;
+        atomic<uint64_t> buckets[EXT2_STATS_BUCKETS];  // [2^i, 2^(i+1)) ns
+    };
+    
+    bool enabled;
+    atomic<uint64_t> read_syscalls;     // pread calls
+    atomic<uint64_t> bytes_read;        // Bytes returned by backend reads
+    atomic<uint64_t> seeks;             // Reads not starting where the last one ended
+    atomic<uint64_t> next_offset;
+    atomic<uint64_t> bytes_memcpy;      // Bytes copied out of the mapping
+    atomic<uint64_t> views;             // Zero-copy views handed out
+    atomic<uint64_t> kernel_copies;     // copy_file_range calls
+    atomic<uint64_t> kernel_copy_bytes;
+    atomic<uint64_t> write_syscalls;
+    atomic<uint64_t> bytes_written;
+    atomic<uint64_t> dir_blocks;        // Directory blocks parsed
+    atomic<uint64_t> dir_entries;       // Live entries produced
+    Histogram ops[STAT_OP_COUNT];
+    mutex phase_lock;
+    vector<pair<string, double>> phases;    // Seconds, in order of first use
+    
+    static const char* opName(int op) {
+        static const char* names[STAT_OP_COUNT] = {
+            "readBytes", "readBlock", "readInode", "readInodes", "dirLookup"
+        };
+        return names[op];
+    }
+    
+    static void add(atomic<uint64_t>& counter, uint64_t value) {
+        counter.fetch_add(value, memory_order_relaxed);
+    }
+    
+    static uint64_t get(const atomic<uint64_t>& counter) {
+        return counter.load(memory_order_relaxed);
+    }
+    
+    // Upper bound of the bucket holding the given fraction of calls
+    // (never more than the slowest call seen)
+    uint64_t percentileNs(const Histogram& hist, double fraction) const {
+        uint64_t target = (uint64_t)(get(hist.count) * fraction);
+        uint64_t seen = 0;
+        for (int i = 0; i < EXT2_STATS_BUCKETS; i++) {
+            seen += get(hist.buckets[i]);
+            if (seen > target) {
+                return min<uint64_t>(2ull << i, get(hist.max_ns));
+            }
+        }
+        return get(hist.max_ns);
+    }
+    
+    void record(StatOp op, uint64_t ns) {
+        Histogram& hist = ops[op];
+        add(hist.count, 1);
+        add(hist.total_ns, ns);
+        
+        int bucket = ns == 0 ? 0 : min(63 - __builtin_clzll(ns), EXT2_STATS_BUCKETS - 1);
+        add(hist.buckets[bucket], 1);
+        
+        uint64_t seen = get(hist.max_ns);
+        while (ns > seen && !hist.max_ns.compare_exchange_weak(seen, ns, memory_order_relaxed)) {
+        }
+    }
+    
+    void addPhase(const string& name, double seconds) {
+        lock_guard<mutex> guard(phase_lock);
+        for (auto& phase : phases) {
+            if (phase.first == name) {
+                phase.second += seconds;
+                return;
+            }
+        }
+        phases.push_back(make_pair(name, seconds));
+    }
+    
+public:
+    // Times one operation into its histogram
+    class Timer {
+    private:
+        IOStats& stats;
+        StatOp op;
+        bool active;
+        chrono::steady_clock::time_point start;
+        
+    public:
+        Timer(IOStats& owner, StatOp timed_op)
+            : stats(owner), op(timed_op), active(owner.enabled) {
+            if (active) {
+                start = chrono::steady_clock::now();
+            }
+        }
+        
+        ~Timer() {
+            if (active) {
+                stats.record(op, chrono::duration_cast<chrono::nanoseconds>(
+                                     chrono::steady_clock::now() - start).count());
+            }
+        }
+    };
+    
+    // Adds the wall time of a scope to a named phase
+    class Phase {
+    private:
+        IOStats& stats;
+        string name;
+        bool active;
+        chrono::steady_clock::time_point start;
+        
+    public:
+        Phase(IOStats& owner, const string& phase_name)
+            : stats(owner), name(phase_name), active(owner.enabled) {
+            if (active) {
+                start = chrono::steady_clock::now();
+            }
+        }
+        
+        ~Phase() {
+            if (active) {
+                stats.addPhase(name, chrono::duration<double>(
+                                         chrono::steady_clock::now() - start).count());
+            }
+        }
+    };
+    
+    IOStats() : enabled(false) {
+        atomic<uint64_t>* counters[] = {
+            &read_syscalls, &bytes_read, &seeks, &next_offset, &bytes_memcpy, &views,
+            &kernel_copies, &kernel_copy_bytes, &write_syscalls, &bytes_written,
+            &dir_blocks, &dir_entries
+        };
+        for (atomic<uint64_t>* counter : counters) {
+            counter->store(0);
+        }
+        for (Histogram& hist : ops) {
+            hist.count.store(0);
+            hist.total_ns.store(0);
+            hist.max_ns.store(0);
+            for (atomic<uint64_t>& bucket : hist.buckets) {
+                bucket.store(0);
+            }
+        }
+    }
+    
+    void enable() { enabled = true; }
+    bool isEnabled() const { return enabled; }
+    
+    // Hooks called by the backends and the parser
+    void addReadSyscall() {
+        if (enabled) {
+            add(read_syscalls, 1);
+        }
+    }
+    
+    void addRead(off_t offset, size_t size) {
+        if (!enabled) {
+            return;
+        }
+        add(bytes_read, size);
+        if (next_offset.exchange(offset + size, memory_order_relaxed) != (uint64_t)offset) {
+            add(seeks, 1);
+        }
+    }
+    
+    void addMemcpy(size_t size) {
+        if (enabled) {
+            add(bytes_memcpy, size);
+        }
+    }
+    
+    void addView() {
+        if (enabled) {
+            add(views, 1);
+        }
+    }
+    
+    void addKernelCopy(size_t size) {
+        if (!enabled) {
+            return;
+        }
+        add(kernel_copies, 1);
+        add(kernel_copy_bytes, size);
+    }
+    
+    void addWrite(size_t size) {
+        if (!enabled) {
+            return;
+        }
+        add(write_syscalls, 1);
+        add(bytes_written, size);
+    }
+    
+    void addDirBlock() {
+        if (enabled) {
+            add(dir_blocks, 1);
+        }
+    }
+    
+    void addDirEntry() {
+        if (enabled) {
+            add(dir_entries, 1);
+        }
+    }
+    
+    // Print everything, as text or as one JSON object
+    void print(ostream& out, bool json, const char* backend,
+               uint64_t cache_hits, uint64_t cache_misses, uint64_t cache_readahead) const {
+        if (json) {
+            out << "{\"backend\":\"" << backend << "\""
+                << ",\"reads\":{\"syscalls\":" << get(read_syscalls)
+                << ",\"bytes\":" << get(bytes_read) << ",\"seeks\":" << get(seeks) << "}"
+                << ",\"mapping\":{\"bytes_copied\":" << get(bytes_memcpy)
+                << ",\"views\":" << get(views) << "}"
+                << ",\"kernel_copies\":{\"calls\":" << get(kernel_copies)
+                << ",\"bytes\":" << get(kernel_copy_bytes) << "}"
+                << ",\"writes\":{\"syscalls\":" << get(write_syscalls)
+                << ",\"bytes\":" << get(bytes_written) << "}"
+                << ",\"directories\":{\"blocks\":" << get(dir_blocks)
+                << ",\"entries\":" << get(dir_entries) << "}"
+                << ",\"block_cache\":{\"hits\":" << cache_hits
+                << ",\"misses\":" << cache_misses
+                << ",\"readahead_blocks\":" << cache_readahead << "}"
+                << ",\"ops\":{";
+            for (int op = 0; op < STAT_OP_COUNT; op++) {
+                const Histogram& hist = ops[op];
+                out << (op ? "," : "") << "\"" << opName(op) << "\":{\"calls\":" << get(hist.count)
+                    << ",\"total_ns\":" << get(hist.total_ns) << ",\"max_ns\":" << get(hist.max_ns)
+                    << ",\"p50_ns\":" << percentileNs(hist, 0.5)
+                    << ",\"p99_ns\":" << percentileNs(hist, 0.99) << ",\"buckets\":[";
+                for (int i = 0; i < EXT2_STATS_BUCKETS; i++) {
+                    out << (i ? "," : "") << get(hist.buckets[i]);
+                }
+                out << "]}";
+            }
+            out << "},\"phases\":[";
+            for (size_t i = 0; i < phases.size(); i++) {
+                out << (i ? "," : "") << "{\"name\":\"" << phases[i].first << "\",\"ms\":"
+                    << fixed << setprecision(3) << phases[i].second * 1000 << "}";
+            }
+            out << "]}" << endl;
+            return;
+        }
+        
+        out << "\n========================================" << endl;
+        out << "I/O STATISTICS (backend: " << backend << ")" << endl;
+        out << "========================================" << endl;
+        out << "Reads: " << get(read_syscalls) << " syscalls, " << get(bytes_read)
+            << " bytes, " << get(seeks) << " seeks" << endl;
+        out << "Mapping: " << get(bytes_memcpy) << " bytes copied, "
+            << get(views) << " zero-copy views" << endl;
+        out << "Kernel copies: " << get(kernel_copies) << " calls, "
+            << get(kernel_copy_bytes) << " bytes" << endl;
+        out << "Writes: " << get(write_syscalls) << " syscalls, "
+            << get(bytes_written) << " bytes" << endl;
+        out << "Directories: " << get(dir_blocks) << " blocks, "
+            << get(dir_entries) << " entries parsed" << endl;
+        out << "Block cache: " << cache_hits << " hits, " << cache_misses
+            << " misses, " << cache_readahead << " blocks read ahead" << endl;
+        out << "----------------------------------------" << endl;
+        out << left << setw(12) << "Operation" << right << setw(10) << "Calls"
+            << setw(12) << "Total ms" << setw(10) << "Mean us" << setw(10) << "p50 us"
+            << setw(10) << "p99 us" << setw(10) << "Max us" << endl;
+        out << fixed << setprecision(1);
+        for (int op = 0; op < STAT_OP_COUNT; op++) {
+            const Histogram& hist = ops[op];
+            uint64_t calls = get(hist.count);
+            if (calls == 0) {
+                continue;
+            }
+            out << left << setw(12) << opName(op) << right << setw(10) << calls
+                << setw(12) << get(hist.total_ns) / 1e6
+                << setw(10) << get(hist.total_ns) / 1e3 / calls
+                << setw(10) << percentileNs(hist, 0.5) / 1e3
+                << setw(10) << percentileNs(hist, 0.99) / 1e3
+                << setw(10) << get(hist.max_ns) / 1e3 << endl;
+        }
+        if (!phases.empty()) {
+            out << "----------------------------------------" << endl;
+            out << left << setw(22) << "Phase" << right << setw(12) << "Wall ms" << endl;
+            out << setprecision(3);
+            for (const auto& phase : phases) {
+                out << left << setw(22) << phase.first << right << setw(12)
+                    << phase.second * 1000 << endl;
+            }
+        }
+        out << "========================================\n" << endl;
+    }
+};
+
+// ============================================================================
+// IMAGE BACKENDS
+// ============================================================================
+
+// Source of raw image bytes. Every backend can copy bytes out; backends that
+// hold the whole image in memory can also hand out zero-copy views.
+class ImageBackend {
+protected:
+    IOStats* stats;                 // Where reads are counted (never null once opened)
+    
+public:
+    ImageBackend() : stats(nullptr) {}
+    virtual ~ImageBackend() {}
+    
+    void setStats(IOStats* counters) { stats = counters; }
+    
+    // Copy up to size bytes at offset into buffer (returns bytes read or -1)
+    virtual ssize_t readAt(void* buffer, size_t size, off_t offset) = 0;
+    
+    // Pointer to size bytes at offset, or nullptr if not available as a view
+    virtual const uint8_t* view(off_t offset, size_t size) {
+        (void)offset;
+        (void)size;
+        return nullptr;
+    }
+    
+    // Underlying image descriptor for in-kernel copies, or -1
+    virtual int rawFd() const { return -1; }
+    
+    virtual const char* name() const = 0;
+};
+
+// Plain file descriptor backend (one pread per request, safe to share
+// between threads since it never moves the file offset)
+class FdBackend : public ImageBackend {
+private:
+    int fd;
+    
+public:
+    explicit FdBackend(int image_fd) : fd(image_fd) {}
+    
+    ~FdBackend() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    
+    ssize_t readAt(void* buffer, size_t size, off_t offset) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t bytes_read = pread(fd, (uint8_t*)buffer + done, size - done, offset + done);
+            stats->addReadSyscall();
+            if (bytes_read < 0) {
+                cerr << "Error: Failed to read " << size << " bytes at offset " << offset << endl;
+                return -1;
+            }
+            if (bytes_read == 0) {
+                break;      // End of image
+            }
+            done += bytes_read;
+        }
+        
+        stats->addRead(offset, done);
+        return done;
+    }
+    
+    int rawFd() const { return fd; }
+    
+    const char* name() const { return "fd"; }
+};
+
+// Read-only mapping of the whole image. Reads are memcpy, views are free.
+class MmapBackend : public ImageBackend {
+private:
+    int fd;                         // Kept open for in-kernel copies
+    const uint8_t* base;
+    size_t length;
+    
+public:
+    MmapBackend(int image_fd, const uint8_t* mapping, size_t mapping_length)
+        : fd(image_fd), base(mapping), length(mapping_length) {}
+    
+    ~MmapBackend() {
+        munmap((void*)base, length);
+        close(fd);
+    }
+    
+    // Map an open image (taking over fd on success); returns nullptr if the
+    // file cannot be mapped
+    static MmapBackend* create(int fd) {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+            return nullptr;
+        }
+        
+        void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            return nullptr;
+        }
+        
+        return new MmapBackend(fd, (const uint8_t*)mapping, st.st_size);
+    }
+    
+    ssize_t readAt(void* buffer, size_t size, off_t offset) {
+        if (offset < 0 || (size_t)offset > length) {
+            cerr << "Error: Offset " << offset << " is beyond end of image" << endl;
+            return -1;
+        }
+        
+        size_t available = min(size, length - (size_t)offset);
+        memcpy(buffer, base + offset, available);
+        stats->addRead(offset, available);
+        stats->addMemcpy(available);
+        return available;
+    }
+    
+    const uint8_t* view(off_t offset, size_t size) {
+        if (offset < 0 || (size_t)offset > length || size > length - (size_t)offset) {
+            return nullptr;
+        }
+        stats->addView();
+        return base + offset;
+    }
+    
+    int rawFd() const { return fd; }
+    
+    const char* name() const { return "mmap"; }
+};
+
+// Read-only handle to the bytes of one block. Points straight into the
+// mapping when the backend supports views, otherwise owns a private copy.
+class BlockRef {
+private:
+    const uint8_t* ptr;
+    shared_ptr<const vector<uint8_t>> owned;
+    
+public:
+    BlockRef() : ptr(nullptr) {}
+    explicit BlockRef(const uint8_t* view) : ptr(view) {}
+    explicit BlockRef(const shared_ptr<const vector<uint8_t>>& buffer)
+        : ptr(buffer->data()), owned(buffer) {}
+    
+    const uint8_t* data() const { return ptr; }
+    bool valid() const { return ptr != nullptr; }
+};
+
+// ============================================================================
+// BLOCK CACHE
+// ============================================================================
+
+// Fixed-capacity LRU cache of image blocks keyed by block number.
+// Buffers are reference counted, so a BlockRef handed out stays valid
+// after its block has been evicted.
+class BlockCache {
+public:
+    typedef shared_ptr<const vector<uint8_t>> Buffer;
+    
+private:
+    struct Entry {
+        uint32_t block;
+        Buffer data;
+    };
+    
+    size_t capacity;                // Maximum number of cached blocks
+    list<Entry> lru;                // Most recently used at the front
+    unordered_map<uint32_t, list<Entry>::iterator> index;
+    
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead_blocks;      // Blocks brought in by read-ahead
+    mutable mutex lock;             // Shared by all reader threads
+    
+public:
+    explicit BlockCache(size_t max_blocks = EXT2_CACHE_BLOCKS)
+        : capacity(max_blocks), hits(0), misses(0), readahead_blocks(0) {}
+    
+    void setCapacity(size_t max_blocks) {
+        lock_guard<mutex> guard(lock);
+        capacity = max_blocks;
+        while (lru.size() > capacity) {
+            index.erase(lru.back().block);
+            lru.pop_back();
+        }
+    }
+    
+    size_t getCapacity() const { return capacity; }
+    
+    // Drop every cached block (counters are kept)
+    void clear() {
+        lock_guard<mutex> guard(lock);
+        lru.clear();
+        index.clear();
+    }
+    
+    // Look up a block, counting a hit or a miss
+    Buffer lookup(uint32_t block) {
+        lock_guard<mutex> guard(lock);
+        auto it = index.find(block);
+        if (it == index.end()) {
+            misses++;
+            return Buffer();
+        }
+        
+        hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->data;
+    }
+    
+    // Forget one block (after it has been rewritten)
+    void erase(uint32_t block) {
+        lock_guard<mutex> guard(lock);
+        auto it = index.find(block);
+        if (it != index.end()) {
+            lru.erase(it->second);
+            index.erase(it);
+        }
+    }
+    
+    // Check for a block without touching counters or LRU order
+    bool contains(uint32_t block) const {
+        lock_guard<mutex> guard(lock);
+        return index.count(block) != 0;
+    }
+    
+    void insert(uint32_t block, const Buffer& data, bool readahead = false) {
+        lock_guard<mutex> guard(lock);
+        if (capacity == 0) {
+            return;
+        }
+        
+        auto it = index.find(block);
+        if (it != index.end()) {
+            it->second->data = data;
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+        
+        if (lru.size() >= capacity) {
+            index.erase(lru.back().block);
+            lru.pop_back();
+        }
+        
+        Entry entry = { block, data };
+        lru.push_front(entry);
+        index[block] = lru.begin();
+        
+        if (readahead) {
+            readahead_blocks++;
+        }
+    }
+    
+    uint64_t getHits() const { return hits; }
+    uint64_t getMisses() const { return misses; }
+    uint64_t getReadaheadBlocks() const { return readahead_blocks; }
+};
+
+// Tracks physical block order within one stream of reads and grows a
+// read-ahead window while the accesses stay sequential
+class SequentialDetector {
+private:
+    uint32_t next_block;
+    uint32_t streak;
+    
+public:
+    SequentialDetector() : next_block(0), streak(0) {}
+    
+    // Record an access and return how many blocks to read ahead of it
+    uint32_t access(uint32_t block) {
+        if (block != 0 && block == next_block) {
+            streak++;
+        } else {
+            streak = 0;
+        }
+        next_block = block + 1;
+        
+        if (streak < 2) {
+            return 0;
+        }
+        return min<uint32_t>(EXT2_READAHEAD_MAX, 1u << min<uint32_t>(streak, 5));
+    }
+};
+
+// ============================================================================
+// PACKED IMAGE BACKEND
+// ============================================================================
+
+// Reads a packed image (see the pack command): the image is split into
+// fixed-size chunks compressed independently with zlib, so a read only
+// decompresses the chunks it touches. Decompressed chunks are kept in a
+// small LRU cache; zero chunks are never stored or read.
+class CompressedBackend : public ImageBackend {
+private:
+    int fd;
+    ext2_pack_header header;
+    vector<ext2_pack_chunk> table;
+    BlockCache chunks;              // Decompressed chunks by chunk number
+    
+    CompressedBackend(int image_fd, const ext2_pack_header& pack_header,
+                      vector<ext2_pack_chunk>& chunk_table)
+        : fd(image_fd), header(pack_header), chunks(EXT2_PACK_CACHE_CHUNKS) {
+        table.swap(chunk_table);
+    }
+    
+    bool readFully(void* buffer, size_t size, off_t offset) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t bytes_read = pread(fd, (uint8_t*)buffer + done, size - done, offset + done);
+            stats->addReadSyscall();
+            if (bytes_read <= 0) {
+                return false;
+            }
+            done += bytes_read;
+        }
+        stats->addRead(offset, size);
+        return true;
+    }
+    
+    // Uncompressed length of a chunk
+    size_t chunkLength(uint64_t chunk) const {
+        return min<uint64_t>(header.chunk_size, header.image_size - chunk * header.chunk_size);
+    }
+    
+    // Decompressed contents of a (non-zero) chunk, from the cache if there
+    BlockCache::Buffer loadChunk(uint64_t chunk) {
+        BlockCache::Buffer cached = chunks.lookup((uint32_t)chunk);
+        if (cached) {
+            return cached;
+        }
+        
+        const ext2_pack_chunk& entry = table[chunk];
+        size_t length = chunkLength(chunk);
+        vector<uint8_t> stored(entry.length);
+        if (!readFully(stored.data(), stored.size(), entry.offset)) {
+            cerr << "Error: Failed to read chunk " << chunk << " of packed image" << endl;
+            return BlockCache::Buffer();
+        }
+        
+        shared_ptr<vector<uint8_t>> data;
+        if (entry.flags & EXT2_PACK_STORED) {
+            if (stored.size() != length) {
+                cerr << "Error: Chunk " << chunk << " of packed image is damaged" << endl;
+                return BlockCache::Buffer();
+            }
+            data = make_shared<vector<uint8_t>>();
+            data->swap(stored);
+        } else {
+            data = make_shared<vector<uint8_t>>(length);
+            uLongf unpacked = length;
+            if (uncompress(data->data(), &unpacked, stored.data(), stored.size()) != Z_OK) {
+                unpacked = 0;
+            }
+            if (unpacked != length) {
+                cerr << "Error: Chunk " << chunk << " of packed image is damaged" << endl;
+                return BlockCache::Buffer();
+            }
+        }
+        
+        chunks.insert((uint32_t)chunk, data);
+        return data;
+    }
+    
+public:
+    ~CompressedBackend() {
+        close(fd);
+    }
+    
+    // Whether an open file starts with a packed image header
+    static bool isPacked(int fd) {
+        char magic[8];
+        return pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+               memcmp(magic, EXT2_PACK_MAGIC, sizeof(magic)) == 0;
+    }
+    
+    // Open a packed image (taking over fd on success); returns nullptr if
+    // the header or chunk table is damaged
+    static CompressedBackend* create(int fd) {
+        struct stat st;
+        ext2_pack_header header;
+        if (fstat(fd, &st) < 0 ||
+            pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            memcmp(header.magic, EXT2_PACK_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != EXT2_PACK_VERSION || header.chunk_size == 0 ||
+            header.chunk_size > EXT2_PACK_MAX_CHUNK ||
+            header.chunk_count != (header.image_size + header.chunk_size - 1) / header.chunk_size ||
+            header.chunk_count > 0xFFFFFFFFull ||
+            header.table_offset > (uint64_t)st.st_size ||
+            header.chunk_count > ((uint64_t)st.st_size - header.table_offset) / sizeof(ext2_pack_chunk)) {
+            cerr << "Error: Damaged packed image header" << endl;
+            return nullptr;
+        }
+        
+        vector<ext2_pack_chunk> table(header.chunk_count);
+        size_t table_size = table.size() * sizeof(ext2_pack_chunk);
+        if (pread(fd, table.data(), table_size, header.table_offset) != (ssize_t)table_size) {
+            cerr << "Error: Failed to read chunk table of packed image" << endl;
+            return nullptr;
+        }
+        
+        // Stored chunks hold exactly the chunk's bytes, and compression is
+        // only kept when it saves space
+        for (uint64_t i = 0; i < table.size(); i++) {
+            const ext2_pack_chunk& entry = table[i];
+            bool zero = (entry.flags & EXT2_PACK_ZERO) != 0;
+            bool stored = (entry.flags & EXT2_PACK_STORED) != 0;
+            uint64_t length = min<uint64_t>(header.chunk_size, header.image_size - i * header.chunk_size);
+            if ((zero && entry.length != 0) || (!zero && entry.length == 0) ||
+                (stored && entry.length != length) || entry.length > length ||
+                entry.offset < sizeof(header) || entry.offset > header.table_offset ||
+                entry.length > header.table_offset - entry.offset) {
+                cerr << "Error: Damaged chunk table entry " << i << " in packed image" << endl;
+                return nullptr;
+            }
+        }
+        
+        return new CompressedBackend(fd, header, table);
+    }
+    
+    ssize_t readAt(void* buffer, size_t size, off_t offset) {
+        if (offset < 0) {
+            cerr << "Error: Offset " << offset << " is beyond end of image" << endl;
+            return -1;
+        }
+        if ((uint64_t)offset >= header.image_size) {
+            return 0;
+        }
+        size = min<uint64_t>(size, header.image_size - offset);
+        
+        size_t done = 0;
+        while (done < size) {
+            uint64_t position = offset + done;
+            uint64_t chunk = position / header.chunk_size;
+            size_t in_chunk = position % header.chunk_size;
+            size_t piece = min<size_t>(size - done, chunkLength(chunk) - in_chunk);
+            
+            if (table[chunk].flags & EXT2_PACK_ZERO) {
+                memset((uint8_t*)buffer + done, 0, piece);
+            } else {
+                BlockCache::Buffer data = loadChunk(chunk);
+                if (!data) {
+                    return -1;
+                }
+                memcpy((uint8_t*)buffer + done, data->data() + in_chunk, piece);
+                stats->addMemcpy(piece);
+            }
+            done += piece;
+        }
+        
+        return done;
+    }
+    
+    const char* name() const { return "packed"; }
+};
+
+// ============================================================================
+// DENTRY CACHE
+// ============================================================================
+
+// Caches (parent inode, name) -> inode lookups, including negative results.
+// Names are kept per directory. A directory read in full is stored whole
+// and marked complete, after which a missing name is known not to exist
+// without re-reading it. When the cache is full, whole directories are
+// evicted, least recently used first, so a complete directory never loses
+// some of its names.
+class DentryCache {
+private:
+    struct Dir {
+        unordered_map<string, uint32_t> names;  // 0 = known not to exist
+        bool complete;                          // names holds every entry
+        list<uint32_t>::iterator recent;        // Position in lru
+    };
+    
+    unordered_map<uint32_t, Dir> dirs;
+    list<uint32_t> lru;             // Cached directories, most recent first
+    size_t size;                    // Names cached over all directories
+    size_t capacity;
+    mutex lock;
+    
+    // The cached directory (created empty if needed), now most recent
+    Dir& touchLocked(uint32_t parent) {
+        auto it = dirs.find(parent);
+        if (it != dirs.end()) {
+            lru.splice(lru.begin(), lru, it->second.recent);
+            return it->second;
+        }
+        lru.push_front(parent);
+        Dir& dir = dirs[parent];
+        dir.complete = false;
+        dir.recent = lru.begin();
+        return dir;
+    }
+    
+    // Evict least recently used directories until count more names fit.
+    // The most recent directory (the one being filled) is kept.
+    void makeRoomLocked(size_t count) {
+        while (size + count > capacity && lru.size() > 1) {
+            auto victim = dirs.find(lru.back());
+            size -= victim->second.names.size();
+            dirs.erase(victim);
+            lru.pop_back();
+        }
+    }
+    
+    void clearLocked() {
+        dirs.clear();
+        lru.clear();
+        size = 0;
+    }
+    
+public:
+    explicit DentryCache(size_t max_entries = EXT2_DENTRY_CACHE_ENTRIES)
+        : size(0), capacity(max_entries) {}
+    
+    // Returns true if the answer is known; inode is 0 for a negative entry
+    bool lookup(uint32_t parent, const string& name, uint32_t& inode) {
+        lock_guard<mutex> guard(lock);
+        auto it = dirs.find(parent);
+        if (it == dirs.end()) {
+            return false;
+        }
+        
+        Dir& dir = touchLocked(parent);
+        auto found = dir.names.find(name);
+        if (found != dir.names.end()) {
+            inode = found->second;
+            return true;
+        }
+        if (dir.complete) {
+            inode = 0;
+            return true;
+        }
+        return false;
+    }
+    
+    void insert(uint32_t parent, const string& name, uint32_t inode) {
+        lock_guard<mutex> guard(lock);
+        Dir& dir = touchLocked(parent);
+        auto found = dir.names.find(name);
+        if (found != dir.names.end()) {
+            found->second = inode;
+            return;
+        }
+        
+        makeRoomLocked(1);
+        if (size + 1 > capacity) {
+            // Only this directory is left and it is full: start it over
+            size -= dir.names.size();
+            dir.names.clear();
+            dir.complete = false;
+        }
+        dir.names[name] = inode;
+        size++;
+    }
+    
+    // Replace what is cached for a directory with all of its entries and
+    // mark it complete. Returns false, caching nothing, if they can't fit.
+    bool fill(uint32_t parent, const vector<pair<string, uint32_t>>& entries) {
+        lock_guard<mutex> guard(lock);
+        if (entries.size() > capacity) {
+            return false;
+        }
+        
+        Dir& dir = touchLocked(parent);
+        size -= dir.names.size();
+        dir.names.clear();
+        makeRoomLocked(entries.size());
+        for (const auto& entry : entries) {
+            dir.names[entry.first] = entry.second;
+        }
+        size += dir.names.size();
+        dir.complete = true;
+        return true;
+    }
+    
+    void clear() {
+        lock_guard<mutex> guard(lock);
+        clearLocked();
+    }
+};
+
+// ============================================================================
+// METADATA INDEX
+// ============================================================================
+
+// Read-only view of an index file written by the index command: the
+// flattened directory tree, a hash table from full paths to tree nodes and
+// the run lists of files and directories. Paths are looked up as one hash
+// probe instead of a directory read per component.
+class MetadataIndex {
+private:
+    const uint8_t* base;
+    size_t length;
+    const ext2_index_header* header;
+    const ext2_index_node* nodes;
+    const uint32_t* buckets;
+    const ext2_index_inode* inodes;
+    const BlockRun* runs;
+    const char* names;
+    
+    void unmap() {
+        if (base) {
+            munmap((void*)base, length);
+        }
+        base = nullptr;
+        length = 0;
+        header = nullptr;
+    }
+    
+    // True if count items of item_size bytes at offset lie inside the file
+    bool sectionFits(uint64_t offset, uint64_t count, uint64_t item_size) const {
+        return offset <= length && count <= (length - offset) / item_size;
+    }
+    
+    // Does node spell out path (normalized, see normalizePath)?
+    bool nodeMatches(uint32_t index, const string& path) const {
+        size_t end = path.size();
+        while (index != 0) {
+            const ext2_index_node& node = nodes[index];
+            size_t len = node.name_len;
+            if (node.parent >= index || end < len + 1 ||
+                (uint64_t)node.name_offset + len > header->names_size ||
+                path[end - len - 1] != '/' ||
+                memcmp(path.data() + end - len, names + node.name_offset, len) != 0) {
+                return false;
+            }
+            end -= len + 1;
+            index = node.parent;
+        }
+        return end == 0;
+    }
+    
+public:
+    MetadataIndex()
+        : base(nullptr), length(0), header(nullptr), nodes(nullptr), buckets(nullptr),
+          inodes(nullptr), runs(nullptr), names(nullptr) {}
+    
+    ~MetadataIndex() {
+        unmap();
+    }
+    
+    // FNV-1a, extended one path at a time: hash of "/a/b" continues from
+    // the hash of "/a" with "/b"
+    static uint32_t extendHash(uint32_t hash, const char* data, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+        }
+        return hash;
+    }
+    
+    static uint32_t rootHash() { return 2166136261u; }
+    
+    // Lexically normalize a path into the form the index is keyed by:
+    // "/a/b" for nested entries and "" for the root. Empty components and
+    // "." are dropped, ".." removes the previous component.
+    static string normalizePath(const string& path) {
+        vector<string> parts;
+        size_t pos = 0;
+        while (pos <= path.size()) {
+            size_t next = path.find('/', pos);
+            if (next == string::npos) {
+                next = path.size();
+            }
+            string component = path.substr(pos, next - pos);
+            if (component == "..") {
+                if (!parts.empty()) {
+                    parts.pop_back();
+                }
+            } else if (!component.empty() && component != ".") {
+                parts.push_back(component);
+            }
+            pos = next + 1;
+        }
+        
+        string normalized;
+        for (size_t i = 0; i < parts.size(); i++) {
+            normalized += "/" + parts[i];
+        }
+        return normalized;
+    }
+    
+    // Map an index file and check it was built from this file system.
+    // Returns false (with a reason unless the file simply doesn't exist)
+    // if the index can't be used.
+    bool load(const string& path, const ext2_superblock& sb, uint32_t fs_block_size,
+              string& reason) {
+        unmap();
+        reason.clear();
+        
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        
+        struct stat st;
+        void* mapping = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ext2_index_header)) {
+            mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            reason = "not an index file";
+            return false;
+        }
+        base = (const uint8_t*)mapping;
+        length = st.st_size;
+        header = (const ext2_index_header*)base;
+        
+        if (memcmp(header->magic, EXT2_INDEX_MAGIC, sizeof(header->magic)) != 0) {
+            reason = "not an index file";
+        } else if (header->version != EXT2_INDEX_VERSION) {
+            reason = "index format version " + to_string(header->version) + " (rebuild it)";
+        } else if (memcmp(header->uuid, sb.s_uuid, sizeof(header->uuid)) != 0 ||
+                   header->block_size != fs_block_size) {
+            reason = "built from a different file system";
+        } else if (header->wtime != sb.s_wtime || header->mnt_count != sb.s_mnt_count ||
+                   header->free_blocks != sb.s_free_blocks_count ||
+                   header->free_inodes != sb.s_free_inodes_count) {
+            reason = "file system has been written since the index was built";
+        } else if (header->node_count == 0 || header->bucket_count == 0 ||
+                   (header->bucket_count & (header->bucket_count - 1)) != 0 ||
+                   !sectionFits(header->nodes_offset, header->node_count, sizeof(ext2_index_node)) ||
+                   !sectionFits(header->buckets_offset, header->bucket_count, sizeof(uint32_t)) ||
+                   !sectionFits(header->inodes_offset, header->inode_count, sizeof(ext2_index_inode)) ||
+                   !sectionFits(header->runs_offset, header->run_count, sizeof(BlockRun)) ||
+                   !sectionFits(header->names_offset, header->names_size, 1)) {
+            reason = "index file is truncated or corrupt";
+        }
+        
+        if (!reason.empty()) {
+            unmap();
+            return false;
+        }
+        
+        nodes = (const ext2_index_node*)(base + header->nodes_offset);
+        buckets = (const uint32_t*)(base + header->buckets_offset);
+        inodes = (const ext2_index_inode*)(base + header->inodes_offset);
+        runs = (const BlockRun*)(base + header->runs_offset);
+        names = (const char*)(base + header->names_offset);
+        return true;
+    }
+    
+    // True if path holds an index built from the file system with this
+    // UUID, current or not
+    static bool isIndexOf(const string& path, const ext2_superblock& sb) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        ext2_index_header file_header;
+        bool match = pread(fd, &file_header, sizeof(file_header), 0) == (ssize_t)sizeof(file_header) &&
+                     memcmp(file_header.magic, EXT2_INDEX_MAGIC, sizeof(file_header.magic)) == 0 &&
+                     memcmp(file_header.uuid, sb.s_uuid, sizeof(file_header.uuid)) == 0;
+        close(fd);
+        return match;
+    }
+    
+    bool loaded() const { return header != nullptr; }
+    
+    // Find the tree node for a path
+    bool lookup(const string& path, uint32_t& node_index) const {
+        string normalized = normalizePath(path);
+        uint32_t mask = header->bucket_count - 1;
+        uint32_t slot = extendHash(rootHash(), normalized.data(), normalized.size()) & mask;
+        
+        // Linear probing; the table is at most half full
+        for (uint32_t probes = 0; probes < header->bucket_count; probes++) {
+            uint32_t entry = buckets[slot];
+            if (entry == 0 || entry > header->node_count) {
+                return false;
+            }
+            if (nodeMatches(entry - 1, normalized)) {
+                node_index = entry - 1;
+                return true;
+            }
+            slot = (slot + 1) & mask;
+        }
+        return false;
+    }
+    
+    const ext2_index_node& node(uint32_t index) const { return nodes[index]; }
+    
+    // Children of a directory node (false if the node's range is corrupt)
+    bool children(uint32_t index, uint32_t& first, uint32_t& count) const {
+        const ext2_index_node& dir = nodes[index];
+        if (dir.first_child > header->node_count ||
+            dir.child_count > header->node_count - dir.first_child) {
+            return false;
+        }
+        first = dir.first_child;
+        count = dir.child_count;
+        return true;
+    }
+    
+    // Entry-style view of a node, name pointing into the mapping
+    DirEntryView entryView(uint32_t index) const {
+        const ext2_index_node& entry = nodes[index];
+        DirEntryView view;
+        view.inode = entry.inode;
+        view.file_type = entry.file_type;
+        view.name_len = (uint64_t)entry.name_offset + entry.name_len <= header->names_size
+                            ? entry.name_len : 0;
+        view.name = names + entry.name_offset;
+        return view;
+    }
+    
+    // Stored run list of an inode, if the index has one
+    bool inodeRuns(uint32_t inode_num, vector<BlockRun>& out) const {
+        const ext2_index_inode* end = inodes + header->inode_count;
+        const ext2_index_inode* it = lower_bound(inodes, end, inode_num,
+            [](const ext2_index_inode& entry, uint32_t value) {
+                return entry.inode < value;
+            });
+        if (it == end || it->inode != inode_num ||
+            it->first_run > header->run_count ||
+            it->run_count > header->run_count - it->first_run) {
+            return false;
+        }
+        out.assign(runs + it->first_run, runs + it->first_run + it->run_count);
+        return true;
+    }
+};
+
+// ============================================================================
+// THREAD POOL
+// ============================================================================
+
+// Work-stealing pool. Each worker owns a deque: tasks it submits go on the
+// back of its own deque and it works from the back (depth first, cache
+// warm), while idle workers steal from the front of other deques (oldest,
+// usually largest subtrees). Tasks submitted from outside the pool are
+// spread round-robin.
+class ThreadPool {
+private:
+    struct Queue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+    
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> workers;
+    atomic<size_t> queued;          // Tasks waiting in any deque
+    atomic<size_t> pending;         // Tasks submitted but not finished
+    atomic<size_t> next_queue;      // Round-robin for outside submissions
+    bool stopping;
+    mutex state_lock;
+    condition_variable work_ready;
+    condition_variable all_done;
+    
+    // Pool and deque index of the calling thread, if it is a worker. A
+    // task may build a pool of its own (a serve worker running du), so
+    // the index only means something to the pool it was set by.
+    static pair<const ThreadPool*, int>& currentWorker() {
+        static thread_local pair<const ThreadPool*, int> worker(nullptr, -1);
+        return worker;
+    }
+    
+    bool popLocal(size_t index, function<void()>& task) {
+        Queue& queue = *queues[index];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+    
+    bool steal(size_t thief, function<void()>& task) {
+        for (size_t i = 1; i < queues.size(); i++) {
+            Queue& queue = *queues[(thief + i) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (!queue.tasks.empty()) {
+                task = move(queue.tasks.front());
+                queue.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void workerLoop(size_t index) {
+        currentWorker() = make_pair(this, (int)index);
+        
+        while (true) {
+            function<void()> task;
+            if (popLocal(index, task) || steal(index, task)) {
+                queued--;
+                task();
+                if (--pending == 0) {
+                    lock_guard<mutex> guard(state_lock);
+                    all_done.notify_all();
+                }
+                continue;
+            }
+            
+            unique_lock<mutex> guard(state_lock);
+            work_ready.wait(guard, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+    
+public:
+    explicit ThreadPool(unsigned int threads)
+        : queued(0), pending(0), next_queue(0), stopping(false) {
+        threads = max(1u, threads);
+        for (unsigned int i = 0; i < threads; i++) {
+            queues.push_back(unique_ptr<Queue>(new Queue()));
+        }
+        for (unsigned int i = 0; i < threads; i++) {
+            workers.push_back(thread(&ThreadPool::workerLoop, this, i));
+        }
+    }
+    
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(state_lock);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (thread& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    void submit(function<void()> task) {
+        const pair<const ThreadPool*, int>& worker = currentWorker();
+        size_t index = worker.first == this ? (size_t)worker.second
+                                            : next_queue++ % queues.size();
+        
+        pending++;
+        {
+            lock_guard<mutex> guard(queues[index]->lock);
+            queues[index]->tasks.push_back(move(task));
+        }
+        queued++;
+        
+        lock_guard<mutex> guard(state_lock);
+        work_ready.notify_one();
+    }
+    
+    // Block until every submitted task (including tasks they submitted)
+    // has finished
+    void wait() {
+        unique_lock<mutex> guard(state_lock);
+        all_done.wait(guard, [this] { return pending == 0; });
+    }
+    
+    size_t size() const { return workers.size(); }
+};
+
+// ============================================================================
+// EXT2 FILE SYSTEM CLASS
+// ============================================================================
+
+class EXT2Parser {
+private:
+    unique_ptr<ImageBackend> image; // Source of image bytes
+    bool use_mmap;                  // Try to map the image on open()
+    BlockCache cache;               // Blocks read through a copying backend
+    unordered_map<uint32_t, shared_ptr<const vector<BlockRun>>> run_cache;  // Block maps by inode
+    mutex run_cache_lock;
+    DentryCache dcache;             // Name lookups by (parent inode, name)
+    IOStats stats;                  // Counters and timings for --stats
+    MetadataIndex index;            // Sidecar index, if one was found and is current
+    bool use_index;                 // Look for an index on open()
+    string index_path;              // Index file (empty: <image>.idx)
+    unsigned int thread_count;      // Workers for parallel walks
+    unsigned int io_depth;          // Files extracted concurrently by bulk copy
+    ext2_superblock superblock;     // Superblock
+    vector<ext2_group_desc> group_descs;  // Whole group descriptor table, indexed by group
+    uint32_t group_count;           // Number of block groups
+    uint32_t block_size;            // Block size in bytes
+    uint32_t inode_size;            // Inode size in bytes
+    bool writable;                  // open() the image read-write (cp-in)
+    vector<vector<uint8_t>> block_bitmaps;  // Bitmaps loaded for writing, by group
+    vector<vector<uint8_t>> inode_bitmaps;
+    vector<uint32_t> alloc_hint;    // Lowest block in each group that may be free
+    vector<bool> dirty_groups;      // Groups whose bitmaps changed since the last flush
+    bool metadata_dirty;            // Descriptors or superblock changed since the last flush
+    
+    // ========================================================================
+    // LOW-LEVEL I/O FUNCTIONS
+    // ========================================================================
+    
+    // Read bytes from disk at specified offset
+    ssize_t readBytes(void* buffer, size_t size, off_t offset) {
+        IOStats::Timer timer(stats, STAT_READ_BYTES);
+        return image->readAt(buffer, size, offset);
+    }
+    
+    // Zero-copy view of bytes on disk (nullptr if the backend can't map them)
+    const uint8_t* viewBytes(off_t offset, size_t size) {
+        return image->view(offset, size);
+    }
+    
+    // Read a complete block
+    bool readBlock(uint32_t block_num, void* buffer) {
+        IOStats::Timer timer(stats, STAT_READ_BLOCK);
+        off_t offset = (off_t)block_num * block_size;
+        ssize_t result = readBytes(buffer, block_size, offset);
+        return result == (ssize_t)block_size;
+    }
+    
+    // Get a block without copying when the image is mapped. Otherwise the
+    // block comes from the LRU cache; on a miss, up to readahead following
+    // blocks are fetched with the same read and cached as well.
+    BlockRef getBlock(uint32_t block_num, uint32_t readahead = 0) {
+        IOStats::Timer timer(stats, STAT_READ_BLOCK);
+        const uint8_t* view = viewBytes((off_t)block_num * block_size, block_size);
+        if (view) {
+            return BlockRef(view);
+        }
+        
+        BlockCache::Buffer cached = cache.lookup(block_num);
+        if (cached) {
+            return BlockRef(cached);
+        }
+        
+        // Never read past the end of the file system, and don't read ahead
+        // into a cache that can't hold the extra blocks
+        if (block_num >= superblock.s_blocks_count || cache.getCapacity() == 0) {
+            readahead = 0;
+        } else {
+            readahead = min(readahead, superblock.s_blocks_count - block_num - 1);
+        }
+        
+        uint32_t count = 1 + readahead;
+        vector<uint8_t> run((size_t)count * block_size);
+        ssize_t result = readBytes(run.data(), run.size(), (off_t)block_num * block_size);
+        if (result < (ssize_t)block_size) {
+            cerr << "Error: Failed to read block " << block_num << endl;
+            return BlockRef();
+        }
+        
+        // A short read just ends the read-ahead early
+        count = result / block_size;
+        BlockCache::Buffer first;
+        for (uint32_t i = 0; i < count; i++) {
+            if (i > 0 && cache.contains(block_num + i)) {
+                continue;
+            }
+            
+            const uint8_t* src = run.data() + (size_t)i * block_size;
+            BlockCache::Buffer buffer =
+                make_shared<const vector<uint8_t>>(src, src + block_size);
+            cache.insert(block_num + i, buffer, i > 0);
+            if (i == 0) {
+                first = buffer;
+            }
+        }
+        
+        return BlockRef(first);
+    }
+    
+    // ========================================================================
+    // EXT2 STRUCTURE PARSING
+    // ========================================================================
+    
+    // Read and validate superblock
+    bool readSuperblock() {
+        // Superblock is at offset 1024
+        if (readBytes(&superblock, sizeof(ext2_superblock), 1024) < 0) {
+            cerr << "Error: Failed to read superblock" << endl;
+            return false;
+        }
+        
+        // Validate magic number
+        if (superblock.s_magic != EXT2_SUPER_MAGIC) {
+            cerr << "Error: Invalid EXT2 magic number: 0x" 
+                 << hex << superblock.s_magic << dec << endl;
+            cerr << "Expected: 0xEF53" << endl;
+            return false;
+        }
+        
+        // Calculate block size
+        block_size = 1024 << superblock.s_log_block_size;
+        
+        // Get inode size
+        if (superblock.s_rev_level == 0) {
+            inode_size = 128;  // Old revision
+        } else {
+            inode_size = superblock.s_inode_size;
+        }
+        
+        return true;
+    }
+    
+    // Read the whole group descriptor table into one contiguous array
+    bool readGroupDescriptors() {
+        if (superblock.s_blocks_per_group == 0 || superblock.s_inodes_per_group == 0) {
+            cerr << "Error: Invalid blocks/inodes per group in superblock" << endl;
+            return false;
+        }
+        
+        group_count = (superblock.s_blocks_count - superblock.s_first_data_block +
+                       superblock.s_blocks_per_group - 1) / superblock.s_blocks_per_group;
+        
+        // Group descriptor table starts right after superblock
+        uint32_t gdt_block = superblock.s_first_data_block + 1;
+        off_t gdt_offset = (off_t)gdt_block * block_size;
+        size_t gdt_size = (size_t)group_count * sizeof(ext2_group_desc);
+        
+        group_descs.resize(group_count);
+        if (readBytes(group_descs.data(), gdt_size, gdt_offset) != (ssize_t)gdt_size) {
+            cerr << "Error: Failed to read group descriptor table" << endl;
+            group_descs.clear();
+            return false;
+        }
+        
+        return true;
+    }
+    
+    // First inode not reserved for the file system itself
+    uint32_t firstInode() const {
+        return superblock.s_rev_level == 0 ? 11 : superblock.s_first_ino;
+    }
+    
+    // First block and number of blocks covered by a group (the last group
+    // is usually shorter)
+    uint32_t groupFirstBlock(uint32_t group) const {
+        return superblock.s_first_data_block + group * superblock.s_blocks_per_group;
+    }
+    
+    uint32_t groupBlockCount(uint32_t group) const {
+        return min(superblock.s_blocks_per_group,
+                   superblock.s_blocks_count - groupFirstBlock(group));
+    }
+    
+    // Size in bytes. With the large_file feature, regular files keep the
+    // upper 32 bits of their size in i_dir_acl (i_size_high).
+    uint64_t fileSize(const ext2_inode& inode) const {
+        uint64_t size = inode.i_size;
+        if ((inode.i_mode & 0xF000) == EXT2_S_IFREG &&
+            (superblock.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+            size |= (uint64_t)inode.i_dir_acl << 32;
+        }
+        return size;
+    }
+    
+    // Read an inode by inode number
+    bool readInode(uint32_t inode_num, ext2_inode& inode) {
+        IOStats::Timer timer(stats, STAT_READ_INODE);
+        if (inode_num == 0 || inode_num > superblock.s_inodes_count) {
+            cerr << "Error: Invalid inode number: " << inode_num << endl;
+            return false;
+        }
+        
+        // Calculate inode location
+        // Inodes are numbered starting from 1
+        uint32_t inode_index = inode_num - 1;
+        uint32_t group = inode_index / superblock.s_inodes_per_group;
+        uint32_t local_index = inode_index % superblock.s_inodes_per_group;
+        
+        if (group >= group_count) {
+            cerr << "Error: Inode " << inode_num << " is in nonexistent group " << group << endl;
+            return false;
+        }
+        
+        // Neighbouring inodes share an inode-table block, so go through the
+        // block cache rather than reading each inode on its own
+        uint32_t byte_in_table = local_index * inode_size;
+        uint32_t table_block = group_descs[group].bg_inode_table + byte_in_table / block_size;
+        
+        BlockRef block = getBlock(table_block);
+        if (!block.valid()) {
+            cerr << "Error: Failed to read inode " << inode_num << endl;
+            return false;
+        }
+        
+        memcpy(&inode, block.data() + byte_in_table % block_size, sizeof(ext2_inode));
+        return true;
+    }
+    
+    // Read many inodes at once. The inodes are sorted by their position in
+    // the inode tables, each needed stretch of table blocks is read with a
+    // single large read (small gaps are read through rather than split),
+    // and results are returned in the order of inode_nums. loaded[i] is
+    // false for inodes that could not be read; returns false if any failed.
+    bool readInodes(const vector<uint32_t>& inode_nums, vector<ext2_inode>& inodes,
+                    vector<bool>& loaded) {
+        IOStats::Timer timer(stats, STAT_READ_INODES);
+        inodes.assign(inode_nums.size(), ext2_inode());
+        loaded.assign(inode_nums.size(), false);
+        bool all_loaded = true;
+        
+        // (byte offset in image, index into inode_nums)
+        vector<pair<uint64_t, size_t>> wanted;
+        wanted.reserve(inode_nums.size());
+        
+        for (size_t i = 0; i < inode_nums.size(); i++) {
+            uint32_t inode_num = inode_nums[i];
+            if (inode_num == 0 || inode_num > superblock.s_inodes_count) {
+                cerr << "Error: Invalid inode number: " << inode_num << endl;
+                all_loaded = false;
+                continue;
+            }
+            
+            uint32_t group = (inode_num - 1) / superblock.s_inodes_per_group;
+            uint32_t local_index = (inode_num - 1) % superblock.s_inodes_per_group;
+            if (group >= group_count) {
+                all_loaded = false;
+                continue;
+            }
+            
+            uint64_t offset = (uint64_t)group_descs[group].bg_inode_table * block_size +
+                              (uint64_t)local_index * inode_size;
+            wanted.push_back(make_pair(offset, i));
+        }
+        
+        sort(wanted.begin(), wanted.end());
+        
+        vector<uint8_t> buffer;
+        size_t pos = 0;
+        while (pos < wanted.size()) {
+            // Grow a range of table blocks while the next inode is close by
+            uint64_t first_block = wanted[pos].first / block_size;
+            uint64_t last_block = first_block;
+            size_t end = pos + 1;
+            while (end < wanted.size()) {
+                uint64_t block = wanted[end].first / block_size;
+                if (block > last_block + EXT2_INODE_BATCH_GAP ||
+                    block - first_block >= EXT2_INODE_BATCH_BLOCKS) {
+                    break;
+                }
+                last_block = block;
+                end++;
+            }
+            
+            off_t range_offset = (off_t)(first_block * block_size);
+            size_t range_size = (size_t)(last_block - first_block + 1) * block_size;
+            
+            const uint8_t* range = viewBytes(range_offset, range_size);
+            if (!range) {
+                buffer.resize(range_size);
+                if (readBytes(buffer.data(), range_size, range_offset) != (ssize_t)range_size) {
+                    cerr << "Error: Failed to read inode table at block " << first_block << endl;
+                    all_loaded = false;
+                    pos = end;
+                    continue;
+                }
+                range = buffer.data();
+            }
+            
+            for (size_t i = pos; i < end; i++) {
+                size_t index = wanted[i].second;
+                memcpy(&inodes[index], range + (wanted[i].first - range_offset), sizeof(ext2_inode));
+                loaded[index] = true;
+            }
+            pos = end;
+        }
+        
+        return all_loaded;
+    }
+    
+    // Called for every in-use inode found by a table scan
+    typedef function<void(uint32_t inode_num, const ext2_inode& inode)> InodeVisitor;
+    
+    // Visit every in-use inode of one group. The inode bitmap is scanned a
+    // 64-bit word at a time (count-trailing-zeros per set bit, whole zero
+    // words skipped), and the inode table is read sequentially in
+    // EXT2_SCAN_CHUNK pieces; chunks with no used inodes are not read.
+    bool scanGroupInodes(uint32_t group, const InodeVisitor& visit) {
+        const ext2_group_desc& gd = group_descs[group];
+        uint32_t per_group = superblock.s_inodes_per_group;
+        uint32_t first_inode = group * per_group + 1;
+        
+        BlockRef bitmap_block = getBlock(gd.bg_inode_bitmap);
+        if (!bitmap_block.valid()) {
+            return false;
+        }
+        
+        // Copy into whole words so the tail can be masked off
+        vector<uint64_t> bitmap((per_group + 63) / 64, 0);
+        memcpy(bitmap.data(), bitmap_block.data(), min<size_t>((per_group + 7) / 8, block_size));
+        if (per_group % 64) {
+            bitmap.back() &= (1ULL << (per_group % 64)) - 1;
+        }
+        
+        uint32_t inodes_per_chunk = max<uint32_t>(1, EXT2_SCAN_CHUNK / inode_size);
+        vector<uint8_t> buffer;
+        
+        for (uint32_t chunk_start = 0; chunk_start < per_group; chunk_start += inodes_per_chunk) {
+            uint32_t chunk_end = min(per_group, chunk_start + inodes_per_chunk);
+            const uint8_t* table = nullptr;
+            
+            for (uint32_t word = chunk_start / 64; word * 64 < chunk_end; word++) {
+                uint64_t bits = bitmap[word];
+                while (bits) {
+                    uint32_t index = word * 64 + __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    if (index < chunk_start || index >= chunk_end) {
+                        continue;
+                    }
+                    
+                    // First used inode in this chunk: read the chunk
+                    if (!table) {
+                        off_t offset = (off_t)gd.bg_inode_table * block_size +
+                                       (off_t)chunk_start * inode_size;
+                        size_t size = (size_t)(chunk_end - chunk_start) * inode_size;
+                        table = viewBytes(offset, size);
+                        if (!table) {
+                            buffer.resize(size);
+                            if (readBytes(buffer.data(), size, offset) != (ssize_t)size) {
+                                cerr << "Error: Failed to read inode table of group "
+                                     << group << endl;
+                                return false;
+                            }
+                            table = buffer.data();
+                        }
+                    }
+                    
+                    ext2_inode inode;
+                    memcpy(&inode, table + (size_t)(index - chunk_start) * inode_size,
+                           sizeof(ext2_inode));
+                    visit(first_inode + index, inode);
+                }
+            }
+        }
+        
+        return true;
+    }
+    
+    // ========================================================================
+    // DATA BLOCK READING
+    // ========================================================================
+    
+    // Append one block to a run list, extending the last run when the block
+    // follows it both logically and physically
+    static void appendRun(vector<BlockRun>& runs, uint32_t logical, uint32_t physical) {
+        if (!runs.empty()) {
+            BlockRun& last = runs.back();
+            if (last.logical + last.length == logical &&
+                last.physical + last.length == physical) {
+                last.length++;
+                return;
+            }
+        }
+        
+        BlockRun run = { logical, physical, 1 };
+        runs.push_back(run);
+    }
+    
+    // Walk one indirect block of the given depth (1 = single, 2 = double,
+    // 3 = triple). A zero pointer at any level is a hole covering that
+    // whole subtree, so logical advances past it without reading anything.
+    // The indirect blocks themselves are appended to indirect if given.
+    bool mapIndirect(uint32_t block_num, int depth, uint32_t& logical,
+                     uint32_t blocks_needed, vector<BlockRun>& runs,
+                     vector<uint32_t>* indirect) {
+        uint32_t entries = block_size / sizeof(uint32_t);
+        uint64_t span = 1;
+        for (int i = 1; i < depth; i++) {
+            span *= entries;
+        }
+        
+        if (block_num == 0) {
+            logical = (uint32_t)min<uint64_t>((uint64_t)logical + span * entries, blocks_needed);
+            return true;
+        }
+        
+        BlockRef pointer_block = getBlock(block_num);
+        if (!pointer_block.valid()) {
+            return false;
+        }
+        if (indirect) {
+            indirect->push_back(block_num);
+        }
+        
+        const uint32_t* pointers = (const uint32_t*)pointer_block.data();
+        for (uint32_t i = 0; i < entries && logical < blocks_needed; i++) {
+            if (depth == 1) {
+                if (pointers[i] != 0) {
+                    appendRun(runs, logical, pointers[i]);
+                }
+                logical++;
+            } else if (pointers[i] == 0) {
+                logical = (uint32_t)min<uint64_t>((uint64_t)logical + span, blocks_needed);
+            } else if (!mapIndirect(pointers[i], depth - 1, logical, blocks_needed, runs, indirect)) {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    // Build the list of physically contiguous runs holding an inode's data:
+    // 12 direct blocks, then the single, double and triple indirect trees.
+    // Holes (zero pointers) are simply absent from the list. If indirect is
+    // given it receives every indirect block of the tree.
+    bool mapInodeBlocks(const ext2_inode& inode, vector<BlockRun>& runs,
+                        vector<uint32_t>* indirect = nullptr) {
+        runs.clear();
+        if (indirect) {
+            indirect->clear();
+        }
+        
+        uint32_t blocks_needed = (uint32_t)((fileSize(inode) + block_size - 1) / block_size);
+        uint32_t logical = 0;
+        
+        // Direct blocks
+        for (int i = 0; i < 12 && logical < blocks_needed; i++, logical++) {
+            if (inode.i_block[i] != 0) {
+                appendRun(runs, logical, inode.i_block[i]);
+            }
+        }
+        
+        // Single, double and triple indirect blocks
+        for (int depth = 1; depth <= 3 && logical < blocks_needed; depth++) {
+            if (!mapIndirect(inode.i_block[11 + depth], depth, logical, blocks_needed, runs,
+                             indirect)) {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    // Run list for an inode, resolved once and then served from the
+    // per-inode cache so repeated and random-offset reads skip the walk
+    // of the indirect tree
+    shared_ptr<const vector<BlockRun>> getBlockMap(uint32_t inode_num, const ext2_inode& inode) {
+        {
+            lock_guard<mutex> guard(run_cache_lock);
+            auto it = run_cache.find(inode_num);
+            if (it != run_cache.end()) {
+                return it->second;
+            }
+        }
+        
+        // Take the list from the index if it has one, otherwise walk the
+        // tree without holding the lock; two threads racing on the same
+        // inode just build the same list twice
+        shared_ptr<vector<BlockRun>> runs = make_shared<vector<BlockRun>>();
+        if (!(index.loaded() && index.inodeRuns(inode_num, *runs)) &&
+            !mapInodeBlocks(inode, *runs)) {
+            return shared_ptr<const vector<BlockRun>>();
+        }
+        
+        // Keep the cache bounded; dropping an arbitrary entry is fine since a
+        // miss only costs one walk of the tree
+        lock_guard<mutex> guard(run_cache_lock);
+        if (run_cache.size() >= EXT2_RUN_CACHE_INODES) {
+            run_cache.erase(run_cache.begin());
+        }
+        run_cache[inode_num] = runs;
+        return runs;
+    }
+    
+    // Physical block holding a logical file block (0 for a hole or past EOF)
+    static uint32_t lookupRun(const vector<BlockRun>& runs, uint32_t logical) {
+        // First run starting after logical, then step back one
+        auto it = upper_bound(runs.begin(), runs.end(), logical,
+                              [](uint32_t value, const BlockRun& run) {
+                                  return value < run.logical;
+                              });
+        if (it == runs.begin()) {
+            return 0;
+        }
+        --it;
+        
+        if (logical >= it->logical + it->length) {
+            return 0;
+        }
+        return it->physical + (logical - it->logical);
+    }
+    
+    // Read data from inode (direct, single, double and triple indirect
+    // blocks; holes read as zeros)
+    bool readInodeData(uint32_t inode_num, const ext2_inode& inode, vector<uint8_t>& data) {
+        shared_ptr<const vector<BlockRun>> runs = getBlockMap(inode_num, inode);
+        if (!runs) {
+            return false;
+        }
+        
+        data.assign(fileSize(inode), 0);
+        SequentialDetector pattern;
+        
+        for (const BlockRun& run : *runs) {
+            for (uint32_t i = 0; i < run.length; i++) {
+                uint64_t start = (uint64_t)(run.logical + i) * block_size;
+                if (start >= data.size()) {
+                    return true;
+                }
+                
+                uint32_t physical = run.physical + i;
+                BlockRef block = getBlock(physical, pattern.access(physical));
+                if (!block.valid()) {
+                    return false;
+                }
+                
+                size_t to_copy = min<uint64_t>(block_size, data.size() - start);
+                memcpy(data.data() + start, block.data(), to_copy);
+            }
+        }
+        
+        return true;
+    }
+    
+    // Read size bytes starting at byte offset of a file into buffer.
+    // Returns the number of bytes read (short at end of file) or -1.
+    ssize_t readInodeRange(uint32_t inode_num, const ext2_inode& inode,
+                           uint64_t offset, size_t size, uint8_t* buffer) {
+        shared_ptr<const vector<BlockRun>> runs = getBlockMap(inode_num, inode);
+        if (!runs) {
+            return -1;
+        }
+        
+        uint64_t file_size = fileSize(inode);
+        if (offset >= file_size) {
+            return 0;
+        }
+        size = min<uint64_t>(size, file_size - offset);
+        
+        size_t done = 0;
+        while (done < size) {
+            uint64_t position = offset + done;
+            uint32_t logical = (uint32_t)(position / block_size);
+            uint32_t in_block = (uint32_t)(position % block_size);
+            size_t piece = min<size_t>(size - done, block_size - in_block);
+            
+            uint32_t physical = lookupRun(*runs, logical);
+            if (physical == 0) {
+                memset(buffer + done, 0, piece);
+            } else {
+                BlockRef block = getBlock(physical);
+                if (!block.valid()) {
+                    return -1;
+                }
+                memcpy(buffer + done, block.data() + in_block, piece);
+            }
+            done += piece;
+        }
+        
+        return done;
+    }
+    
+    // ========================================================================
+    // STREAMING EXTRACTION
+    // ========================================================================
+    
+    // Write all of buffer at offset (or at the current position if the
+    // output can't seek, e.g. a pipe)
+    bool writeAll(int out_fd, const uint8_t* buffer, size_t size,
+                  off_t offset, bool seekable) {
+        while (size > 0) {
+            ssize_t written = seekable ? pwrite(out_fd, buffer, size, offset)
+                                       : write(out_fd, buffer, size);
+            if (written <= 0) {
+                return false;
+            }
+            stats.addWrite(written);
+            buffer += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+    
+    // Write size zero bytes at offset
+    bool writeZeros(int out_fd, off_t offset, uint64_t size, bool seekable,
+                    vector<uint8_t>& chunk) {
+        while (size > 0) {
+            size_t piece = min<uint64_t>(size, EXT2_COPY_CHUNK);
+            chunk.assign(max<size_t>(chunk.size(), piece), 0);
+            if (!writeAll(out_fd, chunk.data(), piece, offset, seekable)) {
+                return false;
+            }
+            offset += piece;
+            size -= piece;
+        }
+        return true;
+    }
+    
+    // Copy size bytes of the image starting at image_offset to the output.
+    // Tries, in order: an in-kernel copy_file_range, a write straight out of
+    // the mapping, and bounded reads through a chunk buffer.
+    bool copyImageRange(off_t image_offset, uint64_t size, int out_fd, off_t out_offset,
+                        bool& use_kernel_copy, bool seekable, vector<uint8_t>& chunk) {
+        int in_fd = image->rawFd();
+        
+        while (use_kernel_copy && size > 0) {
+            loff_t in_pos = image_offset;
+            loff_t out_pos = out_offset;
+            ssize_t copied = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, size, 0);
+            if (copied <= 0) {
+                // Unsupported here (old kernel, cross-device, ...): fall back
+                use_kernel_copy = false;
+                break;
+            }
+            stats.addKernelCopy(copied);
+            image_offset += copied;
+            out_offset += copied;
+            size -= copied;
+        }
+        
+        if (size == 0) {
+            return true;
+        }
+        
+        const uint8_t* view = viewBytes(image_offset, size);
+        if (view) {
+            return writeAll(out_fd, view, size, out_offset, seekable);
+        }
+        
+        while (size > 0) {
+            size_t piece = min<uint64_t>(size, EXT2_COPY_CHUNK);
+            chunk.resize(max<size_t>(chunk.size(), piece));
+            
+            if (readBytes(chunk.data(), piece, image_offset) != (ssize_t)piece) {
+                cerr << "Error: Failed to read " << piece << " bytes at offset "
+                     << image_offset << endl;
+                return false;
+            }
+            if (!writeAll(out_fd, chunk.data(), piece, out_offset, seekable)) {
+                return false;
+            }
+            image_offset += piece;
+            out_offset += piece;
+            size -= piece;
+        }
+        
+        return true;
+    }
+    
+    // Stream an inode's data to out_fd one physical run at a time. Memory use
+    // is bounded by EXT2_COPY_CHUNK regardless of the file size. Holes in the
+    // block map stay holes in a regular output file (runs are written at
+    // their offsets and the file is extended with ftruncate), so time and
+    // space scale with the allocated data; pipes get the zeros written.
+    bool streamInodeData(uint32_t inode_num, const ext2_inode& inode, int out_fd,
+                         uint64_t& bytes_written) {
+        bytes_written = 0;
+        
+        shared_ptr<const vector<BlockRun>> runs = getBlockMap(inode_num, inode);
+        if (!runs) {
+            return false;
+        }
+        
+        struct stat out_st;
+        bool regular_out = fstat(out_fd, &out_st) == 0 && S_ISREG(out_st.st_mode);
+        bool seekable = lseek(out_fd, 0, SEEK_CUR) != -1;
+        bool use_kernel_copy = regular_out && seekable && image->rawFd() >= 0;
+        bool keep_holes = regular_out && seekable;
+        vector<uint8_t> chunk;
+        
+        uint64_t file_size = fileSize(inode);
+        for (const BlockRun& run : *runs) {
+            uint64_t start = (uint64_t)run.logical * block_size;
+            if (start >= file_size) {
+                break;
+            }
+            
+            // Holes before this run are skipped over, or written as zeros
+            // when the output can't have holes
+            if (!keep_holes &&
+                !writeZeros(out_fd, bytes_written, start - bytes_written, seekable, chunk)) {
+                return false;
+            }
+            
+            uint64_t length = min<uint64_t>((uint64_t)run.length * block_size, file_size - start);
+            if (!copyImageRange((off_t)run.physical * block_size, length, out_fd, start,
+                                use_kernel_copy, seekable, chunk)) {
+                return false;
+            }
+            bytes_written = start + length;
+        }
+        
+        // Trailing hole
+        if (keep_holes) {
+            if (ftruncate(out_fd, file_size) < 0) {
+                cerr << "Error: Failed to set output size to " << file_size << endl;
+                return false;
+            }
+        } else if (!writeZeros(out_fd, bytes_written, file_size - bytes_written, seekable, chunk)) {
+            return false;
+        }
+        bytes_written = file_size;
+        
+        return true;
+    }
+    
+    // One chunk of a packed image on its way to the output
+    struct PackChunk {
+        vector<uint8_t> buffer;     // Read buffer when there is no view
+        vector<uint8_t> stored;     // Bytes to write
+        uint32_t flags;             // EXT2_PACK_ZERO, EXT2_PACK_STORED
+        bool ok;
+    };
+    
+    // Fill one chunk of a packed image: zero chunks store nothing, others
+    // store zlib output, or the raw bytes if compressing doesn't help
+    void packChunk(PackChunk& chunk, uint64_t offset, size_t length) {
+        chunk.flags = 0;
+        chunk.stored.clear();
+        
+        const uint8_t* data = viewBytes(offset, length);
+        if (!data) {
+            chunk.buffer.resize(length);
+            chunk.ok = readBytes(chunk.buffer.data(), length, offset) == (ssize_t)length;
+            if (!chunk.ok) {
+                return;
+            }
+            data = chunk.buffer.data();
+        }
+        chunk.ok = true;
+        
+        if (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0) {
+            chunk.flags = EXT2_PACK_ZERO;
+            return;
+        }
+        
+        uLongf packed_length = compressBound(length);
+        chunk.stored.resize(packed_length);
+        if (compress2(chunk.stored.data(), &packed_length, data, length, EXT2_PACK_LEVEL) == Z_OK &&
+            packed_length < length) {
+            chunk.stored.resize(packed_length);
+        } else {
+            chunk.stored.assign(data, data + length);
+            chunk.flags = EXT2_PACK_STORED;
+        }
+    }
+    
+    // CRC32C of an inode's data, read run by run from its block map (out of
+    // the mapping when there is one). Holes are folded in as zeros without
+    // reading anything; bytes_read counts only the allocated data.
+    bool hashInodeData(uint32_t inode_num, const ext2_inode& inode, uint32_t& crc,
+                       uint64_t& bytes_read, vector<uint8_t>& chunk) {
+        shared_ptr<const vector<BlockRun>> runs = getBlockMap(inode_num, inode);
+        if (!runs) {
+            return false;
+        }
+        
+        uint32_t state = 0xFFFFFFFF;
+        uint64_t file_size = fileSize(inode);
+        uint64_t hashed = 0;
+        for (const BlockRun& run : *runs) {
+            uint64_t start = (uint64_t)run.logical * block_size;
+            if (start >= file_size) {
+                break;
+            }
+            state = crc32cZeros(state, start - hashed);
+            
+            uint64_t length = min<uint64_t>((uint64_t)run.length * block_size, file_size - start);
+            off_t offset = (off_t)run.physical * block_size;
+            for (uint64_t done = 0; done < length; ) {
+                size_t piece = min<uint64_t>(length - done, EXT2_COPY_CHUNK);
+                const uint8_t* data = viewBytes(offset + done, piece);
+                if (!data) {
+                    chunk.resize(max<size_t>(chunk.size(), piece));
+                    if (readBytes(chunk.data(), piece, offset + done) != (ssize_t)piece) {
+                        cerr << "Error: Failed to read " << piece << " bytes at offset "
+                             << offset + done << endl;
+                        return false;
+                    }
+                    data = chunk.data();
+                }
+                state = crc32cUpdate(state, data, piece);
+                bytes_read += piece;
+                done += piece;
+            }
+            hashed = start + length;
+        }
+        state = crc32cZeros(state, file_size - hashed);
+        
+        crc = ~state;
+        return true;
+    }
+    
+    // Offsets of every occurrence of the matcher's pattern in an inode's
+    // data, read run by run like hashInodeData. Holes are handed to the
+    // matcher as zeros without reading anything.
+    bool searchInodeData(uint32_t inode_num, const ext2_inode& inode, LiteralMatcher& matcher,
+                         vector<uint64_t>& matches, vector<uint8_t>& chunk) {
+        shared_ptr<const vector<BlockRun>> runs = getBlockMap(inode_num, inode);
+        if (!runs) {
+            return false;
+        }
+        
+        matcher.reset();
+        uint64_t file_size = fileSize(inode);
+        uint64_t searched = 0;
+        for (const BlockRun& run : *runs) {
+            uint64_t start = (uint64_t)run.logical * block_size;
+            if (start >= file_size) {
+                break;
+            }
+            matcher.feedZeros(start - searched, searched, matches);
+            
+            uint64_t length = min<uint64_t>((uint64_t)run.length * block_size, file_size - start);
+            off_t offset = (off_t)run.physical * block_size;
+            for (uint64_t done = 0; done < length; ) {
+                size_t piece = min<uint64_t>(length - done, EXT2_COPY_CHUNK);
+                const uint8_t* data = viewBytes(offset + done, piece);
+                if (!data) {
+                    chunk.resize(max<size_t>(chunk.size(), piece));
+                    if (readBytes(chunk.data(), piece, offset + done) != (ssize_t)piece) {
+                        cerr << "Error: Failed to read " << piece << " bytes at offset "
+                             << offset + done << endl;
+                        return false;
+                    }
+                    data = chunk.data();
+                }
+                matcher.feed(data, piece, start + done, matches);
+                done += piece;
+            }
+            searched = start + length;
+        }
+        matcher.feedZeros(file_size - searched, searched, matches);
+        return true;
+    }
+    
+    // Whether two inodes hold the same bytes (confirms a hash match)
+    bool sameInodeData(uint32_t inode_a, const ext2_inode& a, uint32_t inode_b,
+                       const ext2_inode& b) {
+        uint64_t size = fileSize(a);
+        if (size != fileSize(b)) {
+            return false;
+        }
+        
+        const size_t piece = 64 * 1024;
+        vector<uint8_t> data_a(piece), data_b(piece);
+        for (uint64_t offset = 0; offset < size; offset += piece) {
+            ssize_t got_a = readInodeRange(inode_a, a, offset, piece, data_a.data());
+            ssize_t got_b = readInodeRange(inode_b, b, offset, piece, data_b.data());
+            if (got_a <= 0 || got_a != got_b || memcmp(data_a.data(), data_b.data(), got_a) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // ========================================================================
+    // DIRECTORY PARSING
+    // ========================================================================
+    
+    // Step to the next live entry of one directory block. Entries with
+    // inode 0 (deleted or padding) are skipped rather than ending the walk.
+    // Returns false at the end of the block or on a malformed record, with
+    // corrupt set in the latter case.
+    bool nextInDirBlock(const uint8_t* block, uint32_t& offset, DirEntryView& view,
+                        bool& corrupt) const {
+        corrupt = false;
+        while (offset + 8 <= block_size) {
+            const ext2_dir_entry* entry = (const ext2_dir_entry*)(block + offset);
+            uint16_t rec_len = entry->rec_len;
+            
+            if (rec_len < 8 || (rec_len & 3) != 0 || offset + rec_len > block_size ||
+                8u + entry->name_len > rec_len) {
+                corrupt = true;
+                return false;
+            }
+            offset += rec_len;
+            
+            if (entry->inode != 0) {
+                view.inode = entry->inode;
+                view.file_type = entry->file_type;
+                view.name_len = entry->name_len;
+                view.name = entry->name;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Walks every entry of a directory block by block, straight over the
+    // block bytes (mapping or cache buffer). Holds only the current block.
+    class DirIterator {
+    private:
+        EXT2Parser& fs;
+        shared_ptr<const vector<BlockRun>> runs;
+        uint32_t total_blocks;      // Directory size in blocks
+        uint32_t logical;           // Logical block being walked
+        uint32_t offset;            // Offset of the next record in it
+        BlockRef block;
+        SequentialDetector pattern;
+        bool error;
+        
+    public:
+        DirIterator(EXT2Parser& parser, uint32_t dir_inode_num, const ext2_inode& dir_inode)
+            : fs(parser), total_blocks(0), logical(0), offset(0), error(false) {
+            runs = fs.getBlockMap(dir_inode_num, dir_inode);
+            if (!runs) {
+                error = true;
+                return;
+            }
+            total_blocks = (dir_inode.i_size + fs.block_size - 1) / fs.block_size;
+        }
+        
+        // Produce the next entry; returns false when the directory is done
+        bool next(DirEntryView& view) {
+            while (!error && logical < total_blocks) {
+                if (!block.valid()) {
+                    uint32_t physical = lookupRun(*runs, logical);
+                    if (physical == 0) {
+                        logical++;      // Hole: no entries here
+                        continue;
+                    }
+                    block = fs.getBlock(physical, pattern.access(physical));
+                    if (!block.valid()) {
+                        error = true;
+                        return false;
+                    }
+                    offset = 0;
+                    fs.stats.addDirBlock();
+                }
+                
+                bool corrupt;
+                if (fs.nextInDirBlock(block.data(), offset, view, corrupt)) {
+                    fs.stats.addDirEntry();
+                    return true;
+                }
+                if (corrupt) {
+                    cerr << "Warning: Malformed directory entry in block " << logical
+                         << ", skipping rest of block" << endl;
+                }
+                block = BlockRef();
+                logical++;
+            }
+            return false;
+        }
+        
+        // Block holding the entry last returned (keeps its name alive)
+        const BlockRef& currentBlock() const { return block; }
+        
+        bool failed() const { return error; }
+    };
+    
+    // Find a file in directory by name. Answers come from the dentry cache;
+    // on a miss, indexed directories are searched through their htree and
+    // only that answer is cached. Unindexed directories are read once and
+    // all of their entries are cached, so further lookups in them (hits or
+    // misses) cost no I/O; one too large for the cache caches only the
+    // answer.
+    bool findFileInDirectory(uint32_t dir_inode_num, const string& filename, 
+                            uint32_t& found_inode) {
+        if (dcache.lookup(dir_inode_num, filename, found_inode)) {
+            return found_inode != 0;
+        }
+        
+        IOStats::Timer timer(stats, STAT_DIR_LOOKUP);
+        ext2_inode dir_inode;
+        if (!readInode(dir_inode_num, dir_inode)) {
+            return false;
+        }
+        
+        // Check if it's a directory
+        if ((dir_inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
+            cerr << "Error: Inode " << dir_inode_num << " is not a directory" << endl;
+            return false;
+        }
+        
+        // Hashed lookup for indexed directories
+        if ((superblock.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+            (dir_inode.i_flags & EXT2_INDEX_FL)) {
+            bool usable;
+            bool found = htreeLookup(dir_inode_num, dir_inode, filename, found_inode, usable);
+            if (usable) {
+                dcache.insert(dir_inode_num, filename, found ? found_inode : 0);
+                return found;
+            }
+        }
+        
+        // Linear fallback: read every entry and cache the directory whole,
+        // or just this answer if the directory is larger than the cache
+        vector<pair<string, uint32_t>> entries;
+        DirIterator it(*this, dir_inode_num, dir_inode);
+        DirEntryView entry;
+        found_inode = 0;
+        while (it.next(entry)) {
+            if (found_inode == 0 && entry.nameEquals(filename)) {
+                found_inode = entry.inode;
+            }
+            entries.push_back(make_pair(entry.nameString(), entry.inode));
+        }
+        if (it.failed()) {
+            return false;
+        }
+        
+        if (!dcache.fill(dir_inode_num, entries)) {
+            dcache.insert(dir_inode_num, filename, found_inode);
+        }
+        return found_inode != 0;
+    }
+    
+    // Search one directory block for a name (linear scan of its entries)
+    bool findInDirBlock(const uint8_t* block, const string& name, uint32_t& found_inode) {
+        uint32_t offset = 0;
+        DirEntryView entry;
+        bool corrupt;
+        stats.addDirBlock();
+        while (nextInDirBlock(block, offset, entry, corrupt)) {
+            stats.addDirEntry();
+            if (entry.nameEquals(name)) {
+                found_inode = entry.inode;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Look a name up in an indexed (htree) directory, touching only the
+    // index blocks on the path to the name's hash and the leaf block(s)
+    // that can hold it. Returns false in "usable" if the index can't be
+    // used (unknown hash, bad layout, a block on the path that can't be
+    // read), in which case the caller falls back to a linear scan; a
+    // negative answer is only reported once every leaf was searched.
+    bool htreeLookup(uint32_t dir_inode_num, const ext2_inode& dir_inode, const string& name,
+                     uint32_t& found_inode, bool& usable) {
+        usable = false;
+        found_inode = 0;
+        
+        shared_ptr<const vector<BlockRun>> runs = getBlockMap(dir_inode_num, dir_inode);
+        if (!runs) {
+            return false;
+        }
+        
+        uint32_t root_physical = lookupRun(*runs, 0);
+        BlockRef root = root_physical ? getBlock(root_physical) : BlockRef();
+        if (!root.valid()) {
+            return false;
+        }
+        
+        // Root: "." (12 bytes), ".." then the root info and the entries
+        const ext2_dx_root_info* info = (const ext2_dx_root_info*)(root.data() + 24);
+        if (info->reserved_zero != 0 || info->info_length != 8 ||
+            info->indirect_levels >= DX_MAX_LEVELS) {
+            return false;
+        }
+        
+        int version = info->hash_version;
+        if (version <= DX_HASH_TEA && (superblock.s_flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+            version += 3;
+        }
+        
+        uint32_t hash;
+        if (!dxNameHash(name.data(), name.size(), version, superblock.s_hash_seed, hash)) {
+            return false;
+        }
+        
+        // Descend, remembering each node and the chosen entry so hash
+        // collisions that spill into the next leaf can be followed
+        BlockRef nodes[DX_MAX_LEVELS];
+        uint32_t node_offset[DX_MAX_LEVELS];
+        uint32_t chosen[DX_MAX_LEVELS];
+        int levels = info->indirect_levels + 1;
+        
+        nodes[0] = root;
+        node_offset[0] = 24 + info->info_length;
+        uint32_t leaf_block = 0;
+        
+        for (int level = 0; level < levels; level++) {
+            const uint8_t* base = nodes[level].data() + node_offset[level];
+            const ext2_dx_countlimit* cl = (const ext2_dx_countlimit*)base;
+            const ext2_dx_entry* entries = (const ext2_dx_entry*)base;
+            uint32_t max_entries = (block_size - node_offset[level]) / sizeof(ext2_dx_entry);
+            if (cl->count == 0 || cl->count > cl->limit || cl->limit > max_entries) {
+                return false;
+            }
+            
+            // Last entry whose hash is <= target (entry 0 covers hash 0)
+            uint32_t lo = 1, hi = cl->count;
+            while (lo < hi) {
+                uint32_t mid = (lo + hi) / 2;
+                if (entries[mid].hash > hash) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            chosen[level] = lo - 1;
+            uint32_t logical = entries[chosen[level]].block & 0x0fffffff;
+            
+            if (level + 1 == levels) {
+                leaf_block = logical;
+                break;
+            }
+            
+            uint32_t physical = lookupRun(*runs, logical);
+            nodes[level + 1] = physical ? getBlock(physical) : BlockRef();
+            if (!nodes[level + 1].valid()) {
+                return false;
+            }
+            node_offset[level + 1] = 8;  // Past the empty fake dirent
+        }
+        
+        usable = true;
+        
+        while (true) {
+            uint32_t physical = lookupRun(*runs, leaf_block);
+            BlockRef leaf = physical ? getBlock(physical) : BlockRef();
+            if (!leaf.valid()) {
+                usable = false;         // Unreadable, not absent
+                return false;
+            }
+            if (findInDirBlock(leaf.data(), name, found_inode)) {
+                return true;
+            }
+            
+            // Move to the next index entry; continue only if it is a
+            // collision continuation of the same hash (low bit set)
+            int level = levels - 1;
+            while (level >= 0) {
+                const ext2_dx_countlimit* cl =
+                    (const ext2_dx_countlimit*)(nodes[level].data() + node_offset[level]);
+                if (chosen[level] + 1 < cl->count) {
+                    break;
+                }
+                level--;
+            }
+            if (level < 0) {
+                return false;
+            }
+            
+            chosen[level]++;
+            const ext2_dx_entry* entries =
+                (const ext2_dx_entry*)(nodes[level].data() + node_offset[level]);
+            uint32_t next_hash = entries[chosen[level]].hash;
+            if ((next_hash & 1) == 0 || (next_hash & ~1u) != hash) {
+                return false;
+            }
+            
+            // Re-descend along the first entries of the following subtree
+            uint32_t logical = entries[chosen[level]].block & 0x0fffffff;
+            for (int l = level + 1; l < levels; l++) {
+                uint32_t node_physical = lookupRun(*runs, logical);
+                nodes[l] = node_physical ? getBlock(node_physical) : BlockRef();
+                if (!nodes[l].valid()) {
+                    usable = false;
+                    return false;
+                }
+                node_offset[l] = 8;
+                chosen[l] = 0;
+                logical = ((const ext2_dx_entry*)(nodes[l].data() + 8))[0].block & 0x0fffffff;
+            }
+            leaf_block = logical;
+        }
+    }
+    
+    void printListingHeader(ostream& out, const string& path, uint32_t dir_inode_num) {
+        out << "\n========================================" << endl;
+        out << "DIRECTORY LISTING: " << path << " (Inode " << dir_inode_num << ")" << endl;
+        out << "========================================" << endl;
+        out << left << setw(30) << "Name" 
+             << setw(10) << "Type" 
+             << setw(10) << "Inode"
+             << "Size" << endl;
+        out << "----------------------------------------" << endl;
+    }
+    
+    void printListingFooter(ostream& out, uint64_t total) {
+        out << "----------------------------------------" << endl;
+        out << "Total entries: " << total << endl;
+        out << "========================================\n" << endl;
+    }
+    
+    // ls served entirely from the index: the directory's entries
+    // (including "." and "..") are contiguous nodes carrying name, type,
+    // inode and size, in on-disk order
+    void listIndexedDirectory(const string& path, ostream& out, ostream& err) {
+        uint32_t dir_node;
+        if (!index.lookup(path, dir_node)) {
+            err << "Error: Directory not found: " << path << endl;
+            return;
+        }
+        
+        const ext2_index_node& dir = index.node(dir_node);
+        if ((dir.mode & 0xF000) != EXT2_S_IFDIR) {
+            err << "Error: Inode is not a directory" << endl;
+            return;
+        }
+        
+        uint32_t first, count;
+        if (!index.children(dir_node, first, count)) {
+            err << "Error: Index entry for " << path << " is corrupt" << endl;
+            return;
+        }
+        
+        printListingHeader(out, path, dir.inode);
+        for (uint32_t i = first; i < first + count; i++) {
+            uint64_t size = index.node(i).size;
+            printListingLine(out, index.entryView(i), &size);
+        }
+        printListingFooter(out, count);
+    }
+    
+    // One line of ls output (size is null if the inode couldn't be read)
+    void printListingLine(ostream& out, const DirEntryView& entry, const uint64_t* inode_size) {
+        // Skip . and .. for cleaner output (optional)
+        // if (entry.nameEquals(".") || entry.nameEquals("..")) return;
+        
+        // Inode gives the size
+        string type_str = "UNKNOWN";
+        uint64_t size = 0;
+        
+        if (inode_size) {
+            size = *inode_size;
+            
+            switch (entry.file_type) {
+                case EXT2_FT_REG_FILE: type_str = "FILE"; break;
+                case EXT2_FT_DIR:      type_str = "DIR"; break;
+                case EXT2_FT_SYMLINK:  type_str = "LINK"; break;
+                case EXT2_FT_CHRDEV:   type_str = "CHR"; break;
+                case EXT2_FT_BLKDEV:   type_str = "BLK"; break;
+                case EXT2_FT_FIFO:     type_str = "FIFO"; break;
+                case EXT2_FT_SOCK:     type_str = "SOCK"; break;
+            }
+        }
+        
+        out << left << setw(30) << entry.nameString()
+             << setw(10) << type_str
+             << setw(10) << entry.inode
+             << size << " bytes" << endl;
+    }
+    
+    // Resolve an absolute path ("/var/log/x.log") to an inode number.
+    // Relative paths are taken from the root directory; "." and ".." are
+    // ordinary directory entries and need no special handling. With a
+    // current index the whole path is a single hash lookup.
+    bool resolvePath(const string& path, uint32_t& inode_num) {
+        if (index.loaded()) {
+            uint32_t node_index;
+            if (!index.lookup(path, node_index)) {
+                return false;
+            }
+            inode_num = index.node(node_index).inode;
+            return true;
+        }
+        
+        inode_num = EXT2_ROOT_INO;
+        
+        size_t pos = 0;
+        while (pos < path.size()) {
+            size_t next = path.find('/', pos);
+            if (next == string::npos) {
+                next = path.size();
+            }
+            
+            if (next > pos) {
+                string component = path.substr(pos, next - pos);
+                uint32_t child;
+                if (!findFileInDirectory(inode_num, component, child)) {
+                    return false;
+                }
+                inode_num = child;
+            }
+            pos = next + 1;
+        }
+        
+        return true;
+    }
+    
+    // Printable name of an inode's file type
+    static const char* modeTypeName(uint16_t mode) {
+        switch (mode & 0xF000) {
+            case EXT2_S_IFREG: return "FILE";
+            case EXT2_S_IFDIR: return "DIR";
+            case EXT2_S_IFLNK: return "LINK";
+            case 0x2000:       return "CHR";
+            case 0x6000:       return "BLK";
+            case 0x1000:       return "FIFO";
+            case 0xC000:       return "SOCK";
+        }
+        return "UNKNOWN";
+    }
+    
+    // Format a timestamp from an inode
+    static string formatTime(uint32_t timestamp) {
+        time_t t = timestamp;
+        struct tm tm_buf;
+        char text[64];
+        strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm_buf));
+        return text;
+    }
+    
+    // Create an output file and stream an inode's data into it
+    bool extractInode(uint32_t inode_num, const ext2_inode& inode, const string& output_path,
+                      mode_t mode, uint64_t& written) {
+        int out_fd = ::open(output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+        if (out_fd < 0) {
+            cerr << "Error: Cannot create output file: " << output_path << endl;
+            return false;
+        }
+        
+        // Stream the file run by run instead of buffering it whole
+        bool ok = streamInodeData(inode_num, inode, out_fd, written);
+        close(out_fd);
+        
+        if (!ok) {
+            cerr << "Error: Failed to write complete file: " << output_path << endl;
+        }
+        return ok;
+    }
+    
+    // Target of a symbolic link. Short targets are stored in i_block itself
+    // ("fast" symlinks, no data blocks); longer ones in a data block.
+    bool readSymlink(uint32_t inode_num, const ext2_inode& inode, string& target) {
+        if (inode.i_blocks == 0 && inode.i_size < sizeof(inode.i_block)) {
+            target.assign((const char*)inode.i_block, inode.i_size);
+            return true;
+        }
+        
+        vector<uint8_t> data;
+        if (!readInodeData(inode_num, inode, data)) {
+            return false;
+        }
+        target.assign(data.begin(), data.end());
+        return true;
+    }
+    
+    // mkdir -p on the host (safe to call from several threads)
+    static bool makeHostDirs(const string& path) {
+        for (size_t pos = 1; pos <= path.size(); pos++) {
+            if (pos == path.size() || path[pos] == '/') {
+                string prefix = path.substr(0, pos);
+                if (mkdir(prefix.c_str(), 0755) < 0 && errno != EEXIST) {
+                    cerr << "Error: Cannot create directory: " << prefix << endl;
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    
+    // Counters shared by the tasks of one bulk extraction
+    struct BulkCopyStats {
+        atomic<uint64_t> files;
+        atomic<uint64_t> links;
+        atomic<uint64_t> bytes;
+        atomic<uint64_t> failed;
+        
+        BulkCopyStats() : files(0), links(0), bytes(0), failed(0) {}
+    };
+    
+    // Recreate one inode on the host: regular files are streamed, symlinks
+    // recreated, directories created; anything else is skipped
+    void extractOne(uint32_t inode_num, const ext2_inode& inode, const string& output_path,
+                    BulkCopyStats& copy_stats) {
+        uint16_t type = inode.i_mode & 0xF000;
+        
+        if (type == EXT2_S_IFREG) {
+            uint64_t written = 0;
+            if (extractInode(inode_num, inode, output_path, inode.i_mode & 0777, written)) {
+                copy_stats.files++;
+                copy_stats.bytes += written;
+            } else {
+                copy_stats.failed++;
+            }
+        } else if (type == EXT2_S_IFLNK) {
+            string target;
+            unlink(output_path.c_str());
+            if (readSymlink(inode_num, inode, target) &&
+                symlink(target.c_str(), output_path.c_str()) == 0) {
+                copy_stats.links++;
+            } else {
+                cerr << "Error: Cannot create symlink: " << output_path << endl;
+                copy_stats.failed++;
+            }
+        } else if (type == EXT2_S_IFDIR) {
+            if (!makeHostDirs(output_path)) {
+                copy_stats.failed++;
+            }
+        } else {
+            cerr << "Warning: Skipping special file: " << output_path << endl;
+        }
+    }
+    
+    static void reportBulkCopy(const BulkCopyStats& copy_stats, const string& dest,
+                               ostream& out, ostream& err) {
+        out << "Copied " << copy_stats.files << " files";
+        if (copy_stats.links > 0) {
+            out << ", " << copy_stats.links << " symlinks";
+        }
+        out << " (" << copy_stats.bytes << " bytes) -> " << dest << endl;
+        if (copy_stats.failed > 0) {
+            err << "Error: " << copy_stats.failed << " entries could not be copied" << endl;
+        }
+    }
+    
+    // ========================================================================
+    // WRITE SUPPORT
+    // ========================================================================
+    //
+    // cp-in allocates from copies of the bitmaps and the group descriptor
+    // table kept in memory. File data, pointer blocks, inodes and directory
+    // entries go straight to the image; bitmaps, descriptors and superblock
+    // counters are written back by flushAllocations(), once per batch of
+    // EXT2_WRITE_BATCH files and at the end of the import.
+    
+    // Pointer blocks of a file being written, and the blocks set aside for it
+    struct ImportMap {
+        ext2_inode inode;
+        unordered_map<uint32_t, vector<uint32_t>> tables;  // By physical block
+        vector<BlockRun> reserved;  // Allocation, in the order blocks are handed out
+        size_t next_run;            // Position of the next block in reserved
+        uint32_t next_offset;
+    };
+    
+    // Counters of one import
+    struct ImportStats {
+        uint64_t files;
+        uint64_t dirs;
+        uint64_t links;
+        uint64_t skipped;           // Special files, which can't be imported
+        uint64_t failed;
+        uint64_t bytes;
+        uint64_t blocks;            // Data and pointer blocks allocated
+        uint64_t contiguous;        // Files whose blocks form a single extent
+        uint64_t pending;           // Entries created since the last flush
+        bool full;                  // Ran out of blocks or inodes
+    };
+    
+    // Forget all allocation state (after open())
+    void resetAllocator() {
+        block_bitmaps.assign(group_count, vector<uint8_t>());
+        inode_bitmaps.assign(group_count, vector<uint8_t>());
+        alloc_hint.assign(group_count, 0);
+        dirty_groups.assign(group_count, false);
+        metadata_dirty = false;
+    }
+    
+    // Write whole metadata blocks, dropping any cached copies
+    bool writeBlocks(uint32_t block_num, const void* data, uint32_t count) {
+        if (!writeAll(image->rawFd(), (const uint8_t*)data, (size_t)count * block_size,
+                      (off_t)block_num * block_size, true)) {
+            cerr << "Error: Failed to write block " << block_num << endl;
+            return false;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            cache.erase(block_num + i);
+        }
+        return true;
+    }
+    
+    // Write an inode back to its table. A new inode also gets the space
+    // past the first 128 bytes of a large inode cleared.
+    bool writeInode(uint32_t inode_num, const ext2_inode& inode, bool fresh = false) {
+        uint32_t inode_index = inode_num - 1;
+        uint32_t group = inode_index / superblock.s_inodes_per_group;
+        uint32_t byte_in_table = (inode_index % superblock.s_inodes_per_group) * inode_size;
+        uint32_t table_block = group_descs[group].bg_inode_table + byte_in_table / block_size;
+        off_t offset = (off_t)table_block * block_size + byte_in_table % block_size;
+        
+        vector<uint8_t> buffer(fresh ? inode_size : sizeof(ext2_inode), 0);
+        memcpy(buffer.data(), &inode, sizeof(ext2_inode));
+        if (fresh && inode_size > sizeof(ext2_inode) &&
+            superblock.s_want_extra_isize <= inode_size - sizeof(ext2_inode)) {
+            uint16_t extra_isize = superblock.s_want_extra_isize;
+            memcpy(buffer.data() + sizeof(ext2_inode), &extra_isize, sizeof(extra_isize));
+        }
+        
+        if (!writeAll(image->rawFd(), buffer.data(), buffer.size(), offset, true)) {
+            cerr << "Error: Failed to write inode " << inode_num << endl;
+            return false;
+        }
+        cache.erase(table_block);
+        return true;
+    }
+    
+    // Group holding an inode
+    uint32_t inodeGroup(uint32_t inode_num) const {
+        return (inode_num - 1) / superblock.s_inodes_per_group;
+    }
+    
+    // Block (or inode) bitmap of a group, read from the image on first use
+    vector<uint8_t>* groupBitmap(uint32_t group, bool inodes) {
+        vector<uint8_t>& bitmap = inodes ? inode_bitmaps[group] : block_bitmaps[group];
+        if (bitmap.empty()) {
+            const ext2_group_desc& gd = group_descs[group];
+            bitmap.resize(block_size);
+            if (!readBlock(inodes ? gd.bg_inode_bitmap : gd.bg_block_bitmap, bitmap.data())) {
+                cerr << "Error: Failed to read bitmap of group " << group << endl;
+                bitmap.clear();
+                return nullptr;
+            }
+        }
+        return &bitmap;
+    }
+    
+    static bool bitSet(const vector<uint8_t>& bitmap, uint32_t bit) {
+        return (bitmap[bit >> 3] >> (bit & 7)) & 1;
+    }
+    
+    // Step past bit, or past the whole aligned 64-bit word at bit when
+    // every bit in it equals fill
+    static uint32_t stepBits(const vector<uint8_t>& bitmap, uint32_t bit, uint32_t limit,
+                             uint64_t fill) {
+        if ((bit & 63) == 0 && bit + 64 <= limit) {
+            uint64_t word;
+            memcpy(&word, &bitmap[bit >> 3], sizeof(word));
+            if (word == fill) {
+                return bit + 64;
+            }
+        }
+        return bit + 1;
+    }
+    
+    // Next run of clear bits starting at or after from and ending by limit
+    static bool nextClearRun(const vector<uint8_t>& bitmap, uint32_t from, uint32_t limit,
+                             uint32_t& start, uint32_t& length) {
+        uint32_t bit = from;
+        while (bit < limit && bitSet(bitmap, bit)) {
+            bit = stepBits(bitmap, bit, limit, ~0ull);
+        }
+        if (bit >= limit) {
+            return false;
+        }
+        
+        start = bit;
+        while (bit < limit && !bitSet(bitmap, bit)) {
+            bit = stepBits(bitmap, bit, limit, 0);
+        }
+        length = bit - start;
+        return true;
+    }
+    
+    // Mark count blocks starting at bit of a group used (or free again),
+    // keeping the group and superblock counters in step
+    void markBlocks(uint32_t group, uint32_t bit, uint32_t count, bool used) {
+        vector<uint8_t>& bitmap = block_bitmaps[group];
+        for (uint32_t i = bit; i < bit + count; i++) {
+            if (used) {
+                bitmap[i >> 3] |= 1 << (i & 7);
+            } else {
+                bitmap[i >> 3] &= ~(1 << (i & 7));
+            }
+        }
+        
+        if (used) {
+            group_descs[group].bg_free_blocks_count -= count;
+            superblock.s_free_blocks_count -= count;
+            if (bit == alloc_hint[group]) {
+                alloc_hint[group] = bit + count;
+            }
+        } else {
+            group_descs[group].bg_free_blocks_count += count;
+            superblock.s_free_blocks_count += count;
+            alloc_hint[group] = min(alloc_hint[group], bit);
+        }
+        dirty_groups[group] = true;
+        metadata_dirty = true;
+    }
+    
+    // Give back blocks taken by allocateBlocks()
+    void releaseBlocks(const vector<BlockRun>& runs) {
+        for (const BlockRun& run : runs) {
+            uint32_t offset = run.physical - superblock.s_first_data_block;
+            markBlocks(offset / superblock.s_blocks_per_group,
+                       offset % superblock.s_blocks_per_group, run.length, false);
+        }
+    }
+    
+    // Allocate count blocks in as few extents as possible, near goal_group.
+    // Every group, starting with the goal, is first searched for a single
+    // free run of the whole length; failing that, free runs are taken in
+    // order from the goal on. runs receives the extents, with logical set
+    // to each extent's position in the allocation.
+    bool allocateBlocks(uint32_t count, uint32_t goal_group, vector<BlockRun>& runs) {
+        runs.clear();
+        if (count == 0) {
+            return true;
+        }
+        if (count > superblock.s_free_blocks_count) {
+            return false;
+        }
+        
+        for (uint32_t i = 0; i < group_count; i++) {
+            uint32_t group = (goal_group + i) % group_count;
+            if (group_descs[group].bg_free_blocks_count < count) {
+                continue;
+            }
+            vector<uint8_t>* bitmap = groupBitmap(group, false);
+            if (!bitmap) {
+                return false;
+            }
+            
+            uint32_t start, length;
+            uint32_t from = alloc_hint[group];
+            while (nextClearRun(*bitmap, from, groupBlockCount(group), start, length)) {
+                if (length >= count) {
+                    markBlocks(group, start, count, true);
+                    BlockRun run = { 0, groupFirstBlock(group) + start, count };
+                    runs.push_back(run);
+                    return true;
+                }
+                from = start + length;
+            }
+        }
+        
+        uint32_t taken = 0;
+        for (uint32_t i = 0; i < group_count && taken < count; i++) {
+            uint32_t group = (goal_group + i) % group_count;
+            if (group_descs[group].bg_free_blocks_count == 0) {
+                continue;
+            }
+            vector<uint8_t>* bitmap = groupBitmap(group, false);
+            if (!bitmap) {
+                break;
+            }
+            
+            uint32_t start, length;
+            uint32_t from = alloc_hint[group];
+            while (taken < count && nextClearRun(*bitmap, from, groupBlockCount(group), start, length)) {
+                length = min(length, count - taken);
+                markBlocks(group, start, length, true);
+                BlockRun run = { taken, groupFirstBlock(group) + start, length };
+                runs.push_back(run);
+                taken += length;
+                from = start + length;
+            }
+        }
+        
+        // Counters that promise more than the bitmaps hold
+        if (taken < count) {
+            releaseBlocks(runs);
+            runs.clear();
+            return false;
+        }
+        return true;
+    }
+    
+    // Allocate an inode. Files go in goal_group, or the next group with a
+    // free inode. Directories are spread out instead: they go to the group
+    // with the most free blocks among those with at least the average
+    // number of free inodes, leaving room for the files that follow them.
+    bool allocateInode(uint32_t goal_group, bool directory, uint32_t& inode_num) {
+        if (superblock.s_free_inodes_count == 0) {
+            return false;
+        }
+        
+        if (directory) {
+            uint32_t average = superblock.s_free_inodes_count / group_count;
+            uint32_t best = goal_group;
+            int64_t best_free = -1;
+            for (uint32_t group = 0; group < group_count; group++) {
+                const ext2_group_desc& gd = group_descs[group];
+                if (gd.bg_free_inodes_count > 0 && gd.bg_free_inodes_count >= average &&
+                    (int64_t)gd.bg_free_blocks_count > best_free) {
+                    best = group;
+                    best_free = gd.bg_free_blocks_count;
+                }
+            }
+            goal_group = best;
+        }
+        
+        for (uint32_t i = 0; i < group_count; i++) {
+            uint32_t group = (goal_group + i) % group_count;
+            if (group_descs[group].bg_free_inodes_count == 0) {
+                continue;
+            }
+            vector<uint8_t>* bitmap = groupBitmap(group, true);
+            if (!bitmap) {
+                return false;
+            }
+            
+            // Reserved inodes all live in group 0
+            uint32_t from = group == 0 ? firstInode() - 1 : 0;
+            uint32_t bit, length;
+            if (!nextClearRun(*bitmap, from, superblock.s_inodes_per_group, bit, length)) {
+                continue;
+            }
+            
+            (*bitmap)[bit >> 3] |= 1 << (bit & 7);
+            group_descs[group].bg_free_inodes_count--;
+            superblock.s_free_inodes_count--;
+            if (directory) {
+                group_descs[group].bg_used_dirs_count++;
+            }
+            dirty_groups[group] = true;
+            metadata_dirty = true;
+            
+            inode_num = group * superblock.s_inodes_per_group + bit + 1;
+            return true;
+        }
+        return false;
+    }
+    
+    // Give back an inode taken by allocateInode()
+    void releaseInode(uint32_t inode_num, bool directory) {
+        uint32_t group = inodeGroup(inode_num);
+        uint32_t bit = (inode_num - 1) % superblock.s_inodes_per_group;
+        inode_bitmaps[group][bit >> 3] &= ~(1 << (bit & 7));
+        group_descs[group].bg_free_inodes_count++;
+        superblock.s_free_inodes_count++;
+        if (directory) {
+            group_descs[group].bg_used_dirs_count--;
+        }
+        dirty_groups[group] = true;
+        metadata_dirty = true;
+    }
+    
+    // Undo an import whose inode was written but could not be linked into
+    // its directory: mark the inode deleted on disk (no links, a deletion
+    // time) so nothing reads it as live, then give back it and its blocks
+    void abandonInode(uint32_t inode_num, bool directory, const vector<BlockRun>& blocks) {
+        ext2_inode dead;
+        memset(&dead, 0, sizeof(dead));
+        dead.i_dtime = time(nullptr);
+        writeInode(inode_num, dead);
+        releaseBlocks(blocks);
+        releaseInode(inode_num, directory);
+    }
+    
+    // Write back the bitmaps changed since the last flush, the group
+    // descriptor table and the superblock. The new write time and free
+    // counts mark any index built before as stale, and this file system's
+    // index file is removed so it isn't consulted again.
+    bool flushAllocations() {
+        for (uint32_t group = 0; group < group_count; group++) {
+            if (!dirty_groups[group]) {
+                continue;
+            }
+            const ext2_group_desc& gd = group_descs[group];
+            if ((!block_bitmaps[group].empty() &&
+                 !writeBlocks(gd.bg_block_bitmap, block_bitmaps[group].data(), 1)) ||
+                (!inode_bitmaps[group].empty() &&
+                 !writeBlocks(gd.bg_inode_bitmap, inode_bitmaps[group].data(), 1))) {
+                return false;
+            }
+            dirty_groups[group] = false;
+        }
+        
+        if (!metadata_dirty) {
+            return true;
+        }
+        
+        uint32_t gdt_block = superblock.s_first_data_block + 1;
+        size_t gdt_size = (size_t)group_count * sizeof(ext2_group_desc);
+        vector<uint8_t> gdt(((gdt_size + block_size - 1) / block_size) * block_size);
+        if (readBytes(gdt.data(), gdt.size(), (off_t)gdt_block * block_size) != (ssize_t)gdt.size()) {
+            cerr << "Error: Failed to read group descriptor table" << endl;
+            return false;
+        }
+        memcpy(gdt.data(), group_descs.data(), gdt_size);
+        if (!writeBlocks(gdt_block, gdt.data(), gdt.size() / block_size)) {
+            return false;
+        }
+        
+        superblock.s_wtime = time(nullptr);
+        if (!writeAll(image->rawFd(), (const uint8_t*)&superblock, sizeof(superblock), 1024, true)) {
+            cerr << "Error: Failed to write superblock" << endl;
+            return false;
+        }
+        cache.erase(1024 / block_size);
+        
+        if (MetadataIndex::isIndexOf(index_path, superblock) && ::unlink(index_path.c_str()) != 0) {
+            cerr << "Warning: Failed to remove stale index " << index_path << endl;
+        }
+        
+        metadata_dirty = false;
+        return true;
+    }
+    
+    // Next block of an import's allocation (0 once it is used up)
+    static uint32_t nextReserved(ImportMap& file_map) {
+        while (file_map.next_run < file_map.reserved.size()) {
+            const BlockRun& run = file_map.reserved[file_map.next_run];
+            if (file_map.next_offset < run.length) {
+                return run.physical + file_map.next_offset++;
+            }
+            file_map.next_run++;
+            file_map.next_offset = 0;
+        }
+        return 0;
+    }
+    
+    // Pointer table behind a block pointer: read from the image if the
+    // pointer is set, otherwise taken from the allocation
+    uint32_t* importTable(ImportMap& file_map, uint32_t& pointer) {
+        if (pointer == 0) {
+            pointer = nextReserved(file_map);
+            if (pointer == 0) {
+                return nullptr;
+            }
+            file_map.tables[pointer].assign(block_size / 4, 0);
+            file_map.inode.i_blocks += block_size / 512;
+        } else if (!file_map.tables.count(pointer)) {
+            vector<uint32_t>& table = file_map.tables[pointer];
+            table.resize(block_size / 4);
+            if (!readBlock(pointer, table.data())) {
+                file_map.tables.erase(pointer);
+                return nullptr;
+            }
+        }
+        return file_map.tables[pointer].data();
+    }
+    
+    // Slot holding the physical block of a logical file block; pointer
+    // blocks come from the allocation on first use, just ahead of the data
+    // they map
+    uint32_t* importSlot(ImportMap& file_map, uint64_t logical) {
+        uint64_t per_block = block_size / 4;
+        if (logical < 12) {
+            return &file_map.inode.i_block[logical];
+        }
+        logical -= 12;
+        
+        if (logical < per_block) {
+            uint32_t* single = importTable(file_map, file_map.inode.i_block[12]);
+            return single ? &single[logical] : nullptr;
+        }
+        logical -= per_block;
+        
+        if (logical < per_block * per_block) {
+            uint32_t* dbl = importTable(file_map, file_map.inode.i_block[13]);
+            uint32_t* single = dbl ? importTable(file_map, dbl[logical / per_block]) : nullptr;
+            return single ? &single[logical % per_block] : nullptr;
+        }
+        logical -= per_block * per_block;
+        
+        uint32_t* tri = importTable(file_map, file_map.inode.i_block[14]);
+        uint32_t* dbl = tri ? importTable(file_map, tri[logical / (per_block * per_block)]) : nullptr;
+        uint32_t* single = dbl ? importTable(file_map, dbl[(logical / per_block) % per_block]) : nullptr;
+        return single ? &single[logical % per_block] : nullptr;
+    }
+    
+    // Pointer blocks needed to map the first data_blocks blocks of a file
+    uint64_t pointerBlocks(uint64_t data_blocks) const {
+        uint64_t per_block = block_size / 4;
+        if (data_blocks <= 12) {
+            return 0;
+        }
+        data_blocks -= 12;
+        if (data_blocks <= per_block) {
+            return 1;
+        }
+        data_blocks -= per_block;
+        
+        uint64_t doubly = min(data_blocks, per_block * per_block);
+        uint64_t count = 1 + 1 + (doubly + per_block - 1) / per_block;
+        data_blocks -= doubly;
+        if (data_blocks > 0) {
+            count += 1 + (data_blocks + per_block * per_block - 1) / (per_block * per_block) +
+                     (data_blocks + per_block - 1) / per_block;
+        }
+        return count;
+    }
+    
+    // Largest file the block pointers can map, in blocks
+    uint64_t maxFileBlocks() const {
+        uint64_t per_block = block_size / 4;
+        return 12 + per_block + per_block * per_block + per_block * per_block * per_block;
+    }
+    
+    // Write the pointer tables of a finished import
+    bool writeImportTables(const ImportMap& file_map) {
+        for (const auto& entry : file_map.tables) {
+            if (!writeBlocks(entry.first, entry.second.data(), 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Copy size bytes of a host file into the import's blocks. Every block
+    // is mapped first; then each physically contiguous stretch is filled
+    // with one read of the host file and one write to the image per
+    // EXT2_COPY_CHUNK bytes.
+    bool writeImportData(int host_fd, uint64_t size, ImportMap& file_map) {
+        uint64_t blocks = (size + block_size - 1) / block_size;
+        vector<BlockRun> runs;
+        for (uint64_t logical = 0; logical < blocks; logical++) {
+            uint32_t* pointer = importSlot(file_map, logical);
+            uint32_t physical = pointer ? nextReserved(file_map) : 0;
+            if (physical == 0) {
+                return false;
+            }
+            *pointer = physical;
+            file_map.inode.i_blocks += block_size / 512;
+            appendRun(runs, logical, physical);
+        }
+        
+        vector<uint8_t> chunk(EXT2_COPY_CHUNK);
+        const uint32_t chunk_blocks = EXT2_COPY_CHUNK / block_size;
+        for (const BlockRun& run : runs) {
+            for (uint32_t done = 0; done < run.length; done += chunk_blocks) {
+                uint32_t count = min(chunk_blocks, run.length - done);
+                size_t bytes = (size_t)count * block_size;
+                off_t host_offset = (off_t)(run.logical + done) * block_size;
+                
+                size_t have = 0;
+                while (have < bytes) {
+                    ssize_t got = pread(host_fd, chunk.data() + have, bytes - have, host_offset + have);
+                    if (got < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (got < 0) {
+                        return false;
+                    }
+                    if (got == 0) {
+                        break;      // Host file shrank; the rest reads as zeros
+                    }
+                    have += got;
+                }
+                memset(chunk.data() + have, 0, bytes - have);
+                
+                if (!writeAll(image->rawFd(), chunk.data(), bytes,
+                              (off_t)(run.physical + done) * block_size, true)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    
+    // Length of a directory record for a name, rounded to 4 bytes
+    static uint32_t dirRecordLength(size_t name_len) {
+        return (8 + name_len + 3) & ~3u;
+    }
+    
+    // Fill in a directory record at entry
+    void setDirEntry(uint8_t* entry, uint32_t inode_num, uint32_t rec_len,
+                     const string& name, uint8_t file_type) const {
+        ext2_dir_entry* dirent = (ext2_dir_entry*)entry;
+        dirent->inode = inode_num;
+        dirent->rec_len = rec_len;
+        dirent->name_len = name.size();
+        dirent->file_type = (superblock.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE)
+                            ? file_type : 0;
+        memcpy(entry + 8, name.data(), name.size());
+    }
+    
+    // Add name -> inode_num to a directory, in the slack after an existing
+    // entry when one has room, otherwise in a new block appended to the
+    // directory. An indexed directory loses its index flag, since its hash
+    // tree isn't updated; readers then simply scan it.
+    bool addDirEntry(uint32_t dir_num, const string& name, uint32_t inode_num, uint8_t file_type) {
+        ext2_inode dir_inode;
+        vector<BlockRun> runs;
+        if (!readInode(dir_num, dir_inode) || !mapInodeBlocks(dir_inode, runs)) {
+            return false;
+        }
+        
+        uint32_t needed = dirRecordLength(name.size());
+        vector<uint8_t> block(block_size);
+        bool added = false;
+        for (size_t r = 0; r < runs.size() && !added; r++) {
+            for (uint32_t i = 0; i < runs[r].length && !added; i++) {
+                uint32_t physical = runs[r].physical + i;
+                if (!readBlock(physical, block.data())) {
+                    return false;
+                }
+                
+                uint32_t offset = 0;
+                while (offset + 8 <= block_size) {
+                    ext2_dir_entry* entry = (ext2_dir_entry*)&block[offset];
+                    if (entry->rec_len < 8 || offset + entry->rec_len > block_size) {
+                        break;      // Corrupt block: leave it alone
+                    }
+                    uint32_t used = entry->inode ? dirRecordLength(entry->name_len) : 0;
+                    if (entry->rec_len >= used + needed) {
+                        uint32_t free_len = entry->rec_len - used;
+                        if (used > 0) {
+                            entry->rec_len = used;
+                        }
+                        setDirEntry(&block[offset + used], inode_num, free_len, name, file_type);
+                        if (!writeBlocks(physical, block.data(), 1)) {
+                            return false;
+                        }
+                        added = true;
+                        break;
+                    }
+                    offset += entry->rec_len;
+                }
+            }
+        }
+        
+        if (!added) {
+            // New last block, plus any pointer block needed to map it
+            uint64_t blocks = dir_inode.i_size / block_size;
+            ImportMap dir_map;
+            dir_map.inode = dir_inode;
+            dir_map.next_run = 0;
+            dir_map.next_offset = 0;
+            uint32_t count = 1 + pointerBlocks(blocks + 1) - pointerBlocks(blocks);
+            if (blocks + 1 > maxFileBlocks() ||
+                !allocateBlocks(count, inodeGroup(dir_num), dir_map.reserved)) {
+                return false;
+            }
+            
+            uint32_t* pointer = importSlot(dir_map, blocks);
+            uint32_t physical = pointer ? nextReserved(dir_map) : 0;
+            if (physical == 0) {
+                releaseBlocks(dir_map.reserved);
+                return false;
+            }
+            *pointer = physical;
+            
+            memset(block.data(), 0, block_size);
+            setDirEntry(block.data(), inode_num, block_size, name, file_type);
+            if (!writeBlocks(physical, block.data(), 1) || !writeImportTables(dir_map)) {
+                return false;
+            }
+            dir_inode = dir_map.inode;
+            dir_inode.i_size += block_size;
+            dir_inode.i_blocks += block_size / 512;
+            
+            lock_guard<mutex> guard(run_cache_lock);
+            run_cache.erase(dir_num);
+        }
+        
+        dir_inode.i_flags &= ~EXT2_INDEX_FL;
+        dir_inode.i_mtime = dir_inode.i_ctime = time(nullptr);
+        if (!writeInode(dir_num, dir_inode)) {
+            return false;
+        }
+        dcache.insert(dir_num, name, inode_num);
+        return true;
+    }
+    
+    // New inode for an imported host file (type is an EXT2_S_IF* value)
+    static void initImportInode(ext2_inode& inode, const struct stat& st, uint16_t type) {
+        memset(&inode, 0, sizeof(inode));
+        inode.i_mode = type | (st.st_mode & 07777);
+        inode.i_uid = st.st_uid;
+        inode.i_gid = st.st_gid;
+        inode.i_atime = st.st_atime;
+        inode.i_mtime = st.st_mtime;
+        inode.i_ctime = time(nullptr);
+        inode.i_links_count = 1;
+    }
+    
+    // Import a regular file or symlink as name in directory parent. Returns
+    // false only when the image is full.
+    bool importFile(const string& host_path, const struct stat& st, uint32_t parent,
+                    const string& name, const string& image_path, ImportStats& import_stats,
+                    ostream& err) {
+        bool is_link = S_ISLNK(st.st_mode);
+        string target;
+        int host_fd = -1;
+        uint64_t size;
+        if (is_link) {
+            vector<char> buffer(block_size);
+            ssize_t length = readlink(host_path.c_str(), buffer.data(), buffer.size());
+            if (length < 0 || (size_t)length >= block_size) {
+                err << "Error: Cannot read symlink: " << host_path << endl;
+                import_stats.failed++;
+                return true;
+            }
+            target.assign(buffer.data(), length);
+            size = target.size();
+        } else {
+            host_fd = ::open(host_path.c_str(), O_RDONLY);
+            if (host_fd < 0) {
+                err << "Error: Cannot open host file: " << host_path << endl;
+                import_stats.failed++;
+                return true;
+            }
+            size = st.st_size;
+        }
+        
+        // Short symlink targets live in the block pointers (fast symlinks)
+        bool fast_link = is_link && target.size() < sizeof(((ext2_inode*)0)->i_block);
+        uint64_t data_blocks = fast_link ? 0 : (size + block_size - 1) / block_size;
+        uint64_t total = data_blocks + pointerBlocks(data_blocks);
+        if (data_blocks > maxFileBlocks()) {
+            err << "Error: File too large for the image's block size: " << host_path << endl;
+            import_stats.failed++;
+            close(host_fd);
+            return true;
+        }
+        
+        // Room for the file plus a possible new directory block
+        uint32_t inode_num;
+        if (total + 4 > superblock.s_free_blocks_count ||
+            !allocateInode(inodeGroup(parent), false, inode_num)) {
+            err << "Error: No space left in image for " << host_path << endl;
+            import_stats.full = true;
+            if (host_fd >= 0) {
+                close(host_fd);
+            }
+            return false;
+        }
+        
+        ImportMap file_map;
+        initImportInode(file_map.inode, st, is_link ? EXT2_S_IFLNK : EXT2_S_IFREG);
+        file_map.inode.i_size = (uint32_t)size;
+        file_map.next_run = 0;
+        file_map.next_offset = 0;
+        if (!is_link) {
+            file_map.inode.i_dir_acl = size >> 32;
+            if (size >= 0x80000000ull &&
+                !(superblock.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+                superblock.s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+                metadata_dirty = true;
+            }
+        }
+        
+        if (!allocateBlocks(total, inodeGroup(inode_num), file_map.reserved)) {
+            err << "Error: No space left in image for " << host_path << endl;
+            releaseInode(inode_num, false);
+            import_stats.full = true;
+            if (host_fd >= 0) {
+                close(host_fd);
+            }
+            return false;
+        }
+        
+        bool ok;
+        if (fast_link) {
+            memcpy(file_map.inode.i_block, target.data(), target.size());
+            ok = true;
+        } else if (is_link) {
+            vector<uint8_t> block(block_size, 0);
+            memcpy(block.data(), target.data(), target.size());
+            file_map.inode.i_block[0] = nextReserved(file_map);
+            file_map.inode.i_blocks = block_size / 512;
+            ok = writeBlocks(file_map.inode.i_block[0], block.data(), 1);
+        } else {
+            ok = writeImportData(host_fd, size, file_map) && writeImportTables(file_map);
+        }
+        if (host_fd >= 0) {
+            close(host_fd);
+        }
+        
+        // The inode goes to disk before the entry naming it
+        uint8_t file_type = is_link ? EXT2_FT_SYMLINK : EXT2_FT_REG_FILE;
+        bool written = ok && writeInode(inode_num, file_map.inode, true);
+        if (!written || !addDirEntry(parent, name, inode_num, file_type)) {
+            err << "Error: Failed to import " << host_path << " -> " << image_path << endl;
+            if (written) {
+                abandonInode(inode_num, false, file_map.reserved);
+            } else {
+                releaseBlocks(file_map.reserved);
+                releaseInode(inode_num, false);
+            }
+            import_stats.failed++;
+            return true;
+        }
+        
+        if (is_link) {
+            import_stats.links++;
+        } else {
+            import_stats.files++;
+            import_stats.bytes += size;
+            import_stats.contiguous += file_map.reserved.size() <= 1;
+        }
+        import_stats.blocks += total;
+        return true;
+    }
+    
+    // Create an empty directory as name in parent
+    bool createDirectory(const struct stat& st, uint32_t parent, const string& name,
+                         uint32_t& dir_num) {
+        vector<BlockRun> runs;
+        if (!allocateInode(inodeGroup(parent), true, dir_num)) {
+            return false;
+        }
+        if (!allocateBlocks(1, inodeGroup(dir_num), runs)) {
+            releaseInode(dir_num, true);
+            return false;
+        }
+        
+        vector<uint8_t> block(block_size, 0);
+        setDirEntry(block.data(), dir_num, 12, ".", EXT2_FT_DIR);
+        setDirEntry(block.data() + 12, parent, block_size - 12, "..", EXT2_FT_DIR);
+        
+        ext2_inode inode;
+        initImportInode(inode, st, EXT2_S_IFDIR);
+        inode.i_size = block_size;
+        inode.i_links_count = 2;
+        inode.i_blocks = block_size / 512;
+        inode.i_block[0] = runs[0].physical;
+        
+        if (!writeBlocks(runs[0].physical, block.data(), 1) || !writeInode(dir_num, inode, true)) {
+            releaseBlocks(runs);
+            releaseInode(dir_num, true);
+            return false;
+        }
+        
+        // The new ".." links the parent once more. The count is raised
+        // before the entry is added, and lowered again if that fails, so
+        // a failure at any step leaves no live inode or entry behind.
+        ext2_inode parent_inode;
+        if (!readInode(parent, parent_inode)) {
+            abandonInode(dir_num, true, runs);
+            return false;
+        }
+        parent_inode.i_links_count++;
+        if (!writeInode(parent, parent_inode)) {
+            abandonInode(dir_num, true, runs);
+            return false;
+        }
+        if (!addDirEntry(parent, name, dir_num, EXT2_FT_DIR)) {
+            if (readInode(parent, parent_inode)) {
+                parent_inode.i_links_count--;
+                writeInode(parent, parent_inode);
+            }
+            abandonInode(dir_num, true, runs);
+            return false;
+        }
+        
+        vector<pair<string, uint32_t>> entries;
+        entries.push_back(make_pair(string("."), dir_num));
+        entries.push_back(make_pair(string(".."), parent));
+        dcache.fill(dir_num, entries);
+        return true;
+    }
+    
+    // Import a host path as name in directory parent. Directories are
+    // imported recursively, merging into an existing directory of the same
+    // name. Returns false once the image is full or a write failed.
+    bool importPath(const string& host_path, uint32_t parent, const string& name,
+                    const string& image_path, ImportStats& import_stats, ostream& err) {
+        struct stat st;
+        if (lstat(host_path.c_str(), &st) != 0) {
+            err << "Error: Cannot access host file: " << host_path << endl;
+            import_stats.failed++;
+            return true;
+        }
+        if (name.empty() || name.size() > 255) {
+            err << "Error: Invalid file name: " << image_path << endl;
+            import_stats.failed++;
+            return true;
+        }
+        
+        uint32_t existing;
+        bool exists = findFileInDirectory(parent, name, existing);
+        if (S_ISDIR(st.st_mode)) {
+            uint32_t dir_num = existing;
+            if (exists) {
+                ext2_inode inode;
+                if (!readInode(existing, inode) || (inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
+                    err << "Error: File exists: " << image_path << endl;
+                    import_stats.failed++;
+                    return true;
+                }
+            } else {
+                if (superblock.s_free_blocks_count < 8) {
+                    err << "Error: No space left in image for " << host_path << endl;
+                    import_stats.full = true;
+                    return false;
+                }
+                if (!createDirectory(st, parent, name, dir_num)) {
+                    err << "Error: Failed to create directory " << image_path << endl;
+                    import_stats.full = true;
+                    return false;
+                }
+                import_stats.dirs++;
+                import_stats.pending++;
+            }
+            
+            DIR* dir = opendir(host_path.c_str());
+            if (!dir) {
+                err << "Error: Cannot read host directory: " << host_path << endl;
+                import_stats.failed++;
+                return true;
+            }
+            vector<string> children;
+            while (dirent* child = readdir(dir)) {
+                if (strcmp(child->d_name, ".") != 0 && strcmp(child->d_name, "..") != 0) {
+                    children.push_back(child->d_name);
+                }
+            }
+            closedir(dir);
+            sort(children.begin(), children.end());
+            
+            for (const string& child : children) {
+                if (!importPath(host_path + "/" + child, dir_num, child,
+                                (image_path == "/" ? "" : image_path) + "/" + child,
+                                import_stats, err)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        
+        if (exists) {
+            err << "Error: File exists: " << image_path << endl;
+            import_stats.failed++;
+            return true;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) {
+            err << "Warning: Skipping special file: " << host_path << endl;
+            import_stats.skipped++;
+            return true;
+        }
+        
+        if (!importFile(host_path, st, parent, name, image_path, import_stats, err)) {
+            return false;
+        }
+        if (++import_stats.pending >= EXT2_WRITE_BATCH) {
+            import_stats.pending = 0;
+            return flushAllocations();
+        }
+        return true;
+    }
+
+    // ========================================================================
+    // CONSISTENCY CHECK
+    // ========================================================================
+    //
+    // check rebuilds the allocation state from the inodes themselves and
+    // compares it with what the image records. One task per group reads the
+    // group's whole inode table, claims every block its in-use inodes map
+    // (data, indirect and extended attribute blocks) in a shared bitset, and
+    // counts the directory entries naming each inode. The bitsets are then
+    // compared with the on-disk bitmaps and counters, again per group.
+    
+    // Kinds of problem, in the order they are reported
+    enum CheckKind {
+        CHECK_BAD_BLOCK,            // Pointer outside the file system, unreadable map
+        CHECK_DUPLICATE,            // Block claimed twice
+        CHECK_BLOCK_FREE,           // In use but free in the bitmap
+        CHECK_BLOCK_LEAK,           // Used in the bitmap but claimed by nothing
+        CHECK_INODE_FREE,
+        CHECK_INODE_LEAK,
+        CHECK_LINKS,                // Link count differs from directory entries
+        CHECK_BLOCK_COUNT,          // i_blocks differs from the blocks mapped
+        CHECK_COUNTERS,             // Group descriptor or superblock counters
+        CHECK_KINDS
+    };
+    
+    struct CheckProblem {
+        int kind;
+        uint64_t key;               // Orders problems of one kind (block or inode)
+        string text;
+    };
+    
+    // Shared state of one check
+    struct CheckState {
+        vector<atomic<uint64_t>> claimed;      // Bit per block from s_first_data_block
+        vector<atomic<uint32_t>> entry_links;  // Directory entries naming each inode
+        vector<uint16_t> link_counts;          // i_links_count of in-use inodes, by inode
+        vector<uint8_t> in_use;                // 1 for in-use inodes, by inode
+        vector<uint32_t> group_dirs;           // Directories found in each group
+        mutex lock;                            // Guards everything below
+        unordered_set<uint32_t> xattr_blocks;  // May be shared, so claimed afterwards
+        vector<CheckProblem> problems;
+        uint64_t counts[CHECK_KINDS];          // Problems found, by kind
+        uint64_t inodes;
+        uint64_t dirs;
+        bool failed;
+        
+        CheckState(uint64_t blocks, uint32_t inode_count)
+            : claimed((blocks + 63) / 64), entry_links(inode_count + 1),
+              link_counts(inode_count + 1, 0), in_use(inode_count + 1, 0),
+              inodes(0), dirs(0), failed(false) {
+            memset(counts, 0, sizeof(counts));
+        }
+        
+        // Record a problem; past EXT2_CHECK_KEPT of a kind only the count grows
+        void report(int kind, uint64_t key, const string& text) {
+            lock_guard<mutex> guard(lock);
+            if (counts[kind]++ < EXT2_CHECK_KEPT) {
+                CheckProblem problem = { kind, key, text };
+                problems.push_back(problem);
+            }
+        }
+    };
+    
+    // Whether a group holds a copy of the superblock and descriptor table
+    bool groupHasSuper(uint32_t group) const {
+        if (group <= 1 || !(superblock.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER)) {
+            return true;
+        }
+        for (uint32_t base : { 3u, 5u, 7u }) {
+            uint64_t power = base;
+            while (power < group) {
+                power *= base;
+            }
+            if (power == group) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Claim count blocks starting at block for owner; blocks claimed
+    // before are reported as duplicates
+    void claimBlocks(CheckState& state, uint32_t block, uint32_t count, const string& owner) {
+        if (block < superblock.s_first_data_block || block >= superblock.s_blocks_count ||
+            count > superblock.s_blocks_count - block) {
+            state.report(CHECK_BAD_BLOCK, block, owner + ": block " + to_string(block) +
+                         (count > 1 ? "+" + to_string(count - 1) : "") +
+                         " is outside the file system");
+            return;
+        }
+        
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t bit = block + i - superblock.s_first_data_block;
+            uint64_t mask = 1ULL << (bit % 64);
+            if (state.claimed[bit / 64].fetch_or(mask) & mask) {
+                state.report(CHECK_DUPLICATE, block + i, owner + ": block " +
+                             to_string(block + i) + " is already in use");
+            }
+        }
+    }
+    
+    // Blocks every group reserves for itself: superblock and descriptor
+    // copies (with the blocks reserved for growing the table), bitmaps and
+    // the inode table
+    void claimGroupMetadata(CheckState& state, uint32_t group) {
+        const ext2_group_desc& gd = group_descs[group];
+        string owner = "Group " + to_string(group);
+        
+        if (groupHasSuper(group)) {
+            uint32_t gdt_blocks = (group_count * sizeof(ext2_group_desc) + block_size - 1) / block_size;
+            uint32_t reserved = (superblock.s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INODE)
+                                ? superblock.s_reserved_gdt_blocks : 0;
+            claimBlocks(state, groupFirstBlock(group), 1 + gdt_blocks + reserved, owner + " superblock");
+        }
+        claimBlocks(state, gd.bg_block_bitmap, 1, owner + " block bitmap");
+        claimBlocks(state, gd.bg_inode_bitmap, 1, owner + " inode bitmap");
+        uint32_t table_blocks = ((uint64_t)superblock.s_inodes_per_group * inode_size + block_size - 1) /
+                                block_size;
+        claimBlocks(state, gd.bg_inode_table, table_blocks, owner + " inode table");
+    }
+    
+    // Check one in-use inode: claim its blocks, compare i_blocks with what
+    // it maps, and count the entries of a directory
+    void checkInode(CheckState& state, uint32_t inode_num, const ext2_inode& inode) {
+        string owner = "Inode " + to_string(inode_num);
+        uint16_t type = inode.i_mode & 0xF000;
+        
+        if (inode.i_file_acl != 0) {
+            if (inode.i_file_acl < superblock.s_first_data_block ||
+                inode.i_file_acl >= superblock.s_blocks_count) {
+                state.report(CHECK_BAD_BLOCK, inode.i_file_acl, owner + ": attribute block " +
+                             to_string(inode.i_file_acl) + " is outside the file system");
+            } else {
+                lock_guard<mutex> guard(state.lock);
+                state.xattr_blocks.insert(inode.i_file_acl);
+            }
+        }
+        
+        // The resize inode's tree is the reserved descriptor blocks, which
+        // are claimed as group metadata; only its top block is its own
+        if (inode_num == EXT2_RESIZE_INO &&
+            (superblock.s_feature_compat & EXT2_FEATURE_COMPAT_RESIZE_INODE)) {
+            if (inode.i_block[13] != 0) {
+                claimBlocks(state, inode.i_block[13], 1, owner);
+            }
+            return;
+        }
+        
+        // Devices, FIFOs, sockets and fast symlinks map no blocks
+        uint32_t xattr_sectors = inode.i_file_acl ? block_size / 512 : 0;
+        bool has_blocks = type == EXT2_S_IFREG || type == EXT2_S_IFDIR ||
+                          (type == EXT2_S_IFLNK && inode.i_blocks > xattr_sectors);
+        if (!has_blocks) {
+            return;
+        }
+        
+        vector<BlockRun> runs;
+        vector<uint32_t> indirect;
+        if (!mapInodeBlocks(inode, runs, &indirect)) {
+            state.report(CHECK_BAD_BLOCK, 0, owner + ": block map can't be read");
+            return;
+        }
+        
+        uint64_t mapped = indirect.size();
+        for (uint32_t block : indirect) {
+            claimBlocks(state, block, 1, owner + " (indirect)");
+        }
+        for (const BlockRun& run : runs) {
+            claimBlocks(state, run.physical, run.length, owner);
+            mapped += run.length;
+        }
+        
+        uint64_t expected = mapped * (block_size / 512) + xattr_sectors;
+        if (inode_num >= firstInode() && inode.i_blocks != expected) {
+            state.report(CHECK_BLOCK_COUNT, inode_num, owner + ": i_blocks is " +
+                         to_string(inode.i_blocks) + ", blocks mapped make " + to_string(expected));
+        }
+        
+        if (type == EXT2_S_IFDIR) {
+            DirIterator it(*this, inode_num, inode);
+            DirEntryView entry;
+            while (it.next(entry)) {
+                if (entry.inode > superblock.s_inodes_count) {
+                    state.report(CHECK_LINKS, inode_num, owner + ": entry \"" + entry.nameString() +
+                                 "\" names nonexistent inode " + to_string(entry.inode));
+                } else if (entry.inode != 0) {
+                    state.entry_links[entry.inode]++;
+                }
+            }
+            if (it.failed()) {
+                state.report(CHECK_BAD_BLOCK, 0, owner + ": directory can't be read");
+            }
+        }
+    }
+    
+    // Read one group's whole inode table and check every in-use inode.
+    // In use means what the inode says (a mode, links and no deletion
+    // time); the bitmap is compared against that afterwards.
+    void checkGroupInodes(CheckState& state, uint32_t group) {
+        const ext2_group_desc& gd = group_descs[group];
+        uint32_t per_group = superblock.s_inodes_per_group;
+        uint32_t inodes_per_chunk = max<uint32_t>(1, EXT2_SCAN_CHUNK / inode_size);
+        vector<uint8_t> buffer;
+        uint64_t inodes = 0;
+        
+        for (uint32_t chunk_start = 0; chunk_start < per_group; chunk_start += inodes_per_chunk) {
+            uint32_t chunk_end = min(per_group, chunk_start + inodes_per_chunk);
+            off_t offset = (off_t)gd.bg_inode_table * block_size + (off_t)chunk_start * inode_size;
+            size_t size = (size_t)(chunk_end - chunk_start) * inode_size;
+            const uint8_t* table = viewBytes(offset, size);
+            if (!table) {
+                buffer.resize(size);
+                if (readBytes(buffer.data(), size, offset) != (ssize_t)size) {
+                    state.report(CHECK_BAD_BLOCK, gd.bg_inode_table,
+                                 "Group " + to_string(group) + ": inode table can't be read");
+                    lock_guard<mutex> guard(state.lock);
+                    state.failed = true;
+                    return;
+                }
+                table = buffer.data();
+            }
+            
+            for (uint32_t index = chunk_start; index < chunk_end; index++) {
+                ext2_inode inode;
+                memcpy(&inode, table + (size_t)(index - chunk_start) * inode_size, sizeof(ext2_inode));
+                uint32_t inode_num = group * per_group + index + 1;
+                if (inode.i_mode == 0 || inode.i_links_count == 0 || inode.i_dtime != 0) {
+                    continue;
+                }
+                
+                state.in_use[inode_num] = 1;
+                state.link_counts[inode_num] = inode.i_links_count;
+                if ((inode.i_mode & 0xF000) == EXT2_S_IFDIR) {
+                    state.group_dirs[group]++;
+                }
+                inodes++;
+                checkInode(state, inode_num, inode);
+            }
+        }
+        
+        lock_guard<mutex> guard(state.lock);
+        state.inodes += inodes;
+        state.dirs += state.group_dirs[group];
+    }
+    
+    // 64 claimed bits starting at bit (which need not be word aligned)
+    static uint64_t claimedWord(const CheckState& state, uint64_t bit) {
+        uint64_t word = bit / 64;
+        uint32_t shift = bit % 64;
+        uint64_t value = state.claimed[word].load() >> shift;
+        if (shift != 0 && word + 1 < state.claimed.size()) {
+            value |= state.claimed[word + 1].load() << (64 - shift);
+        }
+        return value;
+    }
+    
+    // Compare one group's bitmaps and counters with what the inodes claim.
+    // Free counts found are added to free_blocks and free_inodes.
+    void checkGroupBitmaps(CheckState& state, uint32_t group,
+                           atomic<uint64_t>& free_blocks, atomic<uint64_t>& free_inodes) {
+        const ext2_group_desc& gd = group_descs[group];
+        string name = "Group " + to_string(group);
+        BlockRef block_bitmap = getBlock(gd.bg_block_bitmap);
+        BlockRef inode_bitmap = getBlock(gd.bg_inode_bitmap);
+        if (!block_bitmap.valid() || !inode_bitmap.valid()) {
+            state.report(CHECK_BAD_BLOCK, gd.bg_block_bitmap, name + ": bitmaps can't be read");
+            return;
+        }
+        
+        // Blocks, a word at a time
+        uint32_t nblocks = groupBlockCount(group);
+        uint64_t first_bit = (uint64_t)group * superblock.s_blocks_per_group;
+        uint32_t used = 0;
+        for (uint32_t bit = 0; bit < nblocks; bit += 64) {
+            uint64_t on_disk = 0;
+            memcpy(&on_disk, block_bitmap.data() + bit / 8, min<uint32_t>(8, (nblocks - bit + 7) / 8));
+            uint64_t claimed = claimedWord(state, first_bit + bit);
+            if (nblocks - bit < 64) {
+                uint64_t mask = (1ULL << (nblocks - bit)) - 1;
+                on_disk &= mask;
+                claimed &= mask;
+            }
+            used += __builtin_popcountll(on_disk);
+            
+            for (uint64_t diff = on_disk ^ claimed; diff; diff &= diff - 1) {
+                uint32_t offset = bit + __builtin_ctzll(diff);
+                uint32_t block = groupFirstBlock(group) + offset;
+                if ((claimed >> (offset - bit)) & 1) {
+                    state.report(CHECK_BLOCK_FREE, block, "Block " + to_string(block) +
+                                 " is in use but marked free");
+                } else {
+                    state.report(CHECK_BLOCK_LEAK, block, "Block " + to_string(block) +
+                                 " is marked in use but nothing uses it");
+                }
+            }
+        }
+        
+        // Inodes; the reserved ones are always marked in use
+        uint32_t per_group = superblock.s_inodes_per_group;
+        uint32_t used_inodes = 0;
+        for (uint32_t index = 0; index < per_group; index++) {
+            uint32_t inode_num = group * per_group + index + 1;
+            bool marked = (inode_bitmap.data()[index / 8] >> (index % 8)) & 1;
+            used_inodes += marked;
+            if (inode_num < firstInode() || marked == (state.in_use[inode_num] != 0)) {
+                continue;
+            }
+            if (marked) {
+                state.report(CHECK_INODE_LEAK, inode_num, "Inode " + to_string(inode_num) +
+                             " is marked in use but is free");
+            } else {
+                state.report(CHECK_INODE_FREE, inode_num, "Inode " + to_string(inode_num) +
+                             " is in use but marked free");
+            }
+        }
+        
+        uint32_t group_free_blocks = nblocks - used;
+        uint32_t group_free_inodes = per_group - used_inodes;
+        if (gd.bg_free_blocks_count != group_free_blocks) {
+            state.report(CHECK_COUNTERS, group, name + ": " + to_string(gd.bg_free_blocks_count) +
+                         " free blocks recorded, bitmap has " + to_string(group_free_blocks));
+        }
+        if (gd.bg_free_inodes_count != group_free_inodes) {
+            state.report(CHECK_COUNTERS, group, name + ": " + to_string(gd.bg_free_inodes_count) +
+                         " free inodes recorded, bitmap has " + to_string(group_free_inodes));
+        }
+        if (gd.bg_used_dirs_count != state.group_dirs[group]) {
+            state.report(CHECK_COUNTERS, group, name + ": " + to_string(gd.bg_used_dirs_count) +
+                         " directories recorded, found " + to_string(state.group_dirs[group]));
+        }
+        free_blocks += group_free_blocks;
+        free_inodes += group_free_inodes;
+    }
+    
+    // ========================================================================
+    // IMAGE DIFF
+    // ========================================================================
+    
+    // What happened to an inode between an older and a newer image
+    enum DiffKind {
+        DIFF_ADDED,             // In use only in the newer image
+        DIFF_REMOVED,           // In use only in the older image
+        DIFF_MODIFIED,          // Contents differ
+        DIFF_METADATA,          // Same contents, other inode fields differ
+        DIFF_KINDS
+    };
+    
+    // One changed inode. Paths are filled in once every group is compared.
+    struct DiffChange {
+        uint32_t inode_num;
+        DiffKind kind;
+        bool is_dir;            // Directory in the image it is named from
+        string path;            // In the newer image (the older for removals)
+        string old_path;        // In the older image, looked up for changes only
+        string fields;          // Metadata fields that differ
+    };
+    
+    // Shared state of one diff; groups are merged in under the lock
+    struct DiffState {
+        mutex lock;
+        vector<DiffChange> changes;
+        uint64_t blocks_allocated;
+        uint64_t blocks_freed;
+        uint64_t table_blocks;          // Inode table blocks with an inode in use
+        uint64_t table_blocks_changed;  // ... whose bytes differ
+        bool failed;
+        
+        DiffState()
+            : blocks_allocated(0), blocks_freed(0), table_blocks(0), table_blocks_changed(0),
+              failed(false) {}
+    };
+    
+    // One group's inode bitmap as words, tail masked off
+    bool groupInodeBits(uint32_t group, vector<uint64_t>& bits) {
+        uint32_t per_group = superblock.s_inodes_per_group;
+        BlockRef bitmap = getBlock(group_descs[group].bg_inode_bitmap);
+        if (!bitmap.valid()) {
+            return false;
+        }
+        bits.assign((per_group + 63) / 64, 0);
+        memcpy(bits.data(), bitmap.data(), min<size_t>((per_group + 7) / 8, block_size));
+        if (per_group % 64) {
+            bits.back() &= (1ULL << (per_group % 64)) - 1;
+        }
+        return true;
+    }
+    
+    // Whether an inode of this image and the same inode of other hold the
+    // same bytes: file data, directory blocks or symlink target. Inodes
+    // without data blocks compare their block pointer area instead.
+    bool sameContentAs(EXT2Parser& other, uint32_t inode_num, const ext2_inode& a,
+                       const ext2_inode& b) {
+        uint64_t size = fileSize(a);
+        if (size != other.fileSize(b)) {
+            return false;
+        }
+        
+        auto has_blocks = [this](const ext2_inode& inode) {
+            uint16_t type = inode.i_mode & 0xF000;
+            uint32_t xattr_sectors = inode.i_file_acl ? block_size / 512 : 0;
+            return type == EXT2_S_IFREG || type == EXT2_S_IFDIR ||
+                   (type == EXT2_S_IFLNK && inode.i_blocks > xattr_sectors);
+        };
+        if (has_blocks(a) != has_blocks(b)) {
+            return false;
+        }
+        if (!has_blocks(a)) {
+            return memcmp(a.i_block, b.i_block, sizeof(a.i_block)) == 0;
+        }
+        
+        const size_t piece = 64 * 1024;
+        vector<uint8_t> data_a(piece), data_b(piece);
+        for (uint64_t offset = 0; offset < size; offset += piece) {
+            ssize_t got_a = readInodeRange(inode_num, a, offset, piece, data_a.data());
+            ssize_t got_b = other.readInodeRange(inode_num, b, offset, piece, data_b.data());
+            if (got_a <= 0 || got_a != got_b || memcmp(data_a.data(), data_b.data(), got_a) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    // Classify an inode in use in both images whose on-disk bytes differ.
+    // Access times are ignored; a new file type or generation number means
+    // the inode was freed and reused, which is a removal plus an addition.
+    void diffInode(EXT2Parser& other, uint32_t inode_num, const uint8_t* before,
+                   const uint8_t* after, vector<DiffChange>& changes) {
+        ext2_inode a, b;
+        memcpy(&a, before, sizeof(a));
+        memcpy(&b, after, sizeof(b));
+        bool a_dir = (a.i_mode & 0xF000) == EXT2_S_IFDIR;
+        bool b_dir = (b.i_mode & 0xF000) == EXT2_S_IFDIR;
+        
+        if ((a.i_mode & 0xF000) != (b.i_mode & 0xF000) || a.i_generation != b.i_generation) {
+            changes.push_back(DiffChange{ inode_num, DIFF_REMOVED, a_dir, "", "", "" });
+            changes.push_back(DiffChange{ inode_num, DIFF_ADDED, b_dir, "", "", "" });
+            return;
+        }
+        
+        string fields;
+        auto differs = [&fields](bool changed, const char* name) {
+            if (changed) {
+                fields += (fields.empty() ? "" : ", ") + string(name);
+            }
+        };
+        differs(a.i_mode != b.i_mode, "mode");
+        differs(a.i_uid != b.i_uid || a.i_gid != b.i_gid, "owner");
+        differs(a.i_links_count != b.i_links_count, "links");
+        differs(a.i_mtime != b.i_mtime, "mtime");
+        differs(a.i_ctime != b.i_ctime, "ctime");
+        differs(a.i_flags != b.i_flags, "flags");
+        differs(a.i_file_acl != b.i_file_acl, "xattr");
+        differs(memcmp(a.i_block, b.i_block, sizeof(a.i_block)) != 0, "blocks");
+        differs(inode_size > sizeof(ext2_inode) &&
+                memcmp(before + sizeof(ext2_inode), after + sizeof(ext2_inode),
+                       inode_size - sizeof(ext2_inode)) != 0, "extra fields");
+        
+        if (!sameContentAs(other, inode_num, a, b)) {
+            changes.push_back(DiffChange{ inode_num, DIFF_MODIFIED, b_dir, "", "", "" });
+        } else if (!fields.empty()) {
+            changes.push_back(DiffChange{ inode_num, DIFF_METADATA, b_dir, "", "", fields });
+        }
+    }
+    
+    // Compare one group of this (older) image with the same group of other.
+    // Block bitmaps are compared whole and only counted through when they
+    // differ. Only inode table blocks holding an inode in use on either
+    // side are read, and only blocks whose bytes differ are examined inode
+    // by inode, so unchanged tables cost one memcmp per block in use.
+    void diffGroup(EXT2Parser& other, DiffState& state, uint32_t group) {
+        const ext2_group_desc& gd = group_descs[group];
+        const ext2_group_desc& other_gd = other.group_descs[group];
+        BlockRef block_bitmap = getBlock(gd.bg_block_bitmap);
+        BlockRef other_block_bitmap = other.getBlock(other_gd.bg_block_bitmap);
+        vector<uint64_t> inodes, other_inodes;
+        if (!block_bitmap.valid() || !other_block_bitmap.valid() ||
+            !groupInodeBits(group, inodes) || !other.groupInodeBits(group, other_inodes)) {
+            cerr << "Error: Failed to read the bitmaps of group " << group << endl;
+            lock_guard<mutex> guard(state.lock);
+            state.failed = true;
+            return;
+        }
+        
+        uint64_t allocated = 0;
+        uint64_t freed = 0;
+        uint32_t nblocks = groupBlockCount(group);
+        if (memcmp(block_bitmap.data(), other_block_bitmap.data(), (nblocks + 7) / 8) != 0) {
+            for (uint32_t bit = 0; bit < nblocks; bit += 64) {
+                uint64_t before = 0;
+                uint64_t after = 0;
+                size_t bytes = min<uint32_t>(8, (nblocks - bit + 7) / 8);
+                memcpy(&before, block_bitmap.data() + bit / 8, bytes);
+                memcpy(&after, other_block_bitmap.data() + bit / 8, bytes);
+                if (nblocks - bit < 64) {
+                    uint64_t mask = (1ULL << (nblocks - bit)) - 1;
+                    before &= mask;
+                    after &= mask;
+                }
+                allocated += __builtin_popcountll(after & ~before);
+                freed += __builtin_popcountll(before & ~after);
+            }
+        }
+        
+        uint32_t per_group = superblock.s_inodes_per_group;
+        uint32_t per_block = block_size / inode_size;
+        uint32_t first_inode = group * per_group + 1;
+        auto in_use = [](const vector<uint64_t>& bits, uint32_t index) {
+            return (bits[index / 64] >> (index % 64)) & 1;
+        };
+        
+        vector<DiffChange> changes;
+        uint64_t table_blocks = 0;
+        uint64_t changed_blocks = 0;
+        bool failed = false;
+        for (uint32_t start = 0; start < per_group && !failed; start += per_block) {
+            uint32_t end = min(per_group, start + per_block);
+            bool used = false;
+            for (uint32_t index = start; index < end && !used; index++) {
+                used = in_use(inodes, index) || in_use(other_inodes, index);
+            }
+            if (!used) {
+                continue;
+            }
+            table_blocks++;
+            
+            BlockRef block = getBlock(gd.bg_inode_table + start / per_block);
+            BlockRef other_block = other.getBlock(other_gd.bg_inode_table + start / per_block);
+            if (!block.valid() || !other_block.valid()) {
+                cerr << "Error: Failed to read the inode table of group " << group << endl;
+                failed = true;
+                break;
+            }
+            if (memcmp(block.data(), other_block.data(), block_size) == 0) {
+                continue;
+            }
+            changed_blocks++;
+            
+            for (uint32_t index = start; index < end; index++) {
+                uint32_t inode_num = first_inode + index;
+                bool before = in_use(inodes, index);
+                bool after = in_use(other_inodes, index);
+                if ((!before && !after) || (inode_num < firstInode() && inode_num != EXT2_ROOT_INO)) {
+                    continue;
+                }
+                
+                const uint8_t* old_bytes = block.data() + (size_t)(index - start) * inode_size;
+                const uint8_t* new_bytes = other_block.data() + (size_t)(index - start) * inode_size;
+                if (before && after) {
+                    if (memcmp(old_bytes, new_bytes, inode_size) != 0) {
+                        diffInode(other, inode_num, old_bytes, new_bytes, changes);
+                    }
+                } else {
+                    const ext2_inode* inode = (const ext2_inode*)(after ? new_bytes : old_bytes);
+                    bool is_dir = (inode->i_mode & 0xF000) == EXT2_S_IFDIR;
+                    changes.push_back(DiffChange{ inode_num, after ? DIFF_ADDED : DIFF_REMOVED,
+                                                  is_dir, "", "", "" });
+                }
+            }
+        }
+        
+        lock_guard<mutex> guard(state.lock);
+        state.changes.insert(state.changes.end(), changes.begin(), changes.end());
+        state.blocks_allocated += allocated;
+        state.blocks_freed += freed;
+        state.table_blocks += table_blocks;
+        state.table_blocks_changed += changed_blocks;
+        state.failed = state.failed || failed;
+    }
+    
+    // Path of a directory, found by climbing ".." entries and looking each
+    // directory up in its parent. Memoized in paths; empty if the chain of
+    // parents is broken.
+    string directoryPath(uint32_t inode_num, unordered_map<uint32_t, string>& paths,
+                         uint32_t depth = 0) {
+        if (inode_num == EXT2_ROOT_INO) {
+            return "/";
+        }
+        auto known = paths.find(inode_num);
+        if (known != paths.end()) {
+            return known->second;
+        }
+        
+        ext2_inode inode;
+        uint32_t parent = 0;
+        DirEntryView entry;
+        if (depth < EXT2_DIFF_MAX_DEPTH && readInode(inode_num, inode)) {
+            DirIterator entries(*this, inode_num, inode);
+            while (entries.next(entry)) {
+                if (entry.name_len == 2 && memcmp(entry.name, "..", 2) == 0) {
+                    parent = entry.inode;
+                    break;
+                }
+            }
+        }
+        
+        string path;
+        ext2_inode parent_inode;
+        string parent_path = parent != 0 && parent != inode_num ?
+                             directoryPath(parent, paths, depth + 1) : "";
+        if (!parent_path.empty() && readInode(parent, parent_inode)) {
+            DirIterator entries(*this, parent, parent_inode);
+            while (entries.next(entry)) {
+                string name(entry.name, entry.name_len);
+                if (entry.inode == inode_num && name != "." && name != "..") {
+                    path = (parent_path == "/" ? "" : parent_path) + "/" + name;
+                    break;
+                }
+            }
+        }
+        paths[inode_num] = path;
+        return path;
+    }
+    
+    // Fill in names (inode -> path) for inodes of this image that still
+    // have none. Directories are named by climbing their ".." chain; other
+    // inodes from the entries of the listed directories, which are the
+    // ones that changed and so the ones an added, removed or renamed name
+    // must be in. With walk set, whatever is left is found by a tree walk.
+    void nameInodes(unordered_map<uint32_t, string>& names, const vector<uint32_t>& dirs,
+                    bool walk) {
+        unordered_map<uint32_t, string> dir_paths;
+        for (auto& name : names) {
+            ext2_inode inode;
+            if (readInode(name.first, inode) && (inode.i_mode & 0xF000) == EXT2_S_IFDIR) {
+                name.second = directoryPath(name.first, dir_paths);
+            }
+        }
+        
+        size_t unnamed = 0;
+        for (uint32_t dir : dirs) {
+            string dir_path = directoryPath(dir, dir_paths);
+            ext2_inode inode;
+            if (dir_path.empty() || !readInode(dir, inode)) {
+                continue;
+            }
+            DirIterator entries(*this, dir, inode);
+            DirEntryView entry;
+            while (entries.next(entry)) {
+                auto wanted = names.find(entry.inode);
+                string name(entry.name, entry.name_len);
+                if (wanted == names.end() || name == "." || name == "..") {
+                    continue;
+                }
+                string path = (dir_path == "/" ? "" : dir_path) + "/" + name;
+                if (wanted->second.empty() || path < wanted->second) {
+                    wanted->second = path;
+                }
+            }
+        }
+        for (const auto& name : names) {
+            unnamed += name.second.empty();
+        }
+        if (!walk || unnamed == 0) {
+            return;
+        }
+        
+        // Files changed in place sit in unchanged directories
+        mutex names_lock;
+        WalkVisitor visit = [&](const string& path, uint32_t inode_num, const ext2_inode&) {
+            lock_guard<mutex> guard(names_lock);
+            auto wanted = names.find(inode_num);
+            if (wanted != names.end() && (wanted->second.empty() || path < wanted->second)) {
+                wanted->second = path;
+            }
+        };
+        vector<WalkDir> walked;
+        IOStats::Phase phase(stats, "diff: walk");
+        walkTree("/", visit, walked);
+    }
+    
+    // ========================================================================
+    // PARALLEL TREE WALK
+    // ========================================================================
+    
+    // Directory found by a tree walk. own_bytes is the space allocated to
+    // the directory itself and to every non-directory entry directly in it
+    // (hard-linked files are counted once).
+    struct WalkDir {
+        string path;
+        size_t parent;              // Index of the parent (0 for the root)
+        uint32_t inode;
+        uint64_t own_bytes;
+    };
+    
+    // Called for every inode reached by a walk, from any worker thread
+    typedef function<void(const string& path, uint32_t inode_num,
+                          const ext2_inode& inode)> WalkVisitor;
+    
+    // Shared state of one walk
+    struct WalkState {
+        ThreadPool* pool;
+        const WalkVisitor* visit;
+        mutex lock;                 // Guards everything below
+        vector<WalkDir> dirs;
+        unordered_set<uint32_t> seen_dirs;
+        unordered_set<uint32_t> seen_links;
+        bool failed;
+    };
+    
+    static string joinPath(const string& dir, const DirEntryView& entry) {
+        string path = dir;
+        if (path.empty() || path[path.size() - 1] != '/') {
+            path += '/';
+        }
+        path.append(entry.name, entry.name_len);
+        return path;
+    }
+    
+    // Walk one directory: visit every entry, account for its space and
+    // hand each subdirectory to the pool as a new task
+    void walkDirectory(WalkState& state, size_t dir_index, string dir_path, uint32_t dir_inode_num) {
+        ext2_inode dir_inode;
+        if (!readInode(dir_inode_num, dir_inode)) {
+            lock_guard<mutex> guard(state.lock);
+            state.failed = true;
+            return;
+        }
+        
+        uint64_t own_bytes = (uint64_t)dir_inode.i_blocks * 512;
+        
+        DirIterator it(*this, dir_inode_num, dir_inode);
+        vector<DirEntryView> window;
+        vector<BlockRef> window_blocks;
+        vector<uint32_t> inode_nums;
+        vector<ext2_inode> inodes;
+        vector<bool> loaded;
+        bool more = true;
+        
+        while (more) {
+            window.clear();
+            window_blocks.clear();
+            inode_nums.clear();
+            
+            DirEntryView entry;
+            while (window.size() < EXT2_LIST_BATCH && (more = it.next(entry))) {
+                if (entry.nameEquals(".") || entry.nameEquals("..")) {
+                    continue;
+                }
+                if (window_blocks.empty() ||
+                    window_blocks.back().data() != it.currentBlock().data()) {
+                    window_blocks.push_back(it.currentBlock());
+                }
+                window.push_back(entry);
+                inode_nums.push_back(entry.inode);
+            }
+            
+            readInodes(inode_nums, inodes, loaded);
+            
+            for (size_t i = 0; i < window.size(); i++) {
+                if (!loaded[i]) {
+                    continue;
+                }
+                
+                const ext2_inode& child = inodes[i];
+                string child_path = joinPath(dir_path, window[i]);
+                (*state.visit)(child_path, window[i].inode, child);
+                
+                if ((child.i_mode & 0xF000) == EXT2_S_IFDIR) {
+                    lock_guard<mutex> guard(state.lock);
+                    if (!state.seen_dirs.insert(window[i].inode).second) {
+                        continue;   // Already walked (corrupt image loop)
+                    }
+                    
+                    WalkDir dir = { child_path, dir_index, window[i].inode, 0 };
+                    size_t child_index = state.dirs.size();
+                    state.dirs.push_back(dir);
+                    
+                    uint32_t child_inode = window[i].inode;
+                    state.pool->submit([this, &state, child_index, child_path, child_inode]() {
+                        walkDirectory(state, child_index, child_path, child_inode);
+                    });
+                } else if (child.i_links_count > 1) {
+                    lock_guard<mutex> guard(state.lock);
+                    if (state.seen_links.insert(window[i].inode).second) {
+                        own_bytes += (uint64_t)child.i_blocks * 512;
+                    }
+                } else {
+                    own_bytes += (uint64_t)child.i_blocks * 512;
+                }
+            }
+        }
+        
+        lock_guard<mutex> guard(state.lock);
+        state.dirs[dir_index].own_bytes += own_bytes;
+        if (it.failed()) {
+            state.failed = true;
+        }
+    }
+    
+    // Walk everything below root_path on thread_count workers. The root is
+    // visited too. dirs receives every directory walked, parents before
+    // their children, with dirs[0] the root (empty if root is not a dir).
+    bool walkTree(const string& root_path, const WalkVisitor& visit, vector<WalkDir>& dirs) {
+        dirs.clear();
+        
+        uint32_t root_inode_num;
+        ext2_inode root_inode;
+        if (!resolvePath(root_path, root_inode_num) || !readInode(root_inode_num, root_inode)) {
+            cerr << "Error: File not found: " << root_path << endl;
+            return false;
+        }
+        
+        string path = root_path.empty() ? "/" : root_path;
+        visit(path, root_inode_num, root_inode);
+        if ((root_inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
+            return true;
+        }
+        
+        ThreadPool pool(thread_count);
+        WalkState state;
+        state.pool = &pool;
+        state.visit = &visit;
+        state.failed = false;
+        
+        WalkDir root = { path, 0, root_inode_num, 0 };
+        state.dirs.push_back(root);
+        state.seen_dirs.insert(root_inode_num);
+        
+        pool.submit([this, &state, path, root_inode_num]() {
+            walkDirectory(state, 0, path, root_inode_num);
+        });
+        pool.wait();
+        
+        dirs.swap(state.dirs);
+        return !state.failed;
+    }
+    
+    // Letter used by find -type for an inode mode
+    static char modeTypeLetter(uint16_t mode) {
+        switch (mode & 0xF000) {
+            case EXT2_S_IFREG: return 'f';
+            case EXT2_S_IFDIR: return 'd';
+            case EXT2_S_IFLNK: return 'l';
+            case 0x2000:       return 'c';
+            case 0x6000:       return 'b';
+            case 0x1000:       return 'p';
+            case 0xC000:       return 's';
+        }
+        return '?';
+    }
+    
+    static bool compareFilter(int cmp, int64_t value, int64_t target) {
+        if (cmp < 0) return value < target;
+        if (cmp > 0) return value > target;
+        return value == target;
+    }
+    
+    bool matchesFilter(const FindFilter& filter, const string& path,
+                       const ext2_inode& inode, time_t now) const {
+        if (filter.type && modeTypeLetter(inode.i_mode) != filter.type) {
+            return false;
+        }
+        
+        if (!filter.name_glob.empty()) {
+            string name = path.substr(path.rfind('/') + 1);
+            if (name.empty()) {
+                name = "/";
+            }
+            if (fnmatch(filter.name_glob.c_str(), name.c_str(), 0) != 0) {
+                return false;
+            }
+        }
+        
+        if (filter.has_size &&
+            !compareFilter(filter.size_cmp, fileSize(inode), (int64_t)filter.size)) {
+            return false;
+        }
+        
+        if (filter.has_mtime) {
+            int64_t age_days = ((int64_t)now - (int64_t)inode.i_mtime) / 86400;
+            if (!compareFilter(filter.mtime_cmp, age_days, filter.mtime_days)) {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+public:
+    // ========================================================================
+    // CONSTRUCTOR & INITIALIZATION
+    // ========================================================================
+    
+    EXT2Parser()
+        : use_mmap(true), use_index(true), thread_count(max(1u, thread::hardware_concurrency())),
+          io_depth(EXT2_IO_DEPTH), group_count(0), block_size(1024), inode_size(128),
+          writable(false), metadata_dirty(false) {}
+    
+    // Number of worker threads for parallel walks
+    void setThreads(unsigned int threads) {
+        thread_count = max(1u, threads);
+    }
+    
+    // Number of files kept in flight by bulk extraction
+    void setIODepth(unsigned int depth) {
+        io_depth = max(1u, depth);
+    }
+    
+    // Choose whether open() may map the image (default: yes)
+    void setUseMmap(bool enable) {
+        use_mmap = enable;
+    }
+    
+    // Choose whether open() looks for a metadata index (default: yes)
+    void setUseIndex(bool enable) {
+        use_index = enable;
+    }
+    
+    // Choose whether open() allows writing to the image (default: no)
+    void setWritable(bool enable) {
+        writable = enable;
+    }
+    
+    // Index file to use and build (default: <image>.idx)
+    void setIndexPath(const string& path) {
+        index_path = path;
+    }
+    
+    // Block cache capacity in blocks (0 disables caching)
+    void setCacheSize(size_t blocks) {
+        cache.setCapacity(blocks);
+    }
+    
+    // Print block cache counters
+    void showCacheStats() const {
+        uint64_t lookups = cache.getHits() + cache.getMisses();
+        cerr << "Block cache: " << cache.getHits() << " hits, "
+             << cache.getMisses() << " misses";
+        if (lookups > 0) {
+            cerr << " (" << fixed << setprecision(1)
+                 << 100.0 * cache.getHits() / lookups << "% hit rate)";
+        }
+        cerr << ", " << cache.getReadaheadBlocks() << " blocks read ahead, capacity "
+             << cache.getCapacity() << " blocks" << endl;
+        if (image && image->view(0, block_size)) {
+            cerr << "  (image is mapped; blocks are served from the mapping, not the cache)" << endl;
+        }
+    }
+    
+    // Start recording I/O counters and timings (call before open())
+    void enableStats() {
+        stats.enable();
+    }
+    
+    // Counters, for phase timers around whole commands
+    IOStats& getStats() {
+        return stats;
+    }
+    
+    // Print what --stats recorded
+    void printStats(ostream& out, bool json) const {
+        stats.print(out, json, backendName(), cache.getHits(), cache.getMisses(),
+                    cache.getReadaheadBlocks());
+    }
+    
+    // Name of the backend serving reads ("mmap" or "fd")
+    const char* backendName() const {
+        return image ? image->name() : "none";
+    }
+    
+    // Open and initialize EXT2 image
+    bool open(const string& image_path) {
+        // Open image file read-only unless writing was asked for
+        int fd = ::open(image_path.c_str(), writable ? O_RDWR : O_RDONLY);
+        if (fd < 0) {
+            cerr << "Error: Cannot open image file: " << image_path << endl;
+            return false;
+        }
+        
+        // Packed images always go through their chunk cache. Otherwise
+        // prefer a mapping, falling back to plain reads for images that
+        // can't be mapped (pipes, character devices, empty files, ...)
+        if (CompressedBackend::isPacked(fd)) {
+            if (writable) {
+                cerr << "Error: Packed images are read-only: " << image_path << endl;
+                close(fd);
+                return false;
+            }
+            CompressedBackend* packed = CompressedBackend::create(fd);
+            if (!packed) {
+                close(fd);
+                return false;
+            }
+            image.reset(packed);
+        } else {
+            MmapBackend* mapped = use_mmap ? MmapBackend::create(fd) : nullptr;
+            if (mapped) {
+                image.reset(mapped);
+            } else {
+                image.reset(new FdBackend(fd));
+            }
+        }
+        image->setStats(&stats);
+        
+        // Read superblock
+        if (!readSuperblock()) {
+            image.reset();
+            return false;
+        }
+        
+        // Read group descriptor table
+        if (!readGroupDescriptors()) {
+            image.reset();
+            return false;
+        }
+        resetAllocator();
+        
+        // Pick up the metadata index if there is one; a stale index is
+        // ignored and lookups fall back to reading directories
+        if (index_path.empty()) {
+            index_path = image_path + EXT2_INDEX_SUFFIX;
+        }
+        if (use_index && !writable) {
+            string reason;
+            if (!index.load(index_path, superblock, block_size, reason) && !reason.empty()) {
+                cerr << "Warning: Ignoring index " << index_path << ": " << reason << endl;
+            }
+        }
+        
+        return true;
+    }
+    
+    // ========================================================================
+    // LIBRARY INTERFACE
+    // ========================================================================
+    // Quiet building blocks for programs that embed the parser (the commands
+    // below print their results instead)
+    
+    // Resolve a path to an inode number
+    bool lookupPath(const string& path, uint32_t& inode_num) {
+        return resolvePath(path, inode_num);
+    }
+    
+    // Read an inode by number
+    bool getInode(uint32_t inode_num, ext2_inode& inode) {
+        return readInode(inode_num, inode);
+    }
+    
+    // Size of an inode's data in bytes, including the large_file high half
+    uint64_t getFileSize(const ext2_inode& inode) const {
+        return fileSize(inode);
+    }
+    
+    // Call visit for each entry of a directory, in on-disk order; stops
+    // early when visit returns false. The entry's name is only valid
+    // during the call.
+    bool forEachEntry(uint32_t dir_inode_num, const function<bool(const DirEntryView&)>& visit) {
+        ext2_inode inode;
+        if (!readInode(dir_inode_num, inode) || (inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
+            return false;
+        }
+        
+        DirIterator it(*this, dir_inode_num, inode);
+        DirEntryView entry;
+        while (it.next(entry)) {
+            if (!visit(entry)) {
+                break;
+            }
+        }
+        return !it.failed();
+    }
+    
+    // Extract the file behind an inode to a host path
+    bool extractFile(uint32_t inode_num, const string& dest_path, uint64_t& written) {
+        ext2_inode inode;
+        if (!readInode(inode_num, inode)) {
+            return false;
+        }
+        return extractInode(inode_num, inode, dest_path, 0644, written);
+    }
+    
+    // Forget everything cached in memory: blocks, run lists and names
+    void dropCaches() {
+        cache.clear();
+        dcache.clear();
+        lock_guard<mutex> guard(run_cache_lock);
+        run_cache.clear();
+    }
+    
+    uint32_t getBlockSize() const { return block_size; }
+    
+    // ========================================================================
+    // FILE SYSTEM OPERATIONS
+    // ========================================================================
+    
+    // List directory contents (ls command)
+    void listDirectory(const string& path = "/", ostream& out = cout, ostream& err = cerr) {
+        if (index.loaded()) {
+            listIndexedDirectory(path, out, err);
+            return;
+        }
+        
+        uint32_t dir_inode_num;
+        if (!resolvePath(path, dir_inode_num)) {
+            err << "Error: Directory not found: " << path << endl;
+            return;
+        }
+        
+        ext2_inode inode;
+        if (!readInode(dir_inode_num, inode)) {
+            err << "Error: Failed to read directory inode" << endl;
+            return;
+        }
+        
+        // Check if it's a directory
+        if ((inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
+            err << "Error: Inode is not a directory" << endl;
+            return;
+        }
+        
+        // Display entries
+        printListingHeader(out, path, dir_inode_num);
+        
+        // Walk the entries in place, fetching inodes for a window of
+        // entries at a time; the window's blocks are held so the names
+        // stay valid until they are printed
+        DirIterator it(*this, dir_inode_num, inode);
+        vector<DirEntryView> window;
+        vector<BlockRef> window_blocks;
+        vector<uint32_t> inode_nums;
+        vector<ext2_inode> inodes;
+        vector<bool> loaded;
+        uint64_t total = 0;
+        bool more = true;
+        
+        while (more) {
+            window.clear();
+            window_blocks.clear();
+            inode_nums.clear();
+            
+            DirEntryView entry;
+            while (window.size() < EXT2_LIST_BATCH && (more = it.next(entry))) {
+                if (window_blocks.empty() ||
+                    window_blocks.back().data() != it.currentBlock().data()) {
+                    window_blocks.push_back(it.currentBlock());
+                }
+                window.push_back(entry);
+                inode_nums.push_back(entry.inode);
+            }
+            
+            // Fetch all entry inodes in inode-table order
+            readInodes(inode_nums, inodes, loaded);
+            
+            for (size_t i = 0; i < window.size(); i++) {
+                uint64_t size = loaded[i] ? fileSize(inodes[i]) : 0;
+                printListingLine(out, window[i], loaded[i] ? &size : nullptr);
+            }
+            total += window.size();
+        }
+        
+        if (it.failed()) {
+            err << "Error: Failed to read directory data" << endl;
+        }
+        
+        printListingFooter(out, total);
+    }
+    
+    // Copy file from image to host (cp command)
+    bool copyFileOut(const string& filename, const string& dest_path = "",
+                     ostream& out = cout, ostream& err = cerr) {
+        // Resolve the path from the root directory
+        uint32_t file_inode_num;
+        if (!resolvePath(filename, file_inode_num)) {
+            err << "Error: File not found: " << filename << endl;
+            return false;
+        }
+        
+        // Read file inode
+        ext2_inode file_inode;
+        if (!readInode(file_inode_num, file_inode)) {
+            err << "Error: Failed to read file inode" << endl;
+            return false;
+        }
+        
+        // Check if it's a regular file
+        if ((file_inode.i_mode & 0xF000) != EXT2_S_IFREG) {
+            err << "Error: Not a regular file" << endl;
+            return false;
+        }
+        
+        // Determine output path (default: last path component)
+        string output_path = dest_path.empty() ? filename.substr(filename.rfind('/') + 1)
+                                               : dest_path;
+        
+        // Write to host file system
+        uint64_t written = 0;
+        if (!extractInode(file_inode_num, file_inode, output_path, 0644, written)) {
+            return false;
+        }
+        
+        out << "Successfully copied: " << filename << " -> " << output_path << endl;
+        out << "Size: " << written << " bytes" << endl;
+        
+        return true;
+    }
+    
+    // Copy a whole directory tree out of the image (cp -r). The tree is
+    // walked first and host directories created; then files are extracted
+    // by io_depth concurrent tasks, each streaming one file in order.
+    bool copyTreeOut(const string& src_path, const string& dest_path,
+                     ostream& out = cout, ostream& err = cerr) {
+        struct Item {
+            string path;
+            uint32_t inode_num;
+            ext2_inode inode;
+        };
+        
+        mutex items_lock;
+        vector<Item> items;
+        WalkVisitor visit = [&](const string& path, uint32_t inode_num, const ext2_inode& inode) {
+            Item item = { path, inode_num, inode };
+            lock_guard<mutex> guard(items_lock);
+            items.push_back(item);
+        };
+        
+        vector<WalkDir> dirs;
+        bool ok;
+        {
+            IOStats::Phase phase(stats, "cp -r: walk");
+            ok = walkTree(src_path, visit, dirs);
+        }
+        if (items.empty()) {
+            return false;
+        }
+        
+        // Host path = destination + path below the source root. The root
+        // keeps however the caller spelled it ("/dir", "/dir/"), so the
+        // separator is added here rather than taken from the image path.
+        string root = items[0].path;
+        auto hostPath = [&](const string& path) {
+            size_t start = root.size();
+            while (start < path.size() && path[start] == '/') {
+                start++;
+            }
+            return start < path.size() ? dest_path + "/" + path.substr(start) : dest_path;
+        };
+        
+        // Directories first (parents sort before children)
+        sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+            return a.path < b.path;
+        });
+        
+        BulkCopyStats copy_stats;
+        for (const Item& item : items) {
+            if ((item.inode.i_mode & 0xF000) == EXT2_S_IFDIR) {
+                extractOne(item.inode_num, item.inode, hostPath(item.path), copy_stats);
+            }
+        }
+        
+        {
+            IOStats::Phase phase(stats, "cp -r: extract");
+            ThreadPool pool(io_depth);
+            for (const Item& item : items) {
+                if ((item.inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
+                    const Item* current = &item;
+                    string output = hostPath(item.path);
+                    pool.submit([this, current, output, &copy_stats]() {
+                        extractOne(current->inode_num, current->inode, output, copy_stats);
+                    });
+                }
+            }
+            pool.wait();
+        }
+        
+        reportBulkCopy(copy_stats, dest_path, out, err);
+        return ok && copy_stats.failed == 0;
+    }
+    
+    // Copy a list of paths (one per line, e.g. from stdin) into dest_dir,
+    // keeping each file's path below the image root. Lookups and copies
+    // run as io_depth concurrent tasks.
+    bool copyListOut(istream& paths, const string& dest_dir,
+                     ostream& out = cout, ostream& err = cerr) {
+        BulkCopyStats copy_stats;
+        mutex err_lock;             // Tasks share the error stream
+        
+        {
+            ThreadPool pool(io_depth);
+            string path;
+            while (getline(paths, path)) {
+                if (path.empty()) {
+                    continue;
+                }
+                
+                pool.submit([this, path, dest_dir, &copy_stats, &err, &err_lock]() {
+                    // Resolve and place the canonical path, so "." and ".."
+                    // can't lead the output outside dest_dir
+                    string canonical = MetadataIndex::normalizePath(path);
+                    uint32_t inode_num;
+                    ext2_inode inode;
+                    if (!resolvePath(canonical, inode_num) || !readInode(inode_num, inode)) {
+                        lock_guard<mutex> guard(err_lock);
+                        err << "Error: File not found: " << path << endl;
+                        copy_stats.failed++;
+                        return;
+                    }
+                    
+                    string output = dest_dir + canonical;
+                    string parent = output.substr(0, output.rfind('/'));
+                    if (!parent.empty() && !makeHostDirs(parent)) {
+                        lock_guard<mutex> guard(err_lock);
+                        err << "Error: Failed to copy " << path << endl;
+                        copy_stats.failed++;
+                        return;
+                    }
+                    extractOne(inode_num, inode, output, copy_stats);
+                });
+            }
+            pool.wait();
+        }
+        
+        reportBulkCopy(copy_stats, dest_dir, out, err);
+        return copy_stats.failed == 0;
+    }
+    
+    // Copy host files and directories into the image (cp-in command). With
+    // several sources, or when dest is an existing directory, each source
+    // is created inside dest under its own name; otherwise the one source
+    // is created as dest. Each file's blocks are allocated as one extent
+    // when a group has room for it. The image must have been opened with
+    // setWritable(true).
+    bool importFiles(const vector<string>& sources, const string& dest,
+                     ostream& out = cout, ostream& err = cerr) {
+        if (!writable || !image || image->rawFd() < 0) {
+            err << "Error: Image is not open for writing" << endl;
+            return false;
+        }
+        
+        // Where each source goes: (parent directory, name)
+        uint32_t dest_num;
+        ext2_inode dest_inode;
+        bool into_dir = resolvePath(dest, dest_num) && readInode(dest_num, dest_inode) &&
+                        (dest_inode.i_mode & 0xF000) == EXT2_S_IFDIR;
+        string dest_path = dest.empty() || dest[0] != '/' ? "/" + dest : dest;
+        while (dest_path.size() > 1 && dest_path[dest_path.size() - 1] == '/') {
+            dest_path.erase(dest_path.size() - 1);
+        }
+        string target_name;
+        if (!into_dir) {
+            if (sources.size() > 1) {
+                err << "Error: Not a directory: " << dest << endl;
+                return false;
+            }
+            size_t slash = dest_path.rfind('/');
+            string parent_path = dest_path.substr(0, slash);
+            target_name = dest_path.substr(slash + 1);
+            if (!resolvePath(parent_path, dest_num) || !readInode(dest_num, dest_inode) ||
+                (dest_inode.i_mode & 0xF000) != EXT2_S_IFDIR) {
+                err << "Error: Directory not found: " << (parent_path.empty() ? "/" : parent_path) << endl;
+                return false;
+            }
+        }
+        
+        ImportStats import_stats;
+        memset(&import_stats, 0, sizeof(import_stats));
+        auto start = chrono::steady_clock::now();
+        bool ok = true;
+        for (const string& source : sources) {
+            string name = target_name;
+            if (into_dir) {
+                string trimmed = source;
+                while (trimmed.size() > 1 && trimmed[trimmed.size() - 1] == '/') {
+                    trimmed.erase(trimmed.size() - 1);
+                }
+                name = trimmed.substr(trimmed.rfind('/') + 1);
+            }
+            string image_path = (dest_path == "/" ? "" : dest_path) + (into_dir ? "/" + name : "");
+            if (!importPath(source, dest_num, name, image_path, import_stats, err)) {
+                ok = false;
+                break;
+            }
+        }
+        
+        // Whatever was allocated goes to disk, even after a failure
+        {
+            IOStats::Phase phase(stats, "cp-in: flush");
+            if (!flushAllocations()) {
+                err << "Error: Failed to write back allocation state" << endl;
+                ok = false;
+            }
+        }
+        dropCaches();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        out << "\n========================================" << endl;
+        out << "IMPORT: " << dest_path << endl;
+        out << "========================================" << endl;
+        out << "Files: " << import_stats.files << " (" << import_stats.bytes << " bytes), "
+            << import_stats.dirs << " directories, " << import_stats.links << " symlinks" << endl;
+        out << "Blocks allocated: " << import_stats.blocks << " (" << import_stats.contiguous
+            << " of " << import_stats.files << " files in one extent)" << endl;
+        if (import_stats.skipped > 0) {
+            out << "Skipped: " << import_stats.skipped << " special files" << endl;
+        }
+        out << "Free: " << superblock.s_free_blocks_count << " blocks, "
+            << superblock.s_free_inodes_count << " inodes" << endl;
+        out << "Time: " << fixed << setprecision(2) << seconds << " s" << endl;
+        out << "========================================\n" << endl;
+        
+        if (import_stats.failed > 0) {
+            err << "Error: " << import_stats.failed << " entries could not be imported" << endl;
+        }
+        return ok && import_stats.failed == 0;
+    }
+
+    // Recursively list paths below a directory that match a filter
+    // (find command). Output is sorted by path.
+    bool findFiles(const string& root_path, const FindFilter& filter, ostream& out = cout) {
+        time_t now = time(nullptr);
+        mutex matches_lock;
+        vector<string> matches;
+        
+        WalkVisitor visit = [&](const string& path, uint32_t, const ext2_inode& inode) {
+            if (matchesFilter(filter, path, inode, now)) {
+                lock_guard<mutex> guard(matches_lock);
+                matches.push_back(path);
+            }
+        };
+        
+        vector<WalkDir> dirs;
+        bool ok = walkTree(root_path, visit, dirs);
+        
+        sort(matches.begin(), matches.end());
+        for (const string& path : matches) {
+            out << path << "\n";
+        }
+        out.flush();
+        
+        return ok;
+    }
+    
+    // Space used by each directory subtree below a path, in KB of allocated
+    // blocks (du command). With summary_only just the total is printed.
+    bool diskUsage(const string& root_path, bool summary_only, ostream& out = cout) {
+        WalkVisitor visit = [](const string&, uint32_t, const ext2_inode&) {};
+        
+        vector<WalkDir> dirs;
+        bool ok = walkTree(root_path, visit, dirs);
+        if (dirs.empty()) {
+            return ok;
+        }
+        
+        // Children always come after their parent, so one backwards pass
+        // rolls every subtree up into its parent
+        vector<uint64_t> totals(dirs.size());
+        for (size_t i = 0; i < dirs.size(); i++) {
+            totals[i] = dirs[i].own_bytes;
+        }
+        for (size_t i = dirs.size() - 1; i > 0; i--) {
+            totals[dirs[i].parent] += totals[i];
+        }
+        
+        vector<size_t> order;
+        if (summary_only) {
+            order.push_back(0);
+        } else {
+            for (size_t i = 0; i < dirs.size(); i++) {
+                order.push_back(i);
+            }
+            sort(order.begin(), order.end(), [&dirs](size_t a, size_t b) {
+                return dirs[a].path < dirs[b].path;
+            });
+        }
+        
+        for (size_t i : order) {
+            out << (totals[i] + 1023) / 1024 << "\t" << dirs[i].path << "\n";
+        }
+        out.flush();
+        
+        return ok;
+    }
+    
+    // Content manifest of every regular file below a path (manifest
+    // command): one "crc32c size inode path" line per path, sorted, then
+    // the groups of distinct inodes with identical content. Each inode is
+    // hashed once, however many names it has, by thread_count workers
+    // streaming straight from the block maps; hash matches are confirmed
+    // byte by byte before being reported as duplicates.
+    bool writeManifest(const string& root_path, ostream& out = cout, ostream& err = cerr) {
+        struct Item {
+            string path;
+            uint32_t inode_num;
+        };
+        struct Content {
+            ext2_inode inode;
+            uint32_t crc;
+            bool ok;
+        };
+        
+        mutex items_lock;
+        vector<Item> items;
+        unordered_map<uint32_t, Content> contents;
+        WalkVisitor visit = [&](const string& path, uint32_t inode_num, const ext2_inode& inode) {
+            if ((inode.i_mode & 0xF000) != EXT2_S_IFREG) {
+                return;
+            }
+            Item item = { path, inode_num };
+            Content content = { inode, 0, false };
+            lock_guard<mutex> guard(items_lock);
+            items.push_back(item);
+            contents.insert(make_pair(inode_num, content));
+        };
+        
+        vector<WalkDir> dirs;
+        bool ok;
+        {
+            IOStats::Phase phase(stats, "manifest: walk");
+            ok = walkTree(root_path, visit, dirs);
+        }
+        if (!ok && items.empty()) {
+            return false;
+        }
+        
+        // Hash every inode once; the map itself is not modified from here on
+        auto start = chrono::steady_clock::now();
+        atomic<uint64_t> hashed_bytes(0);
+        {
+            IOStats::Phase phase(stats, "manifest: hash");
+            ThreadPool pool(thread_count);
+            for (auto& entry : contents) {
+                uint32_t inode_num = entry.first;
+                Content* content = &entry.second;
+                pool.submit([this, inode_num, content, &hashed_bytes]() {
+                    vector<uint8_t> chunk;
+                    uint64_t bytes_read = 0;
+                    content->ok = hashInodeData(inode_num, content->inode, content->crc,
+                                                bytes_read, chunk);
+                    hashed_bytes += bytes_read;
+                });
+            }
+            pool.wait();
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+            return a.path < b.path;
+        });
+        
+        uint32_t failed = 0;
+        out << "crc32c\tsize\tinode\tpath\n";
+        for (const Item& item : items) {
+            const Content& content = contents[item.inode_num];
+            if (!content.ok) {
+                err << "Error: Failed to read " << item.path << endl;
+                failed++;
+                continue;
+            }
+            char line[64];
+            snprintf(line, sizeof(line), "%08x\t%llu\t%u\t", content.crc,
+                     (unsigned long long)fileSize(content.inode), item.inode_num);
+            out << line << item.path << "\n";
+        }
+        
+        // Candidate duplicates share size and hash; split each candidate
+        // group into classes of truly identical inodes
+        map<pair<uint64_t, uint32_t>, vector<uint32_t>> by_hash;
+        for (const auto& entry : contents) {
+            uint64_t size = fileSize(entry.second.inode);
+            if (entry.second.ok && size > 0) {
+                by_hash[make_pair(size, entry.second.crc)].push_back(entry.first);
+            }
+        }
+        
+        vector<vector<uint32_t>> groups;
+        for (auto& candidates : by_hash) {
+            vector<uint32_t>& inodes = candidates.second;
+            sort(inodes.begin(), inodes.end());
+            vector<vector<uint32_t>> classes;
+            for (uint32_t inode_num : inodes) {
+                bool placed = false;
+                for (vector<uint32_t>& group : classes) {
+                    if (sameInodeData(group[0], contents[group[0]].inode,
+                                      inode_num, contents[inode_num].inode)) {
+                        group.push_back(inode_num);
+                        placed = true;
+                        break;
+                    }
+                }
+                if (!placed) {
+                    classes.push_back(vector<uint32_t>(1, inode_num));
+                }
+            }
+            for (vector<uint32_t>& group : classes) {
+                if (group.size() > 1) {
+                    groups.push_back(group);
+                }
+            }
+        }
+        
+        // Paths of each inode, in path order
+        unordered_map<uint32_t, vector<string>> paths;
+        for (const Item& item : items) {
+            paths[item.inode_num].push_back(item.path);
+        }
+        
+        uint64_t redundant = 0;
+        out << "\n========================================" << endl;
+        out << "MANIFEST: " << (root_path.empty() ? "/" : root_path) << endl;
+        out << "========================================" << endl;
+        out << "Files: " << items.size() << " paths, " << contents.size() << " inodes" << endl;
+        out << "Hashed: " << hashed_bytes / 1024 << " KB in " << fixed << setprecision(2)
+            << seconds << " s";
+        if (seconds > 0) {
+            out << " (" << setprecision(1) << hashed_bytes / (1024.0 * 1024.0) / seconds << " MB/s)";
+        }
+        out << endl;
+        out << "Duplicate groups: " << groups.size() << endl;
+        for (const vector<uint32_t>& group : groups) {
+            const Content& content = contents[group[0]];
+            uint64_t size = fileSize(content.inode);
+            redundant += size * (group.size() - 1);
+            out << "----------------------------------------" << endl;
+            char line[64];
+            snprintf(line, sizeof(line), "%llu bytes, crc32c %08x:", (unsigned long long)size,
+                     content.crc);
+            out << line << endl;
+            for (uint32_t inode_num : group) {
+                for (const string& path : paths[inode_num]) {
+                    out << "  " << path << " (inode " << inode_num << ")" << endl;
+                }
+            }
+        }
+        if (!groups.empty()) {
+            out << "----------------------------------------" << endl;
+        }
+        out << "Redundant data: " << redundant / 1024 << " KB" << endl;
+        out << "========================================\n" << endl;
+        
+        return ok && failed == 0;
+    }
+    
+    // Every occurrence of a literal byte string in the regular files below
+    // a path (grep command), printed as "path:offset" sorted by path and
+    // offset. Each inode is searched once, however many names it has, by
+    // thread_count workers streaming straight from the block maps. Returns
+    // false when a file could not be read or nothing matched, as grep does.
+    bool grepFiles(const string& pattern, const string& root_path, ostream& out = cout,
+                   ostream& err = cerr) {
+        struct Item {
+            string path;
+            uint32_t inode_num;
+        };
+        struct Content {
+            ext2_inode inode;
+            vector<uint64_t> matches;
+            bool ok;
+        };
+        
+        if (pattern.empty()) {
+            err << "Error: Empty search pattern" << endl;
+            return false;
+        }
+        
+        mutex items_lock;
+        vector<Item> items;
+        unordered_map<uint32_t, Content> contents;
+        WalkVisitor visit = [&](const string& path, uint32_t inode_num, const ext2_inode& inode) {
+            if ((inode.i_mode & 0xF000) != EXT2_S_IFREG || fileSize(inode) < pattern.size()) {
+                return;
+            }
+            Item item = { path, inode_num };
+            Content content = { inode, vector<uint64_t>(), false };
+            lock_guard<mutex> guard(items_lock);
+            items.push_back(item);
+            contents.insert(make_pair(inode_num, content));
+        };
+        
+        vector<WalkDir> dirs;
+        bool ok;
+        {
+            IOStats::Phase phase(stats, "grep: walk");
+            ok = walkTree(root_path, visit, dirs);
+        }
+        if (!ok && items.empty()) {
+            return false;
+        }
+        
+        // Search every inode once; the map itself is not modified from here on
+        {
+            IOStats::Phase phase(stats, "grep: search");
+            ThreadPool pool(thread_count);
+            for (auto& entry : contents) {
+                uint32_t inode_num = entry.first;
+                Content* content = &entry.second;
+                pool.submit([this, inode_num, content, &pattern]() {
+                    LiteralMatcher matcher(pattern);
+                    vector<uint8_t> chunk;
+                    content->ok = searchInodeData(inode_num, content->inode, matcher,
+                                                  content->matches, chunk);
+                });
+            }
+            pool.wait();
+        }
+        
+        sort(items.begin(), items.end(), [](const Item& a, const Item& b) {
+            return a.path < b.path;
+        });
+        
+        uint32_t failed = 0;
+        uint64_t found = 0;
+        for (const Item& item : items) {
+            const Content& content = contents[item.inode_num];
+            if (!content.ok) {
+                err << "Error: Failed to read " << item.path << endl;
+                failed++;
+                continue;
+            }
+            for (uint64_t offset : content.matches) {
+                out << item.path << ":" << offset << "\n";
+            }
+            found += content.matches.size();
+        }
+        out.flush();
+        
+        return ok && failed == 0 && found > 0;
+    }
+    
+    // Space and fragmentation report computed from the bitmaps themselves
+    // (fsstats command): true free/used counts against the stored counters,
+    // a histogram of free extent sizes, the largest free run, and extents
+    // per file from the block maps of every in-use inode.
+    bool showFsStats(ostream& out = cout) {
+        bool ok = true;
+        uint64_t used_blocks = 0, used_inodes = 0;
+        FreeRunScanner free_runs;
+        vector<uint64_t> words;
+        
+        for (uint32_t g = 0; g < group_count; g++) {
+            const ext2_group_desc& gd = group_descs[g];
+            uint32_t nblocks = groupBlockCount(g);
+            uint32_t ninodes = superblock.s_inodes_per_group;
+            
+            BlockRef block_bitmap = getBlock(gd.bg_block_bitmap);
+            BlockRef inode_bitmap = getBlock(gd.bg_inode_bitmap);
+            if (!block_bitmap.valid() || !inode_bitmap.valid()) {
+                ok = false;
+                continue;
+            }
+            
+            // Block bitmap: used count over the group's real blocks only
+            words.assign((nblocks + 63) / 64, 0);
+            memcpy(words.data(), block_bitmap.data(), min<size_t>((nblocks + 7) / 8, block_size));
+            if (nblocks % 64) {
+                words.back() &= (1ULL << (nblocks % 64)) - 1;
+            }
+            used_blocks += popcountWords(words.data(), words.size());
+            free_runs.scan(words.data(), nblocks, groupFirstBlock(g));
+            
+            words.assign((ninodes + 63) / 64, 0);
+            memcpy(words.data(), inode_bitmap.data(), min<size_t>((ninodes + 7) / 8, block_size));
+            if (ninodes % 64) {
+                words.back() &= (1ULL << (ninodes % 64)) - 1;
+            }
+            used_inodes += popcountWords(words.data(), words.size());
+        }
+        free_runs.endRun();
+        
+        // Extents per file, one task per group
+        mutex frag_lock;
+        vector<uint64_t> extent_hist(64, 0);
+        uint64_t files = 0, fragmented = 0, total_extents = 0;
+        vector<pair<uint64_t, uint32_t>> worst;     // (extents, inode)
+        
+        {
+            ThreadPool pool(thread_count);
+            for (uint32_t g = 0; g < group_count; g++) {
+                pool.submit([&, g]() {
+                    vector<uint64_t> local_hist(64, 0);
+                    vector<pair<uint64_t, uint32_t>> local_worst;
+                    uint64_t local_files = 0, local_frag = 0, local_extents = 0;
+                    vector<BlockRun> runs;
+                    vector<uint32_t> indirect;
+                    
+                    InodeVisitor visit = [&](uint32_t inode_num, const ext2_inode& inode) {
+                        uint16_t type = inode.i_mode & 0xF000;
+                        if (inode.i_links_count == 0 || inode.i_blocks == 0 ||
+                            (type != EXT2_S_IFREG && type != EXT2_S_IFDIR) ||
+                            (inode_num < firstInode() && inode_num != EXT2_ROOT_INO)) {
+                            return;
+                        }
+                        if (!mapInodeBlocks(inode, runs, &indirect) || runs.empty()) {
+                            return;
+                        }
+                        
+                        // A new extent starts where the next run doesn't
+                        // follow on disk. Gaps filled only by the file's
+                        // own indirect blocks, and runs that continue
+                        // physically across a hole, don't count.
+                        sort(indirect.begin(), indirect.end());
+                        uint64_t extents = 1;
+                        for (size_t i = 1; i < runs.size(); i++) {
+                            uint32_t prev_end = runs[i - 1].physical + runs[i - 1].length;
+                            uint32_t next = runs[i].physical;
+                            if (next < prev_end) {
+                                extents++;
+                                continue;
+                            }
+                            size_t meta = lower_bound(indirect.begin(), indirect.end(), next) -
+                                          lower_bound(indirect.begin(), indirect.end(), prev_end);
+                            if (meta != next - prev_end) {
+                                extents++;
+                            }
+                        }
+                        
+                        local_files++;
+                        local_extents += extents;
+                        local_hist[63 - __builtin_clzll(extents)]++;
+                        if (extents > 1) {
+                            local_frag++;
+                            local_worst.push_back(make_pair(extents, inode_num));
+                        }
+                    };
+                    
+                    bool scanned = scanGroupInodes(g, visit);
+                    
+                    lock_guard<mutex> guard(frag_lock);
+                    ok = ok && scanned;
+                    files += local_files;
+                    fragmented += local_frag;
+                    total_extents += local_extents;
+                    for (size_t b = 0; b < 64; b++) {
+                        extent_hist[b] += local_hist[b];
+                    }
+                    worst.insert(worst.end(), local_worst.begin(), local_worst.end());
+                });
+            }
+            pool.wait();
+        }
+        
+        uint64_t free_blocks = superblock.s_blocks_count - superblock.s_first_data_block - used_blocks;
+        uint64_t free_inodes = superblock.s_inodes_count - used_inodes;
+        
+        out << "\n========================================" << endl;
+        out << "EXT2 SPACE AND FRAGMENTATION STATISTICS" << endl;
+        out << "========================================" << endl;
+        out << "Used Blocks: " << used_blocks << endl;
+        out << "Free Blocks: " << free_blocks
+             << " (superblock says " << superblock.s_free_blocks_count << ")" << endl;
+        out << "Used Inodes: " << used_inodes << endl;
+        out << "Free Inodes: " << free_inodes
+             << " (superblock says " << superblock.s_free_inodes_count << ")" << endl;
+        out << "Largest Free Run: " << free_runs.largest << " blocks";
+        if (free_runs.largest > 0) {
+            out << " starting at block " << free_runs.largest_start;
+        }
+        out << endl;
+        
+        out << "\nFree Extent Sizes (blocks):" << endl;
+        for (size_t b = 0; b < 64; b++) {
+            if (free_runs.histogram[b] == 0) continue;
+            string range = to_string(1ULL << b) + "-" + to_string((2ULL << b) - 1);
+            out << "  " << left << setw(22) << range << free_runs.histogram[b] << endl;
+        }
+        
+        out << "\nFile Fragmentation:" << endl;
+        out << "Files With Data: " << files << endl;
+        out << "Non-contiguous Files: " << fragmented;
+        if (files > 0) {
+            out << " (" << fixed << setprecision(1) << 100.0 * fragmented / files << "%)";
+        }
+        out << endl;
+        if (files > 0) {
+            out << "Average Extents Per File: " << fixed << setprecision(2)
+                 << (double)total_extents / files << endl;
+        }
+        out << "Extents Per File:" << endl;
+        for (size_t b = 0; b < 64; b++) {
+            if (extent_hist[b] == 0) continue;
+            string range = b == 0 ? "1" : to_string(1ULL << b) + "-" + to_string((2ULL << b) - 1);
+            out << "  " << left << setw(22) << range << extent_hist[b] << endl;
+        }
+        
+        if (!worst.empty()) {
+            size_t shown = min<size_t>(10, worst.size());
+            partial_sort(worst.begin(), worst.begin() + shown, worst.end(),
+                         greater<pair<uint64_t, uint32_t>>());
+            out << "Most Fragmented (inode: extents):" << endl;
+            for (size_t i = 0; i < shown; i++) {
+                out << "  " << worst[i].second << ": " << worst[i].first << endl;
+            }
+        }
+        out << "========================================\n" << endl;
+        
+        return ok;
+    }
+    
+    // Cross-check the allocation state (check command): the blocks and
+    // inodes in use against the bitmaps, the free and directory counters of
+    // every group and of the superblock, and every link count against the
+    // directory entries naming the inode. Returns false on any difference.
+    bool checkFileSystem(ostream& out = cout, ostream& err = cerr) {
+        static const char* const kind_names[CHECK_KINDS] = {
+            "Bad block references", "Blocks claimed twice", "Blocks in use but marked free",
+            "Leaked blocks", "Inodes in use but marked free", "Leaked inodes",
+            "Link counts", "Block counts", "Counters"
+        };
+        
+        auto start = chrono::steady_clock::now();
+        CheckState state(superblock.s_blocks_count - superblock.s_first_data_block,
+                         superblock.s_inodes_count);
+        state.group_dirs.assign(group_count, 0);
+        
+        for (uint32_t group = 0; group < group_count; group++) {
+            claimGroupMetadata(state, group);
+        }
+        {
+            IOStats::Phase phase(stats, "check: inodes");
+            ThreadPool pool(thread_count);
+            for (uint32_t group = 0; group < group_count; group++) {
+                pool.submit([this, &state, group]() { checkGroupInodes(state, group); });
+            }
+            pool.wait();
+        }
+        
+        // Attribute blocks may be shared, so each is claimed once
+        vector<uint32_t> xattr_blocks(state.xattr_blocks.begin(), state.xattr_blocks.end());
+        sort(xattr_blocks.begin(), xattr_blocks.end());
+        for (uint32_t block : xattr_blocks) {
+            claimBlocks(state, block, 1, "Attribute block");
+        }
+        
+        for (uint32_t inode_num = 1; inode_num <= superblock.s_inodes_count; inode_num++) {
+            uint32_t entries = state.entry_links[inode_num];
+            if (!state.in_use[inode_num]) {
+                if (entries > 0) {
+                    state.report(CHECK_LINKS, inode_num, "Inode " + to_string(inode_num) +
+                                 " is free but named by " + to_string(entries) + " directory entries");
+                }
+            } else if ((inode_num >= firstInode() || inode_num == EXT2_ROOT_INO) &&
+                       entries != state.link_counts[inode_num]) {
+                state.report(CHECK_LINKS, inode_num, "Inode " + to_string(inode_num) +
+                             ": link count is " + to_string(state.link_counts[inode_num]) +
+                             ", directory entries make " + to_string(entries));
+            }
+        }
+        
+        atomic<uint64_t> free_blocks(0);
+        atomic<uint64_t> free_inodes(0);
+        {
+            IOStats::Phase phase(stats, "check: bitmaps");
+            ThreadPool pool(thread_count);
+            for (uint32_t group = 0; group < group_count; group++) {
+                pool.submit([this, &state, group, &free_blocks, &free_inodes]() {
+                    checkGroupBitmaps(state, group, free_blocks, free_inodes);
+                });
+            }
+            pool.wait();
+        }
+        if (superblock.s_free_blocks_count != free_blocks) {
+            state.report(CHECK_COUNTERS, group_count, "Superblock: " +
+                         to_string(superblock.s_free_blocks_count) + " free blocks recorded, bitmaps have " +
+                         to_string(free_blocks));
+        }
+        if (superblock.s_free_inodes_count != free_inodes) {
+            state.report(CHECK_COUNTERS, group_count, "Superblock: " +
+                         to_string(superblock.s_free_inodes_count) + " free inodes recorded, bitmaps have " +
+                         to_string(free_inodes));
+        }
+        
+        uint64_t claimed = 0;
+        for (const atomic<uint64_t>& word : state.claimed) {
+            claimed += __builtin_popcountll(word.load());
+        }
+        sort(state.problems.begin(), state.problems.end(),
+             [](const CheckProblem& a, const CheckProblem& b) {
+                 return a.kind != b.kind ? a.kind < b.kind : a.key < b.key;
+             });
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        uint64_t total = 0;
+        out << "\n========================================" << endl;
+        out << "CONSISTENCY CHECK" << endl;
+        out << "========================================" << endl;
+        out << "Inodes in use: " << state.inodes << " (" << state.dirs << " directories)" << endl;
+        out << "Blocks in use: " << claimed << " of "
+            << superblock.s_blocks_count - superblock.s_first_data_block << endl;
+        size_t next = 0;
+        for (int kind = 0; kind < CHECK_KINDS; kind++) {
+            total += state.counts[kind];
+            if (state.counts[kind] == 0) {
+                continue;
+            }
+            out << kind_names[kind] << ": " << state.counts[kind] << endl;
+            uint64_t shown = 0;
+            for (; next < state.problems.size() && state.problems[next].kind == kind; next++) {
+                if (shown++ < EXT2_CHECK_REPORT) {
+                    out << "  " << state.problems[next].text << endl;
+                }
+            }
+            if (state.counts[kind] > EXT2_CHECK_REPORT) {
+                out << "  ... " << state.counts[kind] - EXT2_CHECK_REPORT << " more" << endl;
+            }
+        }
+        out << "----------------------------------------" << endl;
+        out << (total == 0 ? "File system is consistent" : to_string(total) + " problems found") << endl;
+        out << "Time: " << fixed << setprecision(2) << seconds << " s" << endl;
+        out << "========================================\n" << endl;
+        
+        if (total > 0 || state.failed) {
+            err << "Error: File system check found " << total << " problems" << endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // Changes from this image to a newer image of the same file system
+    // (diff command), by path: inodes added, removed, modified (contents
+    // differ) and changed in metadata only. Groups are compared on
+    // thread_count workers a bitmap and an inode table block at a time,
+    // and only changed inodes are resolved to paths, so the cost follows
+    // the amount of change rather than the size of the images. Returns
+    // false when the images differ or can't be compared, as diff does.
+    bool diffImage(const string& other_path, ostream& out = cout, ostream& err = cerr) {
+        static const char* const kind_names[DIFF_KINDS] = {
+            "added", "removed", "modified", "metadata"
+        };
+        
+        EXT2Parser other;
+        other.setUseMmap(use_mmap);
+        other.setThreads(thread_count);
+        other.setUseIndex(false);
+        if (!other.open(other_path)) {
+            err << "Error: Failed to open EXT2 image: " << other_path << endl;
+            return false;
+        }
+        if (block_size != other.block_size || inode_size != other.inode_size ||
+            superblock.s_blocks_count != other.superblock.s_blocks_count ||
+            superblock.s_inodes_per_group != other.superblock.s_inodes_per_group ||
+            superblock.s_blocks_per_group != other.superblock.s_blocks_per_group) {
+            err << "Error: " << other_path << " has a different layout; diff compares two "
+                << "images of one file system" << endl;
+            return false;
+        }
+        
+        auto start = chrono::steady_clock::now();
+        DiffState state;
+        {
+            IOStats::Phase phase(stats, "diff: tables");
+            ThreadPool pool(thread_count);
+            for (uint32_t group = 0; group < group_count; group++) {
+                pool.submit([this, &other, &state, group]() { diffGroup(other, state, group); });
+            }
+            pool.wait();
+        }
+        
+        // New paths come from the newer image, removed ones from the older.
+        // Changed inodes are also looked up in the directories that changed
+        // in the older image, which is where a rename left its old name.
+        unordered_map<uint32_t, string> new_names, removed_names, old_names;
+        vector<uint32_t> new_dirs, old_dirs;
+        for (const DiffChange& change : state.changes) {
+            if (change.kind == DIFF_REMOVED) {
+                removed_names[change.inode_num];
+            } else {
+                new_names[change.inode_num];
+            }
+            if (change.kind == DIFF_MODIFIED || change.kind == DIFF_METADATA) {
+                old_names[change.inode_num];
+            }
+            if (change.is_dir && change.kind != DIFF_METADATA) {
+                if (change.kind != DIFF_REMOVED) {
+                    new_dirs.push_back(change.inode_num);
+                }
+                if (change.kind != DIFF_ADDED) {
+                    old_dirs.push_back(change.inode_num);
+                }
+            }
+        }
+        {
+            IOStats::Phase phase(stats, "diff: names");
+            other.nameInodes(new_names, new_dirs, true);
+            nameInodes(removed_names, old_dirs, true);
+            nameInodes(old_names, old_dirs, false);
+        }
+        
+        uint64_t counts[DIFF_KINDS] = {};
+        for (DiffChange& change : state.changes) {
+            change.path = change.kind == DIFF_REMOVED ? removed_names[change.inode_num]
+                                                      : new_names[change.inode_num];
+            if (change.path.empty()) {
+                change.path = "[inode " + to_string(change.inode_num) + "]";
+            }
+            const string& old_path = old_names[change.inode_num];
+            if (change.kind != DIFF_ADDED && !old_path.empty() && old_path != change.path) {
+                change.old_path = old_path;
+            }
+            counts[change.kind]++;
+        }
+        sort(state.changes.begin(), state.changes.end(),
+             [](const DiffChange& a, const DiffChange& b) {
+                 return a.path != b.path ? a.path < b.path : a.kind < b.kind;
+             });
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        out << "\n========================================" << endl;
+        out << "IMAGE DIFF: " << other_path << endl;
+        out << "========================================" << endl;
+        for (const DiffChange& change : state.changes) {
+            out << left << setw(10) << kind_names[change.kind] << right << change.path;
+            if (change.is_dir && change.path != "/") {
+                out << "/";
+            }
+            if (!change.old_path.empty()) {
+                out << " (was " << change.old_path << ")";
+            }
+            if (change.kind == DIFF_METADATA) {
+                out << ": " << change.fields;
+            }
+            out << endl;
+        }
+        if (!state.changes.empty()) {
+            out << "----------------------------------------" << endl;
+        }
+        out << "Added: " << counts[DIFF_ADDED] << ", removed: " << counts[DIFF_REMOVED]
+            << ", modified: " << counts[DIFF_MODIFIED] << ", metadata only: "
+            << counts[DIFF_METADATA] << endl;
+        out << "Blocks: " << state.blocks_allocated << " allocated, " << state.blocks_freed
+            << " freed" << endl;
+        out << "Inode table blocks in use: " << state.table_blocks << ", "
+            << state.table_blocks_changed << " changed" << endl;
+        out << "Time: " << fixed << setprecision(2) << seconds << " s" << endl;
+        out << "========================================\n" << endl;
+        
+        return !state.failed && state.changes.empty();
+    }
+    
+    // Dump every in-use inode as tab-separated values, one group after
+    // another in inode-table order (scan-inodes command)
+    bool scanInodes(ostream& out = cout) {
+        out << "inode\tmode\tsize\tlinks\tatime\tctime\tmtime\tblocks\n";
+        
+        string text;
+        bool ok = true;
+        for (uint32_t g = 0; g < group_count; g++) {
+            text.clear();
+            InodeVisitor visit = [this, &text](uint32_t inode_num, const ext2_inode& inode) {
+                char line[160];
+                int len = snprintf(line, sizeof(line), "%u\t%06o\t%llu\t%u\t%u\t%u\t%u\t%u\n",
+                                   inode_num, inode.i_mode, (unsigned long long)fileSize(inode),
+                                   inode.i_links_count,
+                                   inode.i_atime, inode.i_ctime, inode.i_mtime, inode.i_blocks);
+                text.append(line, len);
+            };
+            
+            if (!scanGroupInodes(g, visit)) {
+                ok = false;
+            }
+            out << text;
+        }
+        out.flush();
+        
+        return ok;
+    }
+    
+    // Show inode metadata for a path (stat command)
+    bool statPath(const string& path, ostream& out = cout, ostream& err = cerr) {
+        uint32_t inode_num;
+        if (!resolvePath(path, inode_num)) {
+            err << "Error: File not found: " << path << endl;
+            return false;
+        }
+        
+        ext2_inode inode;
+        if (!readInode(inode_num, inode)) {
+            err << "Error: Failed to read inode " << inode_num << endl;
+            return false;
+        }
+        
+        shared_ptr<const vector<BlockRun>> runs = getBlockMap(inode_num, inode);
+        
+        out << "\n========================================" << endl;
+        out << "File: " << path << endl;
+        out << "========================================" << endl;
+        out << "Inode: " << inode_num << endl;
+        out << "Type: " << modeTypeName(inode.i_mode) << endl;
+        out << "Mode: 0" << oct << (inode.i_mode & 07777) << dec << endl;
+        out << "UID/GID: " << inode.i_uid << "/" << inode.i_gid << endl;
+        out << "Size: " << fileSize(inode) << " bytes" << endl;
+        out << "Links: " << inode.i_links_count << endl;
+        out << "Blocks (512-byte): " << inode.i_blocks << endl;
+        if (runs) {
+            out << "Extents: " << runs->size() << endl;
+        }
+        out << "Access Time: " << formatTime(inode.i_atime) << endl;
+        out << "Change Time: " << formatTime(inode.i_ctime) << endl;
+        out << "Modify Time: " << formatTime(inode.i_mtime) << endl;
+        out << "========================================\n" << endl;
+        
+        return true;
+    }
+    
+    // Build the metadata index for this image (index command). The tree is
+    // walked breadth first so each directory's entries land in one
+    // contiguous range of nodes; the file is written beside the target and
+    // renamed into place.
+    bool buildIndex(const string& output_path, ostream& out = cout, ostream& err = cerr) {
+        string path = output_path.empty() ? index_path : output_path;
+        
+        vector<ext2_index_node> nodes;
+        vector<uint32_t> hashes;        // Path hash of each node
+        vector<bool> hashed;            // False for "." and ".." entries
+        string names;
+        vector<ext2_index_inode> inode_list;
+        vector<BlockRun> all_runs;
+        unordered_set<uint32_t> mapped;         // Inodes whose runs are stored
+        unordered_set<uint32_t> walked_dirs;    // Guards against directory loops
+        
+        // Run lists are kept for files and directories, once per inode
+        auto addRuns = [&](uint32_t inode_num, const ext2_inode& inode) {
+            uint16_t type = inode.i_mode & 0xF000;
+            if ((type != EXT2_S_IFREG && type != EXT2_S_IFDIR) || !mapped.insert(inode_num).second) {
+                return;
+            }
+            vector<BlockRun> runs;
+            if (!mapInodeBlocks(inode, runs)) {
+                return;
+            }
+            ext2_index_inode entry = { inode_num, (uint32_t)all_runs.size(), (uint32_t)runs.size() };
+            inode_list.push_back(entry);
+            all_runs.insert(all_runs.end(), runs.begin(), runs.end());
+        };
+        
+        ext2_inode root;
+        if (!readInode(EXT2_ROOT_INO, root)) {
+            err << "Error: Failed to read root inode" << endl;
+            return false;
+        }
+        
+        ext2_index_node root_node;
+        memset(&root_node, 0, sizeof(root_node));
+        root_node.inode = EXT2_ROOT_INO;
+        root_node.mode = root.i_mode;
+        root_node.size = fileSize(root);
+        root_node.mtime = root.i_mtime;
+        root_node.file_type = EXT2_FT_DIR;
+        nodes.push_back(root_node);
+        hashes.push_back(MetadataIndex::rootHash());
+        hashed.push_back(true);
+        addRuns(EXT2_ROOT_INO, root);
+        
+        vector<uint32_t> inode_nums;
+        vector<ext2_inode> inodes;
+        vector<bool> loaded;
+        
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if ((nodes[i].mode & 0xF000) != EXT2_S_IFDIR || !hashed[i] ||
+                !walked_dirs.insert(nodes[i].inode).second) {
+                continue;
+            }
+            
+            ext2_inode dir_inode;
+            if (!readInode(nodes[i].inode, dir_inode)) {
+                err << "Warning: Failed to read directory inode " << nodes[i].inode << endl;
+                continue;
+            }
+            
+            // Names are copied out as they are read, so no blocks need holding
+            uint32_t first = nodes.size();
+            uint32_t dir_hash = MetadataIndex::extendHash(hashes[i], "/", 1);
+            inode_nums.clear();
+            
+            DirIterator it(*this, nodes[i].inode, dir_inode);
+            DirEntryView entry;
+            while (it.next(entry)) {
+                bool dot = entry.nameEquals(".") || entry.nameEquals("..");
+                
+                ext2_index_node child;
+                memset(&child, 0, sizeof(child));
+                child.inode = entry.inode;
+                child.parent = i;
+                child.name_offset = names.size();
+                child.name_len = entry.name_len;
+                child.file_type = entry.file_type;
+                names.append(entry.name, entry.name_len);
+                
+                nodes.push_back(child);
+                hashes.push_back(dot ? 0 : MetadataIndex::extendHash(dir_hash, entry.name, entry.name_len));
+                hashed.push_back(!dot);
+                inode_nums.push_back(entry.inode);
+            }
+            if (it.failed()) {
+                err << "Warning: Failed to read directory inode " << nodes[i].inode << endl;
+            }
+            
+            nodes[i].first_child = first;
+            nodes[i].child_count = nodes.size() - first;
+            
+            // Fill in sizes and modes in inode-table order
+            readInodes(inode_nums, inodes, loaded);
+            for (size_t j = 0; j < inode_nums.size(); j++) {
+                if (!loaded[j]) {
+                    continue;
+                }
+                ext2_index_node& child = nodes[first + j];
+                child.mode = inodes[j].i_mode;
+                child.size = fileSize(inodes[j]);
+                child.mtime = inodes[j].i_mtime;
+                if (hashed[first + j]) {
+                    addRuns(inode_nums[j], inodes[j]);
+                }
+            }
+            
+            if (names.size() > 0xFFFFFFFFull) {
+                err << "Error: Name table too large for an index" << endl;
+                return false;
+            }
+        }
+        
+        // Path hash table, at most half full
+        uint32_t bucket_count = 16;
+        while (bucket_count < 2 * nodes.size()) {
+            bucket_count *= 2;
+        }
+        vector<uint32_t> buckets(bucket_count, 0);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (!hashed[i]) {
+                continue;
+            }
+            uint32_t slot = hashes[i] & (bucket_count - 1);
+            while (buckets[slot] != 0) {
+                slot = (slot + 1) & (bucket_count - 1);
+            }
+            buckets[slot] = i + 1;
+        }
+        
+        sort(inode_list.begin(), inode_list.end(),
+             [](const ext2_index_inode& a, const ext2_index_inode& b) {
+                 return a.inode < b.inode;
+             });
+        
+        // Lay out the sections, each 8-byte aligned
+        ext2_index_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, EXT2_INDEX_MAGIC, sizeof(header.magic));
+        header.version = EXT2_INDEX_VERSION;
+        header.block_size = block_size;
+        memcpy(header.uuid, superblock.s_uuid, sizeof(header.uuid));
+        header.wtime = superblock.s_wtime;
+        header.mnt_count = superblock.s_mnt_count;
+        header.free_blocks = superblock.s_free_blocks_count;
+        header.free_inodes = superblock.s_free_inodes_count;
+        header.node_count = nodes.size();
+        header.bucket_count = bucket_count;
+        header.inode_count = inode_list.size();
+        header.run_count = all_runs.size();
+        
+        auto align = [](uint64_t offset) { return (offset + 7) & ~7ull; };
+        header.nodes_offset = align(sizeof(header));
+        header.buckets_offset = align(header.nodes_offset + nodes.size() * sizeof(ext2_index_node));
+        header.inodes_offset = align(header.buckets_offset + buckets.size() * sizeof(uint32_t));
+        header.runs_offset = align(header.inodes_offset + inode_list.size() * sizeof(ext2_index_inode));
+        header.names_offset = align(header.runs_offset + all_runs.size() * sizeof(BlockRun));
+        header.names_size = names.size();
+        
+        struct Section {
+            uint64_t offset;
+            const void* data;
+            size_t size;
+        };
+        Section sections[] = {
+            { 0, &header, sizeof(header) },
+            { header.nodes_offset, nodes.data(), nodes.size() * sizeof(ext2_index_node) },
+            { header.buckets_offset, buckets.data(), buckets.size() * sizeof(uint32_t) },
+            { header.inodes_offset, inode_list.data(), inode_list.size() * sizeof(ext2_index_inode) },
+            { header.runs_offset, all_runs.data(), all_runs.size() * sizeof(BlockRun) },
+            { header.names_offset, names.data(), names.size() },
+        };
+        
+        string temp_path = path + ".tmp";
+        int out_fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            err << "Error: Cannot create index file: " << temp_path << endl;
+            return false;
+        }
+        
+        bool ok = true;
+        for (const Section& section : sections) {
+            if (section.size > 0 &&
+                !writeAll(out_fd, (const uint8_t*)section.data, section.size, section.offset, true)) {
+                ok = false;
+                break;
+            }
+        }
+        ok = close(out_fd) == 0 && ok;
+        if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+            err << "Error: Failed to write index file: " << path << endl;
+            unlink(temp_path.c_str());
+            return false;
+        }
+        
+        uint64_t file_size = header.names_offset + names.size();
+        out << "\n========================================" << endl;
+        out << "METADATA INDEX: " << path << endl;
+        out << "========================================" << endl;
+        out << "Entries: " << nodes.size() << endl;
+        out << "Run lists: " << inode_list.size() << " inodes, " << all_runs.size() << " runs" << endl;
+        out << "Index size: " << file_size << " bytes" << endl;
+        out << "========================================\n" << endl;
+        
+        return true;
+    }
+
+    // Write the image as a packed image (pack command). Chunks of
+    // EXT2_PACK_CHUNK bytes are compressed independently with zlib by
+    // thread_count workers, a batch at a time, and written in order.
+    // All-zero chunks are only flagged in the chunk table, and chunks zlib
+    // can't shrink are stored as they are. Only the file system's own
+    // blocks are packed.
+    bool packImage(const string& output_path, ostream& out = cout, ostream& err = cerr) {
+        ext2_pack_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, EXT2_PACK_MAGIC, sizeof(header.magic));
+        header.version = EXT2_PACK_VERSION;
+        header.chunk_size = EXT2_PACK_CHUNK;
+        header.image_size = (uint64_t)superblock.s_blocks_count * block_size;
+        header.chunk_count = (header.image_size + EXT2_PACK_CHUNK - 1) / EXT2_PACK_CHUNK;
+        
+        string temp_path = output_path + ".tmp";
+        int out_fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            err << "Error: Cannot create packed image: " << temp_path << endl;
+            return false;
+        }
+        
+        auto start = chrono::steady_clock::now();
+        vector<ext2_pack_chunk> table(header.chunk_count);
+        vector<PackChunk> batch(max(1u, thread_count) * 4);
+        uint64_t offset = sizeof(header);
+        uint64_t zero_chunks = 0;
+        uint64_t stored_chunks = 0;
+        bool ok = true;
+        {
+            IOStats::Phase phase(stats, "pack: compress");
+            ThreadPool pool(thread_count);
+            for (uint64_t first = 0; ok && first < header.chunk_count; first += batch.size()) {
+                uint64_t count = min<uint64_t>(batch.size(), header.chunk_count - first);
+                for (uint64_t i = 0; i < count; i++) {
+                    PackChunk* chunk = &batch[i];
+                    uint64_t chunk_offset = (first + i) * EXT2_PACK_CHUNK;
+                    size_t length = min<uint64_t>(EXT2_PACK_CHUNK, header.image_size - chunk_offset);
+                    pool.submit([this, chunk, chunk_offset, length]() {
+                        packChunk(*chunk, chunk_offset, length);
+                    });
+                }
+                pool.wait();
+                
+                for (uint64_t i = 0; i < count; i++) {
+                    PackChunk& chunk = batch[i];
+                    if (!chunk.ok) {
+                        err << "Error: Failed to read image at offset "
+                            << (first + i) * EXT2_PACK_CHUNK << endl;
+                        ok = false;
+                        break;
+                    }
+                    
+                    ext2_pack_chunk& entry = table[first + i];
+                    entry.offset = offset;
+                    entry.length = chunk.stored.size();
+                    entry.flags = chunk.flags;
+                    zero_chunks += (chunk.flags & EXT2_PACK_ZERO) != 0;
+                    stored_chunks += (chunk.flags & EXT2_PACK_STORED) != 0;
+                    
+                    if (!chunk.stored.empty() &&
+                        !writeAll(out_fd, chunk.stored.data(), chunk.stored.size(), offset, true)) {
+                        err << "Error: Failed to write packed image: " << temp_path << endl;
+                        ok = false;
+                        break;
+                    }
+                    offset += chunk.stored.size();
+                }
+            }
+        }
+        
+        header.table_offset = offset;
+        ok = ok &&
+             writeAll(out_fd, (const uint8_t*)table.data(), table.size() * sizeof(ext2_pack_chunk),
+                      offset, true) &&
+             writeAll(out_fd, (const uint8_t*)&header, sizeof(header), 0, true);
+        ok = close(out_fd) == 0 && ok;
+        if (!ok || rename(temp_path.c_str(), output_path.c_str()) != 0) {
+            err << "Error: Failed to write packed image: " << output_path << endl;
+            unlink(temp_path.c_str());
+            return false;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        uint64_t file_size = offset + table.size() * sizeof(ext2_pack_chunk);
+        out << "\n========================================" << endl;
+        out << "PACKED IMAGE: " << output_path << endl;
+        out << "========================================" << endl;
+        out << "Image: " << header.image_size / 1024 << " KB in " << header.chunk_count
+            << " chunks of " << EXT2_PACK_CHUNK / 1024 << " KB" << endl;
+        out << "Zero chunks: " << zero_chunks << ", stored uncompressed: " << stored_chunks << endl;
+        out << "Packed size: " << file_size / 1024 << " KB (" << fixed << setprecision(1)
+            << (file_size > 0 ? (double)header.image_size / file_size : 0.0) << ":1)" << endl;
+        out << "Time: " << setprecision(2) << seconds << " s" << endl;
+        out << "========================================\n" << endl;
+        
+        return true;
+    }
+    
+    // Show file system information
+    void showInfo(ostream& out = cout) {
+        out << "\n========================================" << endl;
+        out << "EXT2 FILE SYSTEM INFORMATION" << endl;
+        out << "========================================" << endl;
+        out << "Magic Number: 0x" << hex << superblock.s_magic << dec << endl;
+        out << "Block Size: " << block_size << " bytes" << endl;
+        out << "Inode Size: " << inode_size << " bytes" << endl;
+        out << "Total Blocks: " << superblock.s_blocks_count << endl;
+        out << "Free Blocks: " << superblock.s_free_blocks_count << endl;
+        out << "Total Inodes: " << superblock.s_inodes_count << endl;
+        out << "Free Inodes: " << superblock.s_free_inodes_count << endl;
+        out << "Blocks Per Group: " << superblock.s_blocks_per_group << endl;
+        out << "Inodes Per Group: " << superblock.s_inodes_per_group << endl;
+        out << "First Data Block: " << superblock.s_first_data_block << endl;
+        
+        if (superblock.s_volume_name[0] != '\0') {
+            out << "Volume Name: " << superblock.s_volume_name << endl;
+        }
+        out << "Image Backend: " << backendName() << endl;
+        
+        out << "Block Groups: " << group_count << endl;
+        
+        out << "\nGroup Descriptors:" << endl;
+        out << left << setw(7) << "Group"
+             << setw(20) << "Blocks"
+             << setw(10) << "BBitmap"
+             << setw(10) << "IBitmap"
+             << setw(10) << "ITable"
+             << setw(12) << "FreeBlocks"
+             << setw(12) << "FreeInodes"
+             << "Dirs" << endl;
+        out << "----------------------------------------" << endl;
+        
+        uint64_t free_blocks = 0, free_inodes = 0, used_dirs = 0;
+        for (uint32_t g = 0; g < group_count; g++) {
+            const ext2_group_desc& gd = group_descs[g];
+            uint32_t first = groupFirstBlock(g);
+            string range = to_string(first) + "-" + to_string(first + groupBlockCount(g) - 1);
+            
+            out << left << setw(7) << g
+                 << setw(20) << range
+                 << setw(10) << gd.bg_block_bitmap
+                 << setw(10) << gd.bg_inode_bitmap
+                 << setw(10) << gd.bg_inode_table
+                 << setw(12) << gd.bg_free_blocks_count
+                 << setw(12) << gd.bg_free_inodes_count
+                 << gd.bg_used_dirs_count << endl;
+            
+            free_blocks += gd.bg_free_blocks_count;
+            free_inodes += gd.bg_free_inodes_count;
+            used_dirs += gd.bg_used_dirs_count;
+        }
+        
+        out << "----------------------------------------" << endl;
+        out << "Group totals: " << free_blocks << " free blocks, "
+             << free_inodes << " free inodes, " << used_dirs << " directories" << endl;
+        out << "========================================\n" << endl;
+    }
+};
+
+}  // namespace ext2
+
+#endif  // EXT2_PARSER_H